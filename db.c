@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,6 +9,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
 
 typedef struct {
   char* buffer;
@@ -19,6 +22,10 @@ typedef enum {
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
   EXECUTE_KEY_NOT_FOUND,
+  EXECUTE_INDEX_EXISTS,
+  EXECUTE_VIEW_EXISTS,
+  EXECUTE_OUT_OF_MEMORY,
+  EXECUTE_TOO_MANY_PREPARED_STATEMENTS,
   EXECUTE_FAIL
 } ExecuteResult;
 
@@ -30,12 +37,22 @@ typedef enum {
 typedef enum {
   PREPARE_SUCCESS,
   PREPARE_NEGATIVE_ID,
+  PREPARE_ID_TOO_LARGE,
   PREPARE_STRING_TOO_LONG,
   PREPARE_SYNTAX_ERROR,
-  PREPARE_UNRECOGNIZED_STATEMENT
+  PREPARE_UNRECOGNIZED_STATEMENT,
+  PREPARE_UNKNOWN_PREPARED_STATEMENT
 } PrepareResult;
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT , STATEMENT_DELETE} StatementType;
+typedef enum {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_DELETE,
+  STATEMENT_PREPARE,
+  STATEMENT_EXECUTE,
+  STATEMENT_CREATE_INDEX,
+  STATEMENT_CREATE_VIEW
+} StatementType;
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
@@ -45,14 +62,123 @@ typedef struct {
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+
+/* Size of a row once serialized into a leaf cell (ROW_SIZE as a constant expression) */
+#define ROW_VALUE_SIZE                                              \
+  (size_of_attribute(Row, id) + size_of_attribute(Row, username) + \
+   size_of_attribute(Row, email))
+
+#define MAX_PREPARED_STATEMENTS 16
+#define PREPARED_STATEMENT_NAME_SIZE 32
+#define MAX_STATEMENT_PARAMETERS 3
+
+typedef enum { COLUMN_ID, COLUMN_USERNAME, COLUMN_EMAIL } Column;
+
+#define COLUMN_BIT(column) (1u << (column))
+#define ALL_COLUMNS (COLUMN_BIT(COLUMN_ID) | COLUMN_BIT(COLUMN_USERNAME) | COLUMN_BIT(COLUMN_EMAIL))
+
+/* Scalar function applied to a column before it is projected or grouped */
+typedef enum { FUNCTION_NONE, FUNCTION_DOMAIN } ColumnFunction;
+
+typedef enum {
+  COMPARE_EQUAL,
+  COMPARE_NOT_EQUAL,
+  COMPARE_LESS,
+  COMPARE_LESS_EQUAL,
+  COMPARE_GREATER,
+  COMPARE_GREATER_EQUAL,
+  COMPARE_PREFIX,  // text columns only: the value starts with the text
+  COMPARE_SUFFIX,  // text columns only: the value ends with the text
+  COMPARE_CONTAINS,  // text columns only: the text appears anywhere in the value
+  COMPARE_IN         // id only: the id is one of the query's in_ids
+} CompareOp;
+
+typedef enum {
+  AGGREGATE_NONE,
+  AGGREGATE_COUNT,
+  AGGREGATE_SUM,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX,
+  AGGREGATE_APPROX_DISTINCT  // estimated from the column's sketch, never aggregated per row
+} AggregateType;
+
+#define MAX_PROJECTIONS 8
+#define MAX_PREDICATES 4
+#define MAX_IN_IDS 1024
+#define MAX_SAMPLE_SIZE 1024  // more than the rows the table can hold; 300 KB of fetched rows
+
+/* One output column: a plain column, a function of one, or an aggregate over one */
+typedef struct {
+  AggregateType aggregate;
+  Column column;
+  ColumnFunction function;
+} Projection;
+
+/* <column> <op> <value>; id columns compare against integer, text columns against text */
+typedef struct {
+  Column column;
+  CompareOp op;
+  uint32_t integer;
+  char text[COLUMN_EMAIL_SIZE + 1];
+} Predicate;
+
+/*
+select [<projection>, ...] [where <predicate> and ...] [group by <expression>]
+       [order by <column> [asc | desc]] [limit <n>]
+An empty projection list means every column. With group by, plain
+projections must be the grouped expression itself.
+*/
+typedef struct {
+  uint32_t num_projections;
+  Projection projections[MAX_PROJECTIONS];
+  uint32_t num_predicates;
+  Predicate predicates[MAX_PREDICATES];
+  bool has_aggregates;
+  bool has_group_by;
+  Column group_column;
+  ColumnFunction group_function;
+  bool has_order_by;
+  Column order_column;
+  bool order_descending;
+  bool has_limit;
+  uint32_t limit;
+  uint32_t num_in_ids;  // ids of the query's in list, sorted and distinct
+  uint32_t* in_ids;     // allocated from the statement arena
+  bool has_sample;
+  uint32_t sample_size;  // distinct random rows to return instead of scanning
+} SelectQuery;
+
+/*
+A prepared statement keeps the shape of a statement that was parsed once.
+Each '?' in the template becomes a parameter, and executing the statement only
+binds the new values. Insert parameters are bound straight into row_value,
+which is already laid out the way the row is stored in a leaf cell.
+*/
+typedef struct {
+  char name[PREPARED_STATEMENT_NAME_SIZE + 1];
+  StatementType type;
+  uint32_t num_parameters;
+  Column parameters[MAX_STATEMENT_PARAMETERS];
+  char row_value[ROW_VALUE_SIZE];  // only used by insert statement
+  int delete_id;                   // only used by delete statement
+} PreparedStatement;
+
 typedef struct {
   StatementType type;
-  Row row_to_insert;  // only used by insert statement
+  char row_value[ROW_VALUE_SIZE];  // only used by insert statement, encoded as a leaf cell value
   int delete_id;
+  PreparedStatement to_prepare;  // only used by prepare statement
+  PreparedStatement* prepared;   // only used by execute statement
+  SelectQuery select;            // only used by select statement
+  Column index_column;           // only used by create index and create view statements
+  ColumnFunction view_function;  // only used by create view statement
+  bool hash_index;               // only used by create index statement
+  bool reverse_index;            // only used by create index statement
+  bool trigram_index;            // only used by create index statement
+  bool explain;                  // print the plan and program instead of running
 } Statement;
 
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
-
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
 const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
 const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
@@ -88,8 +214,103 @@ typedef struct {
   LRUNode* tail;
 } LRU_List;
 
+/*
+Every allocation is tagged with the part of the engine it belongs to, so
+.memory can report what is using memory. memory_alloc is refused once the
+memory limit would be passed even after shedding the caches, and its
+callers fail the statement or do without. memory_alloc_required is for
+memory that is bounded by design (a fixed number of frames, one arena
+block at a time) or cannot be given up midway; it only counts toward the
+limit.
+*/
+typedef enum {
+  MEMORY_FRAMES,   // page frames held by the pager
+  MEMORY_LRU,      // nodes of the pager's LRU list
+  MEMORY_ARENA,    // statement arena blocks: pin lists, cursors, scratch values
+  MEMORY_INPUT,    // the input line buffer
+  MEMORY_TABLE,    // the pager, table and index directories
+  MEMORY_CACHE,    // row cache, key filter and compiled programs
+  MEMORY_SORT,     // order by records and merge buffers
+  MEMORY_GROUP,    // group by hash tables and batches
+  MEMORY_SCRATCH,  // large statement buffers, .analyze and benchmark arrays
+  NUM_MEMORY_TAGS
+} MemoryTag;
+
+const char* memory_tag_names[NUM_MEMORY_TAGS] = {
+    "frames", "lru", "arena", "input", "table", "cache", "sort", "group", "scratch",
+};
+
+/* Precedes every tagged allocation; 16 bytes keeps the memory after it aligned */
+typedef struct {
+  uint64_t size;
+  uint64_t tag;
+} MemoryHeader;
+
+typedef struct {
+  pthread_mutex_t lock;  // group workers allocate from their own threads
+  pthread_mutex_t shed_lock;
+  uint64_t current[NUM_MEMORY_TAGS];
+  uint64_t peak[NUM_MEMORY_TAGS];
+  uint64_t total;
+  uint64_t total_peak;
+  uint64_t limit;  // 0 for no limit
+  uint64_t num_sheds;
+  uint64_t num_refused;
+  void (*shed)(void* argument);  // frees caches to make room under the limit
+  void* shed_argument;
+} MemoryAccounts;
+
+MemoryAccounts memory_accounts = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                  .shed_lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_SPARE_TRACKERS 64
+
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t size;
+  size_t used;
+  char data[];
+} ArenaBlock;
+
+/*
+Memory that only lives for one statement: cursors, the lists of pages a
+function has pinned and scratch rows. Allocations bump a pointer through
+a chain of blocks and are never freed one at a time; arena_reset releases
+them all before the next statement. Pinned page lists are handed back as
+soon as they are unpinned so that long statements can reuse them.
+*/
+typedef struct {
+  ArenaBlock* first;    // kept across resets
+  ArenaBlock* current;  // blocks after first are freed by a reset
+  PinnedPageNode* spare_nodes;
+  PinnedPages* spare_trackers[ARENA_SPARE_TRACKERS];
+  uint32_t num_spare_trackers;
+} Arena;
+
+/* A point in the arena that arena_release rolls back to */
+typedef struct {
+  ArenaBlock* block;
+  size_t used;
+} ArenaMark;
+
 #define FREED_PAGES_STACK_SIZE (TABLE_MAX_PAGES * sizeof(uint32_t))
 #define FREED_PAGES_START_OFFSET (FREED_PAGES_STACK_SIZE + sizeof(uint32_t))
+/*
+Page 0 is the table root and is never freed, so the last slot of the freed
+pages stack holds the catalog page number instead (0 until one is created).
+*/
+#define CATALOG_PAGE_SLOT (TABLE_MAX_PAGES - 1)
+
+/* Counters for .stats pager, kept since the database was opened */
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t reads;        // misses that found the page in the file
+  uint64_t evictions;
+  uint64_t write_backs;  // pages written to the file by evictions and flushes
+  uint32_t stale_pins;   // frames left pinned when the last statement finished
+} PagerStats;
 
 typedef struct {
   int file_descriptor;
@@ -101,12 +322,181 @@ typedef struct {
   LRU_List lru_list;
   uint32_t num_loaded_pages;
   int32_t page_numbers[TABLE_MAX_PAGES];
-  bool pinned[TABLE_MAX_PAGES];
+  uint16_t pinned[TABLE_MAX_PAGES];  // how many tracker entries hold each page
+  Arena arena;  // transient memory of the statement being executed
+  PagerStats stats;
 } Pager;
 
+#define DEFAULT_SORT_MEMORY (4 * 1024 * 1024)
+#define DEFAULT_GROUP_MEMORY (4 * 1024 * 1024)
+#define MAX_GROUP_THREADS 8
+
+#define HISTOGRAM_BUCKETS 16
+#define ANALYZE_SAMPLE_LEAVES 32
+
+/*
+Statistics gathered by .analyze for the planner. They are not kept up to
+date by writes; the planner falls back to fixed guesses until they exist.
+*/
+typedef struct {
+  bool valid;
+  uint32_t num_rows;
+  uint32_t num_leaves;
+  uint32_t min_key;
+  uint32_t max_key;
+  uint32_t histogram[HISTOGRAM_BUCKETS];  // equi-depth: largest key in each bucket
+  double distinct_usernames;              // estimated from a sample of leaves
+  double distinct_emails;
+  double distinct_domains;
+} TableStats;
+
+/*
+Bloom filter over every id in the table. It is saved in a page of its own
+on close and read back on open; the catalog only marks the saved copy as
+good between a close and the next open, so a file whose process died
+never loads a filter that is missing ids. Deleted ids cannot be cleared
+from it, so id lookups rebuild it from the leaves once deletes have made
+it stale or inserts have outgrown it. Deletes only read it.
+*/
+typedef struct {
+  bool valid;
+  bool refused;          // a rebuild was refused memory; retried once the limit changes
+  bool saved;            // the bits in page_num match, so the catalog may vouch for them
+  uint32_t page_num;     // page the filter is saved in, 0 until the first save
+  uint32_t num_bits;     // a power of two, at most one page of bits
+  uint32_t num_keys;     // ids added since the last rebuild
+  uint32_t num_deleted;  // ids deleted since the last rebuild, still set in bits
+  uint64_t* bits;
+} KeyFilter;
+
+#define KEY_FILTER_BITS_PER_KEY 10
+#define KEY_FILTER_PROBES 7
+#define KEY_FILTER_MIN_BITS 1024
+#define KEY_FILTER_MAX_BITS (PAGE_SIZE * 8)
+
+/*
+Decoded rows of recent lookups by id, direct-mapped by the hash of the id:
+a row replaces whatever was in its slot. Inserts and deletes clear the
+slot of the id they change, so a cached row is never stale.
+*/
+typedef struct {
+  bool valid;
+  Row row;
+} RowCacheSlot;
+
+typedef struct {
+  uint32_t num_slots;  // a power of two, 0 when the cache is off
+  RowCacheSlot* slots;
+  uint64_t hits;
+  uint64_t misses;
+} RowCache;
+
+/*
+Row bytes written by inserts: encoding the row once, then what the tree
+moves to place it, counting a whole cell for the new one. .stats inserts
+prints the average per insert.
+*/
+typedef struct {
+  uint64_t rows;
+  uint64_t bytes_copied;
+} InsertStats;
+
+/*
+HDR-style latency histograms in nanoseconds. Values below
+LATENCY_SUB_BUCKETS get a bucket each; above that every power of two is
+split into LATENCY_SUB_BUCKETS / 2 buckets, so a percentile is off by at
+most 1/32 of its value. Every call is counted, but a statement only takes
+a few microseconds, so only every LATENCY_SAMPLE_RATE-th one of each kind
+is timed to keep the two clock reads out of the cost of the rest. The
+choice comes from the call count, not table_random, so timing never moves
+the sequence `select ... sample` draws from. Splits and merges
+are slow enough to time every one.
+*/
+#define LATENCY_SAMPLE_RATE 8
+#define LATENCY_SUB_BITS 6
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 36  // about 68 seconds; longer samples land in the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS / 2)
+
+typedef enum {
+  LATENCY_INSERT,
+  LATENCY_SELECT,
+  LATENCY_DELETE,
+  LATENCY_LEAF_SPLIT,
+  LATENCY_INTERNAL_SPLIT,
+  LATENCY_LEAF_MERGE,
+  LATENCY_INTERNAL_MERGE,
+  NUM_LATENCY_KINDS
+} LatencyKind;
+
+const char* latency_kind_names[NUM_LATENCY_KINDS] = {
+    "insert", "select", "delete", "leaf split", "internal split", "leaf merge", "internal merge",
+};
+
+typedef struct {
+  uint64_t calls;
+  uint64_t count;  // calls that were timed
+  uint64_t max;
+  uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+#define DEFAULT_ROW_CACHE_ROWS 1024
+#define MAX_ROW_CACHE_ROWS (1 << 20)
+
+/* Tunables changed at runtime with the .set meta command */
+typedef struct {
+  uint32_t sort_memory;    // bytes a sort may hold before spilling runs to disk
+  uint32_t group_memory;   // bytes of group by hash tables before spilling partitions
+  uint32_t group_threads;  // workers aggregating into their own hash tables
+  uint32_t row_cache_rows;  // decoded rows kept for lookups by id, 0 for none
+  uint32_t memory_limit;    // bytes all tagged allocations may hold, 0 for no limit
+} Settings;
+
+/*
+HyperLogLog sketches of the distinct usernames, emails and email domains.
+Inserts add to them as they go; deletes cannot be taken back out, so after
+many deletes the estimates run high until the sketches are rebuilt.
+*/
+#define SKETCH_PRECISION 10
+#define SKETCH_REGISTERS (1 << SKETCH_PRECISION)
+#define NUM_SKETCHES 3  // username, email, domain(email)
+
+typedef struct {
+  bool valid;  // false when the file has rows that were never sketched
+  uint32_t page_num;  // page the sketches are saved in, 0 until the first save
+  uint8_t registers[NUM_SKETCHES][SKETCH_REGISTERS];
+} DistinctSketches;
+
+#define MAX_AGGREGATE_VIEWS 4
+
+/* count, sum, min and max of id per value of a grouped expression, kept by every write */
+typedef struct {
+  uint32_t root_page_num;
+  Column column;
+  ColumnFunction function;
+} AggregateView;
+
 typedef struct {
   Pager* pager;
   uint32_t root_page_num;
+  Settings settings;
+  TableStats stats;
+  PreparedStatement prepared_statements[MAX_PREPARED_STATEMENTS];
+  uint32_t num_prepared_statements;
+  struct Batch* batch;             // scratch space for batch scans and parallel group by
+  struct ProgramCache* programs;  // compiled statement programs, by shape
+  uint32_t index_roots[3];        // secondary index root page by column, 0 if none
+  uint32_t reverse_index_roots[3];  // root of the index on reversed values, 0 if none
+  uint32_t trigram_index_roots[3];  // root of the trigram posting lists, 0 if none
+  struct HashIndex* hash_index;   // directory of the hash index on id, NULL if none
+  KeyFilter key_filter;
+  RowCache row_cache;
+  AggregateView views[MAX_AGGREGATE_VIEWS];
+  uint32_t num_views;
+  DistinctSketches sketches;
+  uint64_t random_state;  // splitmix64 state for sampling
+  InsertStats insert_stats;
+  LatencyHistogram latency[NUM_LATENCY_KINDS];
 } Table;
 
 typedef struct {
@@ -114,6 +504,8 @@ typedef struct {
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;  // Indicates a position one past the last element
+  PinnedPages* tracker;  // pins node while the cursor reads rows from it
+  char* node;            // leaf page_num once read, NULL until then
 } Cursor;
 
 void print_row(Row* row) {
@@ -184,6 +576,86 @@ const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
 const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
     (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
 
+/*
+ * Index Node Layout
+ *
+ * Secondary index nodes are slotted pages: after the header comes an array
+ * of 2 byte cell offsets in key order, growing up, while the cells are packed
+ * down from the end of the page. Every cell is padded to 4 bytes.
+ * Leaf cell:     id (4), value length (2), value bytes
+ * Internal cell: child page (4), then the largest entry of that child
+ */
+const uint32_t INDEX_NODE_NUM_CELLS_OFFSET = 2;    // uint16_t
+const uint32_t INDEX_NODE_CELLS_START_OFFSET = 4;  // uint16_t, lowest cell byte
+const uint32_t INDEX_NODE_NEXT_OFFSET = 8;  // next leaf, or an internal node's right child
+const uint32_t INDEX_NODE_HEADER_SIZE = 12;
+const uint32_t INDEX_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t INDEX_ENTRY_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint16_t);
+const uint32_t INDEX_INTERNAL_CHILD_SIZE = sizeof(uint32_t);
+#define INDEX_MAX_CELL_SIZE 292
+#define INDEX_MAX_CELLS 512
+#define INDEX_MAX_DEPTH 16
+
+/*
+ * Trigram Index Layout
+ *
+ * Trigram indexes use index nodes too. A leaf entry is one block of a
+ * trigram's posting list, keyed by its value:
+ * trigram (3), last id the block covers (4, big-endian), ids as varint deltas
+ */
+#define TRIGRAM_SIZE 3
+#define TRIGRAM_KEY_SIZE 7
+#define TRIGRAM_BLOCK_SIZE 128  // varint bytes in a block before it is split
+#define TRIGRAM_TAIL_ID UINT32_MAX  // last id of a trigram's final, open block
+/* A block may overshoot by an id before it splits, and a split half restarts its deltas */
+#define TRIGRAM_MAX_ENTRY_SIZE (TRIGRAM_KEY_SIZE + TRIGRAM_BLOCK_SIZE + 2 * 5)
+
+/*
+ * Catalog Page Layout
+ */
+const uint32_t CATALOG_INDEX_ROOTS_OFFSET = 0;  // one root page per column, 0 if none
+const uint32_t CATALOG_HASH_INDEX_OFFSET = 12;  // hash index directory page, 0 if none
+const uint32_t CATALOG_REVERSE_INDEX_ROOTS_OFFSET = 16;  // reversed value indexes by column
+const uint32_t CATALOG_TRIGRAM_INDEX_ROOTS_OFFSET = 28;  // trigram indexes by column
+const uint32_t CATALOG_NUM_VIEWS_OFFSET = 40;  // how many aggregate views follow
+const uint32_t CATALOG_VIEWS_OFFSET = 44;  // root page, column and function of each view
+const uint32_t CATALOG_SKETCH_PAGE_OFFSET = 92;  // distinct count sketches, 0 if never saved
+const uint32_t CATALOG_KEY_FILTER_OFFSET = 96;  // filter page, then its bits, keys and deletes
+
+/*
+ * Hash Index Layout
+ *
+ * The directory page holds the global depth, one bucket page per directory
+ * slot, and then the overflow pages chained to buckets that can no longer
+ * split. Bucket pages hold their local depth, an entry count, the next page
+ * of their chain and (id, leaf page) entries, so a probe reads its bucket
+ * and then the leaf that holds the row.
+ */
+#define HASH_MAX_GLOBAL_DEPTH 9  // leaves room in the directory page for the overflow list
+#define HASH_MAX_BUCKETS (1 << HASH_MAX_GLOBAL_DEPTH)
+#define HASH_MAX_OVERFLOW_PAGES TABLE_MAX_PAGES
+const uint32_t HASH_DIRECTORY_DEPTH_OFFSET = 0;
+const uint32_t HASH_DIRECTORY_BUCKETS_OFFSET = sizeof(uint32_t);
+const uint32_t HASH_DIRECTORY_NUM_OVERFLOW_OFFSET =
+    HASH_DIRECTORY_BUCKETS_OFFSET + HASH_MAX_BUCKETS * sizeof(uint32_t);
+const uint32_t HASH_DIRECTORY_OVERFLOW_OFFSET = HASH_DIRECTORY_NUM_OVERFLOW_OFFSET + sizeof(uint32_t);
+const uint32_t HASH_BUCKET_LOCAL_DEPTH_OFFSET = 0;
+const uint32_t HASH_BUCKET_NUM_ENTRIES_OFFSET = sizeof(uint32_t);
+const uint32_t HASH_BUCKET_NEXT_OFFSET = 2 * sizeof(uint32_t);
+const uint32_t HASH_BUCKET_HEADER_SIZE = 3 * sizeof(uint32_t);
+const uint32_t HASH_ENTRY_ID = 0;
+const uint32_t HASH_ENTRY_LEAF = 1;
+const uint32_t HASH_ENTRY_SIZE = 2 * sizeof(uint32_t);
+
+/* In-memory copy of the directory, so a probe only reads its bucket */
+typedef struct HashIndex {
+  uint32_t directory_page_num;
+  uint32_t global_depth;
+  uint32_t buckets[HASH_MAX_BUCKETS];
+  uint32_t num_overflow;
+  uint32_t overflow[HASH_MAX_OVERFLOW_PAGES];
+} HashIndex;
+
 NodeType get_node_type(char* node) {
   uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
   return (NodeType)value;
@@ -285,11 +757,16 @@ void pager_flush(Pager* pager, uint32_t page_num) {
     printf("Error writing: %d\n", errno);
     exit(EXIT_FAILURE);
   }
+  pager->stats.write_backs += 1;
 }
 
+/*
+Pins are counted, so a cursor that keeps its leaf pinned across steps is
+not unpinned when some other tracker releases the same page.
+*/
 void pin_page(Pager* pager, uint32_t page_num) {
   if (page_num < TABLE_MAX_PAGES) {
-    pager->pinned[page_num] = true;
+    pager->pinned[page_num] += 1;
   } else {
     printf("Error: Attempted to pin an invalid page number %u\n", page_num);
   }
@@ -297,28 +774,243 @@ void pin_page(Pager* pager, uint32_t page_num) {
 
 void unpin_page(Pager* pager, uint32_t page_num) {
   if (page_num < TABLE_MAX_PAGES) {
-    pager->pinned[page_num] = false;
+    if (pager->pinned[page_num] > 0) {
+      pager->pinned[page_num] -= 1;
+    }
   } else {
     printf("Error: Attempted to unpin an invalid page number %u\n", page_num);
   }
 }
+void memory_account(MemoryTag tag, int64_t bytes) {
+  pthread_mutex_lock(&memory_accounts.lock);
+  memory_accounts.current[tag] += bytes;
+  memory_accounts.total += bytes;
+  if (memory_accounts.current[tag] > memory_accounts.peak[tag]) {
+    memory_accounts.peak[tag] = memory_accounts.current[tag];
+  }
+  if (memory_accounts.total > memory_accounts.total_peak) {
+    memory_accounts.total_peak = memory_accounts.total;
+  }
+  pthread_mutex_unlock(&memory_accounts.lock);
+}
+
+/* Whether bytes more fit under the limit, shedding the caches once if they do not */
+bool memory_reserve(size_t bytes) {
+  if (memory_accounts.limit == 0) {
+    return true;
+  }
+  if (__atomic_load_n(&memory_accounts.total, __ATOMIC_RELAXED) + bytes <=
+      memory_accounts.limit) {
+    return true;
+  }
+  if (memory_accounts.shed) {
+    pthread_mutex_lock(&memory_accounts.shed_lock);
+    memory_accounts.shed(memory_accounts.shed_argument);
+    pthread_mutex_unlock(&memory_accounts.shed_lock);
+    __atomic_add_fetch(&memory_accounts.num_sheds, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&memory_accounts.total, __ATOMIC_RELAXED) + bytes <=
+        memory_accounts.limit) {
+      return true;
+    }
+  }
+  __atomic_add_fetch(&memory_accounts.num_refused, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+void* memory_allocate(MemoryTag tag, size_t size, bool required) {
+  if (!required && !memory_reserve(size)) {
+    return NULL;
+  }
+  MemoryHeader* header = malloc(sizeof(MemoryHeader) + size);
+  if (header == NULL) {
+    if (required) {
+      printf("Error: Out of memory allocating %zu bytes for %s.\n", size, memory_tag_names[tag]);
+      exit(EXIT_FAILURE);
+    }
+    return NULL;
+  }
+  header->size = size;
+  header->tag = tag;
+  memory_account(tag, size);
+  return header + 1;
+}
+
+/* NULL if the limit refuses it or malloc fails */
+void* memory_alloc(MemoryTag tag, size_t size) {
+  return memory_allocate(tag, size, false);
+}
+
+void* memory_alloc_required(MemoryTag tag, size_t size) {
+  return memory_allocate(tag, size, true);
+}
+
+void* memory_calloc(MemoryTag tag, size_t count, size_t size) {
+  void* memory = memory_alloc(tag, count * size);
+  if (memory != NULL) {
+    memset(memory, 0, count * size);
+  }
+  return memory;
+}
+
+void* memory_reallocate(MemoryTag tag, void* memory, size_t size, bool required) {
+  if (memory == NULL) {
+    return memory_allocate(tag, size, required);
+  }
+  MemoryHeader* header = (MemoryHeader*)memory - 1;
+  uint64_t old_size = header->size;
+  if (!required && size > old_size && !memory_reserve(size - old_size)) {
+    return NULL;
+  }
+  MemoryHeader* resized = realloc(header, sizeof(MemoryHeader) + size);
+  if (resized == NULL) {
+    if (required) {
+      printf("Error: Out of memory allocating %zu bytes for %s.\n", size, memory_tag_names[tag]);
+      exit(EXIT_FAILURE);
+    }
+    return NULL;
+  }
+  resized->size = size;
+  memory_account(resized->tag, (int64_t)size - (int64_t)old_size);
+  return resized + 1;
+}
+
+/* Like realloc, the old memory is left alone when this returns NULL */
+void* memory_realloc(MemoryTag tag, void* memory, size_t size) {
+  return memory_reallocate(tag, memory, size, false);
+}
+
+void* memory_realloc_required(MemoryTag tag, void* memory, size_t size) {
+  return memory_reallocate(tag, memory, size, true);
+}
+
+void memory_free(void* memory) {
+  if (memory == NULL) {
+    return;
+  }
+  MemoryHeader* header = (MemoryHeader*)memory - 1;
+  memory_account(header->tag, -(int64_t)header->size);
+  free(header);
+}
+
+void print_memory(void) {
+  printf("memory: %lu bytes, peak %lu, limit ", (unsigned long)memory_accounts.total,
+         (unsigned long)memory_accounts.total_peak);
+  if (memory_accounts.limit) {
+    printf("%lu\n", (unsigned long)memory_accounts.limit);
+  } else {
+    printf("none\n");
+  }
+  for (uint32_t i = 0; i < NUM_MEMORY_TAGS; i++) {
+    printf("  %s: %lu bytes, peak %lu\n", memory_tag_names[i],
+           (unsigned long)memory_accounts.current[i], (unsigned long)memory_accounts.peak[i]);
+  }
+  printf("caches shed %lu times, %lu allocations refused\n",
+         (unsigned long)memory_accounts.num_sheds, (unsigned long)memory_accounts.num_refused);
+}
+
+/* Blocks for a single oversized allocation hold large statement buffers and may be refused */
+ArenaBlock* arena_block_new(size_t size) {
+  ArenaBlock* block = size > ARENA_BLOCK_SIZE
+                          ? memory_alloc(MEMORY_SCRATCH, sizeof(ArenaBlock) + size)
+                          : memory_alloc_required(MEMORY_ARENA, sizeof(ArenaBlock) + size);
+  if (block == NULL) {
+    return NULL;
+  }
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+void arena_init(Arena* arena) {
+  arena->first = arena_block_new(ARENA_BLOCK_SIZE);
+  arena->current = arena->first;
+  arena->spare_nodes = NULL;
+  arena->num_spare_trackers = 0;
+}
+
+/*
+Allocations are 16 byte aligned. Ones larger than a block get a block of
+their own, which counts against the memory limit: NULL if it refuses.
+*/
+void* arena_alloc(Arena* arena, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  ArenaBlock* block = arena->current;
+  if (block->used + size > block->size) {
+    block = arena_block_new(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    if (block == NULL) {
+      return NULL;
+    }
+    arena->current->next = block;
+    arena->current = block;
+  }
+  void* memory = block->data + block->used;
+  block->used += size;
+  return memory;
+}
+
+ArenaMark arena_mark(Arena* arena) {
+  ArenaMark mark = {arena->current, arena->current->used};
+  return mark;
+}
+
+/*
+Release everything allocated since mark, so that a loop doing one lookup
+at a time stays in the same memory. Nothing allocated after the mark can
+still be in use, not even a page pinned on a tracker from before it. The
+spare lists may hold trackers and nodes from the released memory, so they
+are emptied.
+*/
+void arena_release(Arena* arena, ArenaMark mark) {
+  ArenaBlock* block = mark.block->next;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    memory_free(block);
+    block = next;
+  }
+  mark.block->next = NULL;
+  mark.block->used = mark.used;
+  arena->current = mark.block;
+  arena->spare_nodes = NULL;
+  arena->num_spare_trackers = 0;
+}
+
+/* Release everything allocated since the last reset, keeping the first block */
+void arena_reset(Arena* arena) {
+  ArenaBlock* block = arena->first->next;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    memory_free(block);
+    block = next;
+  }
+  arena->first->next = NULL;
+  arena->first->used = 0;
+  arena->current = arena->first;
+  arena->spare_nodes = NULL;
+  arena->num_spare_trackers = 0;
+}
+
 /* For every function interacting with the b+ tree, we will create a linked list of pages that it interacts with. 
 Just when that function is about to end, we will unpin all the pages in that linked list. This linked list ensures that 
 the pages the function it interacts with are not unintentionally removed from memory and flushed to disk. */
-PinnedPages* init_pinned_pages() {
-    PinnedPages* tracker = (PinnedPages*)malloc(sizeof(PinnedPages));  // Dynamically allocate memory
-    if (tracker == NULL) {
-        // Handle allocation failure (e.g., return NULL or log error)
-        printf("Error: Memory allocation for pinned pages tracker failed!\n");
-        return NULL;
-    }
+PinnedPages* init_pinned_pages(Pager* pager) {
+    Arena* arena = &pager->arena;
+    PinnedPages* tracker = arena->num_spare_trackers > 0
+                               ? arena->spare_trackers[--arena->num_spare_trackers]
+                               : arena_alloc(arena, sizeof(PinnedPages));
     tracker->head = NULL;  // Initialize head to NULL
     tracker->tail = NULL;  // Initialize tail to NULL
     return tracker;  // Return the pointer to the allocated and initialized structure
 }
 
-void append_pinned_page(PinnedPages* tracker, uint32_t page_num) {
-    PinnedPageNode* new_node = (PinnedPageNode*)malloc(sizeof(PinnedPageNode));
+void append_pinned_page(Pager* pager, PinnedPages* tracker, uint32_t page_num) {
+    Arena* arena = &pager->arena;
+    PinnedPageNode* new_node = arena->spare_nodes;
+    if (new_node != NULL) {
+        arena->spare_nodes = new_node->next;
+    } else {
+        new_node = arena_alloc(arena, sizeof(PinnedPageNode));
+    }
     new_node->page_num = page_num;
     new_node->next = NULL;
 
@@ -334,30 +1026,25 @@ void append_pinned_page(PinnedPages* tracker, uint32_t page_num) {
 }
 
 void unpin_all_pages(Pager* pager, PinnedPages* tracker) {
-    PinnedPageNode* current = tracker->head;
+    Arena* arena = &pager->arena;
 
     // Unpin all pages
-    while (current != NULL) {
+    while (tracker->head != NULL) {
         // Unpin the page using the unpin_page function
+        PinnedPageNode* current = tracker->head;
         unpin_page(pager, current->page_num);
 
-        // Move to the next node in the linked list
-        PinnedPageNode* temp = current;
-        current = current->next;
-
-        // Free the current node to release memory
-        free(temp);
+        // Hand the node back to the arena for the next page pinned
+        tracker->head = current->next;
+        current->next = arena->spare_nodes;
+        arena->spare_nodes = current;
     }
-
-    // After unpinning all pages, reset the linked list pointers
-    tracker->head = NULL;
     tracker->tail = NULL;
 
-    // Free the tracker structure itself
-    free(tracker);
-
-    // Set the tracker pointer to NULL to avoid dangling pointers
-    tracker = NULL;
+    // The tracker itself can be reused too; past the spare slots it waits for the reset
+    if (arena->num_spare_trackers < ARENA_SPARE_TRACKERS) {
+        arena->spare_trackers[arena->num_spare_trackers++] = tracker;
+    }
 }
 
 void lru_list_initialize(Pager* pager) {
@@ -386,7 +1073,7 @@ void remove_node(Pager* pager, LRUNode* node_to_remove) {
         pager->lru_list.tail = node_to_remove->prev;
     }
 
-    free(node_to_remove);
+    memory_free(node_to_remove);
     node_to_remove = NULL;
     pager->num_loaded_pages -= 1;
 }
@@ -395,17 +1082,27 @@ void add_page_to_lru(Pager* pager, uint32_t page_num) {
   LRUNode* current = pager->lru_list.head;
   while (current) {
     if (current->page_num == page_num) {
-        remove_node(pager, current);
         break;
       }
     current = current->next;
   }
 
-  LRUNode* new_node = malloc(sizeof(LRUNode));
-    if (!new_node) {
-        printf("Failed to allocate LRUNode\n");
-        exit(EXIT_FAILURE);
+  LRUNode* new_node = current;
+  if (new_node) {
+    /* Already loaded: move its node to the front rather than allocating a new one */
+    if (new_node == pager->lru_list.head) {
+      return;
+    }
+    new_node->prev->next = new_node->next;
+    if (new_node->next) {
+      new_node->next->prev = new_node->prev;
+    } else {
+      pager->lru_list.tail = new_node->prev;
     }
+    pager->num_loaded_pages -= 1;
+  } else {
+    new_node = memory_alloc_required(MEMORY_LRU, sizeof(LRUNode));
+  }
   new_node->page_num = page_num;
   new_node->prev = NULL;
   new_node->next = pager->lru_list.head;
@@ -452,11 +1149,12 @@ char* get_page(Pager* pager, uint32_t page_num, PinnedPages* tracker) {
   }
   pin_page(pager, page_num);
   add_page_to_lru(pager, page_num);
-  append_pinned_page(tracker, page_num);
+  append_pinned_page(pager, tracker, page_num);
 
   if (pager->page_numbers[page_num] == -1) {
     // Cache miss. Allocate memory and load from file.
-    char* page = malloc(PAGE_SIZE);
+    pager->stats.misses += 1;
+    char* page = memory_alloc_required(MEMORY_FRAMES, PAGE_SIZE);
     memset(page, 0, PAGE_SIZE);
     uint32_t num_pages = pager->file_length / PAGE_SIZE;
 
@@ -472,6 +1170,9 @@ char* get_page(Pager* pager, uint32_t page_num, PinnedPages* tracker) {
         printf("Error reading file: %d\n", errno);
         exit(EXIT_FAILURE);
       }
+      if (bytes_read > 0) {
+        pager->stats.reads += 1;
+      }
     }
 
     if (page_num >= pager->num_pages) {
@@ -480,13 +1181,15 @@ char* get_page(Pager* pager, uint32_t page_num, PinnedPages* tracker) {
 
     if (pager->num_loaded_pages > MAX_NUM_LOADED_PAGES) {
       uint32_t page_to_evict = remove_least_recently_used(pager);
+      pager->stats.evictions += 1;
+      pager->stats.write_backs += 1;
       lseek(pager->file_descriptor, FREED_PAGES_START_OFFSET + (page_to_evict * PAGE_SIZE), SEEK_SET);
       ssize_t bytes_written = write(pager->file_descriptor, pager->pages[pager->page_numbers[page_to_evict]], PAGE_SIZE);
 
       off_t total_file_length = lseek(pager->file_descriptor, 0, SEEK_END);
       pager->file_length = total_file_length - FREED_PAGES_START_OFFSET;
 
-      free(pager->pages[pager->page_numbers[page_to_evict]]);
+      memory_free(pager->pages[pager->page_numbers[page_to_evict]]);
       pager->pages[pager->page_numbers[page_to_evict]] = NULL;
       pager->page_numbers[page_num] = pager->page_numbers[page_to_evict];
       pager->page_numbers[page_to_evict]  = -1;
@@ -496,24 +1199,85 @@ char* get_page(Pager* pager, uint32_t page_num, PinnedPages* tracker) {
     }
     pager->pages[pager->page_numbers[page_num]] = page;
 
+  } else {
+    pager->stats.hits += 1;
   }
   return pager->pages[pager->page_numbers[page_num]];
 }
 
-uint32_t get_node_max_key(Pager* pager, char* node) {
-  PinnedPages* tracker = init_pinned_pages();
+/*
+Called between statements, when every tracker has been released. A frame
+that is still pinned has leaked its pin and can never be evicted.
+*/
+void pager_end_statement(Pager* pager) {
+  uint32_t pinned = 0;
+  for (LRUNode* node = pager->lru_list.head; node; node = node->next) {
+    pinned += pager->pinned[node->page_num] > 0;
+  }
+  pager->stats.stale_pins = pinned;
+  arena_reset(&pager->arena);
+}
 
-  if (get_node_type(node) == NODE_LEAF) {
-    uint32_t max_key = *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
-    unpin_all_pages(pager, tracker);
-    return max_key;
+uint64_t latency_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+uint32_t latency_bucket(uint64_t value) {
+  if (value >= (1ull << LATENCY_MAX_BITS)) {
+    value = (1ull << LATENCY_MAX_BITS) - 1;
   }
-  char* right_child = get_page(pager,*internal_node_right_child(node), tracker);
-  
-  uint32_t max_key = get_node_max_key(pager, right_child);
+  if (value < LATENCY_SUB_BUCKETS) {
+    return value;
+  }
+  uint32_t shift = 63 - __builtin_clzll(value) - (LATENCY_SUB_BITS - 1);
+  return shift * (LATENCY_SUB_BUCKETS / 2) + (uint32_t)(value >> shift);
+}
 
-  unpin_all_pages(pager, tracker);
+/* The largest value that lands in bucket */
+uint64_t latency_bucket_highest(uint32_t bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) {
+    return bucket;
+  }
+  uint32_t shift = bucket / (LATENCY_SUB_BUCKETS / 2) - 1;
+  uint64_t mantissa = bucket - shift * (LATENCY_SUB_BUCKETS / 2);
+  return ((mantissa + 1) << shift) - 1;
+}
+
+/* Count a call. Returns the start reading for latency_record, or 0 when the call is not timed. */
+uint64_t latency_start(LatencyHistogram* histogram, bool timed) {
+  histogram->calls += 1;
+  return timed ? latency_now() : 0;
+}
+
+void latency_record(LatencyHistogram* histogram, uint64_t start) {
+  if (start == 0) {
+    return;
+  }
+  uint64_t elapsed = latency_now() - start;
+  histogram->count += 1;
+  histogram->buckets[latency_bucket(elapsed)] += 1;
+  if (elapsed > histogram->max) {
+    histogram->max = elapsed;
+  }
+}
 
+/* Walks down the right children, keeping only the page it is on pinned */
+uint32_t get_node_max_key(Pager* pager, char* node) {
+  PinnedPages* tracker = NULL;
+  while (get_node_type(node) != NODE_LEAF) {
+    PinnedPages* child_tracker = init_pinned_pages(pager);
+    node = get_page(pager, *internal_node_right_child(node), child_tracker);
+    if (tracker != NULL) {
+      unpin_all_pages(pager, tracker);
+    }
+    tracker = child_tracker;
+  }
+  uint32_t max_key = *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+  if (tracker != NULL) {
+    unpin_all_pages(pager, tracker);
+  }
   return max_key;
 }
 
@@ -534,7 +1298,7 @@ void indent(uint32_t level) {
 
 
 void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-  PinnedPages* tracker = init_pinned_pages();
+  PinnedPages* tracker = init_pinned_pages(pager);
   char* node = get_page(pager, page_num, tracker);
   uint32_t num_keys, child;
 
@@ -604,14 +1368,16 @@ void initialize_internal_node(char* node) {
 
 
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  PinnedPages* tracker = init_pinned_pages();
+  PinnedPages* tracker = init_pinned_pages(table->pager);
   char* node = get_page(table->pager, page_num, tracker);
   uint32_t num_cells = *leaf_node_num_cells(node);
 
-  Cursor* cursor = malloc(sizeof(Cursor));
+  Cursor* cursor = arena_alloc(&table->pager->arena, sizeof(Cursor));
   cursor->table = table;
   cursor->page_num = page_num;
   cursor->end_of_table = false;
+  cursor->tracker = NULL;
+  cursor->node = NULL;
 
   // Binary search
   uint32_t min_index = 0;
@@ -621,6 +1387,7 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
     uint32_t key_at_index = *leaf_node_key(node, index);
     if (key == key_at_index) {
       cursor->cell_num = index;
+      unpin_all_pages(table->pager, tracker);
       return cursor;
     }
     if (key < key_at_index) {
@@ -667,7 +1434,7 @@ uint32_t internal_node_find_child(char* node, uint32_t key) {
 }
 
 Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  PinnedPages* tracker = init_pinned_pages();
+  PinnedPages* tracker = init_pinned_pages(table->pager);
   char* node = get_page(table->pager, page_num, tracker);
 
   uint32_t child_index = internal_node_find_child(node, key);
@@ -697,7 +1464,7 @@ If the key is not present, return the position
 where it should be inserted
 */
 Cursor* table_find(Table* table, uint32_t key) {
-  PinnedPages* tracker = init_pinned_pages();
+  PinnedPages* tracker = init_pinned_pages(table->pager);
  
   uint32_t root_page_num = table->root_page_num;
   char* root_node = get_page(table->pager, root_page_num, tracker);
@@ -717,7 +1484,7 @@ Cursor* table_find(Table* table, uint32_t key) {
 }
 
 Cursor* table_start(Table* table) {
-  PinnedPages* tracker = init_pinned_pages();
+  PinnedPages* tracker = init_pinned_pages(table->pager);
 
   Cursor* cursor = table_find(table, 0);
   char* node = get_page(table->pager, cursor->page_num, tracker);
@@ -728,26 +1495,39 @@ Cursor* table_start(Table* table) {
   return cursor;
 }
 
-char* cursor_value(Cursor* cursor) {
-  PinnedPages* tracker = init_pinned_pages();
+/*
+A cursor pins its leaf the first time it reads from it and keeps the frame
+until it moves to the next leaf, so a scan fetches each leaf once instead
+of once per row.
+*/
+char* cursor_node(Cursor* cursor) {
+  if (cursor->node == NULL) {
+    cursor->tracker = init_pinned_pages(cursor->table->pager);
+    cursor->node = get_page(cursor->table->pager, cursor->page_num, cursor->tracker);
+  }
+  return cursor->node;
+}
 
-  uint32_t page_num = cursor->page_num;
-  char* page = get_page(cursor->table->pager, page_num, tracker);
+void cursor_release(Cursor* cursor) {
+  if (cursor->tracker) {
+    unpin_all_pages(cursor->table->pager, cursor->tracker);
+    cursor->tracker = NULL;
+  }
+  cursor->node = NULL;
+}
 
-  unpin_all_pages(cursor->table->pager, tracker);
-  return leaf_node_value(page, cursor->cell_num);
+char* cursor_value(Cursor* cursor) {
+  return leaf_node_value(cursor_node(cursor), cursor->cell_num);
 }
 
 void cursor_advance(Cursor* cursor) {
-  PinnedPages* tracker = init_pinned_pages();
-
-  uint32_t page_num = cursor->page_num;
-  char* node = get_page(cursor->table->pager, page_num, tracker);
+  char* node = cursor_node(cursor);
 
   cursor->cell_num += 1;
   if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
     /* Advance to next leaf node */
     uint32_t next_page_num = *leaf_node_next_leaf(node);
+    cursor_release(cursor);
     if (next_page_num == 0) {
       /* This was rightmost leaf */
       cursor->end_of_table = true;
@@ -756,7 +1536,6 @@ void cursor_advance(Cursor* cursor) {
       cursor->cell_num = 0;
     }
   }
-  unpin_all_pages(cursor->table->pager, tracker);
 }
 
 bool is_empty_stack(Pager* pager) {
@@ -764,7 +1543,11 @@ bool is_empty_stack(Pager* pager) {
 }
 
 bool is_full_stack(Pager* pager) {
-  return pager->freed_pages_count >= TABLE_MAX_PAGES;
+  return pager->freed_pages_count >= CATALOG_PAGE_SLOT;
+}
+
+uint32_t* pager_catalog_page_num(Pager* pager) {
+  return &pager->freed_pages_stack[CATALOG_PAGE_SLOT];
 }
 
 void push_free_page(Pager* pager, uint32_t page_num) {
@@ -788,6 +1571,15 @@ uint32_t pop_free_page(Pager* pager) {
   }
 }
 
+bool page_is_free(Pager* pager, uint32_t page_num) {
+  for (uint32_t i = 0; i < pager->freed_pages_count; i++) {
+    if (pager->freed_pages_stack[i] == page_num) {
+      return true;
+    }
+  }
+  return false;
+}
+
 Pager* pager_open(const char* filename) {
   int fd = open(filename,
                 O_RDWR |      // Read/Write mode
@@ -801,7 +1593,7 @@ Pager* pager_open(const char* filename) {
     exit(EXIT_FAILURE);
   }
 
-  Pager* pager = malloc(sizeof(Pager));
+  Pager* pager = memory_alloc_required(MEMORY_TABLE, sizeof(Pager));
   if (pager == NULL) {
   perror("Unable to allocate memory for Pager");
   exit(EXIT_FAILURE);
@@ -850,21 +1642,125 @@ Pager* pager_open(const char* filename) {
     pager->pages[i] = NULL;
   }
 
+  arena_init(&pager->arena);
+
   for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
     pager->page_numbers[i] = -1;
-    pager->pinned[i] = false;
+    pager->pinned[i] = 0;
   }
 
   return pager;
 }
 
+void hash_index_load(Table* table, uint32_t directory_page_num);
+void hash_index_locate(Table* table, uint32_t id, uint32_t leaf_page_num);
+void hash_index_locate_leaf(Table* table, uint32_t leaf_page_num);
+bool key_filter_reset(KeyFilter* filter, uint32_t num_bits);
+void key_filter_load(Table* table, uint32_t num_bits, uint32_t num_keys, uint32_t num_deleted);
+void key_filter_save(Table* table);
+
+/* Empty the cache and size it for at most rows rows */
+void row_cache_resize(RowCache* cache, uint32_t rows) {
+  memory_free(cache->slots);
+  cache->num_slots = 0;
+  cache->slots = NULL;
+  cache->hits = 0;
+  cache->misses = 0;
+  if (rows == 0) {
+    return;
+  }
+  cache->num_slots = 1;
+  while (cache->num_slots * 2 <= rows) {
+    cache->num_slots *= 2;
+  }
+  /* The allocation may shed the caches, which is safe since the old slots are already gone */
+  cache->slots = memory_calloc(MEMORY_CACHE, cache->num_slots, sizeof(RowCacheSlot));
+  if (cache->slots == NULL) {
+    cache->num_slots = 0;
+  }
+}
+
+/*
+Called when an allocation would pass the memory limit. The row cache and
+key filter only save page reads, so they are the first to go: a shed row
+cache stays empty until .set row_cache sizes it again, and the key filter
+is rebuilt the next time it is needed.
+*/
+void table_shed_caches(void* argument) {
+  Table* table = argument;
+  memory_free(table->row_cache.slots);
+  table->row_cache.slots = NULL;
+  table->row_cache.num_slots = 0;
+  memory_free(table->key_filter.bits);
+  table->key_filter.bits = NULL;
+  table->key_filter.valid = false;
+}
+
+/* Every page the catalog names has to lie inside the file */
+void catalog_check_page(Pager* pager, uint32_t page_num) {
+  if (page_num >= pager->num_pages) {
+    printf("Corrupt catalog: page %d is past the end of the file.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void catalog_check(Table* table, uint32_t hash_directory_page_num) {
+  Pager* pager = table->pager;
+  for (uint32_t column = 0; column < 3; column++) {
+    catalog_check_page(pager, table->index_roots[column]);
+    catalog_check_page(pager, table->reverse_index_roots[column]);
+    catalog_check_page(pager, table->trigram_index_roots[column]);
+  }
+  for (uint32_t i = 0; i < table->num_views; i++) {
+    AggregateView* view = &table->views[i];
+    if (view->column > COLUMN_EMAIL || view->function > FUNCTION_DOMAIN) {
+      printf("Corrupt catalog: aggregate view %d.\n", i);
+      exit(EXIT_FAILURE);
+    }
+    catalog_check_page(pager, view->root_page_num);
+  }
+  catalog_check_page(pager, table->sketches.page_num);
+  catalog_check_page(pager, table->key_filter.page_num);
+  catalog_check_page(pager, hash_directory_page_num);
+}
+
 Table* db_open(const char* filename) {
-  PinnedPages* tracker = init_pinned_pages();
   Pager* pager = pager_open(filename);
+  PinnedPages* tracker = init_pinned_pages(pager);
 
-  Table* table = malloc(sizeof(Table));
+  Table* table = memory_alloc_required(MEMORY_TABLE, sizeof(Table));
   table->pager = pager;
   table->root_page_num = 0;
+  table->num_prepared_statements = 0;
+  table->batch = NULL;
+  table->programs = NULL;
+  memset(table->index_roots, 0, sizeof(table->index_roots));
+  memset(table->reverse_index_roots, 0, sizeof(table->reverse_index_roots));
+  memset(table->trigram_index_roots, 0, sizeof(table->trigram_index_roots));
+  table->hash_index = NULL;
+  table->num_views = 0;
+  table->random_state = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+  table->insert_stats.rows = 0;
+  table->insert_stats.bytes_copied = 0;
+  memset(table->latency, 0, sizeof(table->latency));
+  table->sketches.valid = pager->num_pages == 0;
+  table->sketches.page_num = 0;
+  memset(table->sketches.registers, 0, sizeof(table->sketches.registers));
+  table->key_filter.valid = false;
+  table->key_filter.saved = false;
+  table->key_filter.page_num = 0;
+  table->key_filter.refused = false;
+  table->key_filter.bits = NULL;
+  table->row_cache.slots = NULL;
+  row_cache_resize(&table->row_cache, DEFAULT_ROW_CACHE_ROWS);
+  table->stats.valid = false;
+  table->settings.sort_memory = DEFAULT_SORT_MEMORY;
+  table->settings.group_memory = DEFAULT_GROUP_MEMORY;
+  table->settings.group_threads = 1;
+  table->settings.row_cache_rows = DEFAULT_ROW_CACHE_ROWS;
+  table->settings.memory_limit = 0;
+  memory_accounts.shed = table_shed_caches;
+  memory_accounts.shed_argument = table;
   lru_list_initialize(pager);
 
   if (pager->num_pages == 0) {
@@ -873,6 +1769,39 @@ Table* db_open(const char* filename) {
     char* root_node = get_page(pager, 0, tracker);
     initialize_leaf_node(root_node);
     set_node_root(root_node, true);
+    key_filter_reset(&table->key_filter, KEY_FILTER_MIN_BITS);
+  } else if (*pager_catalog_page_num(pager) != 0) {
+    char* catalog = get_page(pager, *pager_catalog_page_num(pager), tracker);
+    memcpy(table->index_roots, catalog + CATALOG_INDEX_ROOTS_OFFSET,
+           sizeof(table->index_roots));
+    memcpy(table->reverse_index_roots, catalog + CATALOG_REVERSE_INDEX_ROOTS_OFFSET,
+           sizeof(table->reverse_index_roots));
+    memcpy(table->trigram_index_roots, catalog + CATALOG_TRIGRAM_INDEX_ROOTS_OFFSET,
+           sizeof(table->trigram_index_roots));
+    memcpy(&table->num_views, catalog + CATALOG_NUM_VIEWS_OFFSET, sizeof(uint32_t));
+    if (table->num_views > MAX_AGGREGATE_VIEWS) {
+      printf("Corrupt catalog: %d aggregate views.\n", table->num_views);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(table->views, catalog + CATALOG_VIEWS_OFFSET,
+           table->num_views * sizeof(AggregateView));
+    memcpy(&table->sketches.page_num, catalog + CATALOG_SKETCH_PAGE_OFFSET, sizeof(uint32_t));
+    uint32_t hash_directory_page_num = *(uint32_t*)(catalog + CATALOG_HASH_INDEX_OFFSET);
+    uint32_t saved_filter[4];
+    memcpy(saved_filter, catalog + CATALOG_KEY_FILTER_OFFSET, sizeof(saved_filter));
+    table->key_filter.page_num = saved_filter[0];
+    catalog_check(table, hash_directory_page_num);
+    if (table->sketches.page_num != 0) {
+      memcpy(table->sketches.registers,
+             get_page(pager, table->sketches.page_num, tracker),
+             sizeof(table->sketches.registers));
+      table->sketches.valid = true;
+    }
+    /* Before the filter, whose load saves the catalog and so needs the directory */
+    if (hash_directory_page_num != 0) {
+      hash_index_load(table, hash_directory_page_num);
+    }
+    key_filter_load(table, saved_filter[1], saved_filter[2], saved_filter[3]);
   }
 
   unpin_all_pages(pager, tracker);
@@ -880,7 +1809,7 @@ Table* db_open(const char* filename) {
 }
 
 InputBuffer* new_input_buffer() {
-  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+  InputBuffer* input_buffer = memory_alloc_required(MEMORY_INPUT, sizeof(InputBuffer));
   input_buffer->buffer = NULL;
   input_buffer->buffer_length = 0;
   input_buffer->input_length = 0;
@@ -891,8 +1820,13 @@ InputBuffer* new_input_buffer() {
 void print_prompt() { printf("db > "); }
 
 void read_input(InputBuffer* input_buffer) {
+  /* getline grows the buffer with libc, so only its capacity is accounted */
+  size_t old_length = input_buffer->buffer_length;
   ssize_t bytes_read =
       getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+  if (input_buffer->buffer_length != old_length) {
+    memory_account(MEMORY_INPUT, (int64_t)input_buffer->buffer_length - (int64_t)old_length);
+  }
 
   if (bytes_read == -1) {
     if (feof(stdin)) {
@@ -914,8 +1848,9 @@ void read_input(InputBuffer* input_buffer) {
 }
 
 void close_input_buffer(InputBuffer* input_buffer) {
+  memory_account(MEMORY_INPUT, -(int64_t)input_buffer->buffer_length);
   free(input_buffer->buffer);
-  free(input_buffer);
+  memory_free(input_buffer);
 }
 
 void flush_freed_pages_stack(Pager* pager) {
@@ -944,8 +1879,14 @@ void flush_freed_pages_stack(Pager* pager) {
 
 }
 
+void sketches_save(Table* table);
+
 void db_close(Table* table) {
   Pager* pager = table->pager;
+  memory_accounts.shed = NULL;
+
+  sketches_save(table);
+  key_filter_save(table);
 
   flush_freed_pages_stack(pager);
 
@@ -954,7 +1895,7 @@ void db_close(Table* table) {
       continue;
     }
     pager_flush(pager, i);
-    free(pager->pages[pager->page_numbers[i]]);
+    memory_free(pager->pages[pager->page_numbers[i]]);
     pager->pages[pager->page_numbers[i]] = NULL;
   }
 
@@ -966,17 +1907,32 @@ void db_close(Table* table) {
   for (uint32_t i = 0; i < MAX_NUM_LOADED_PAGES; i++) {
     char* page = pager->pages[i];
     if (page) {
-      free(page);
+      memory_free(page);
       pager->pages[i] = NULL;
     }
   }
 
-
-  free(pager);
-  free(table);
+  arena_reset(&pager->arena);
+  memory_free(pager->arena.first);
+  memory_free(pager);
+  memory_free(table->batch);
+  memory_free(table->programs);
+  memory_free(table->hash_index);
+  memory_free(table->key_filter.bits);
+  memory_free(table->row_cache.slots);
+  memory_free(table);
 
 }
 
+void bench_parse(Table* table, uint32_t iterations);
+void bench_lookups(Table* table, uint32_t num_lookups);
+MetaCommandResult do_set_command(InputBuffer* input_buffer, Table* table);
+MetaCommandResult do_stats_command(InputBuffer* input_buffer, Table* table);
+void print_program_cache_stats(Table* table);
+bool table_analyze(Table* table);
+void print_stats(TableStats* stats);
+uint32_t sketches_rebuild(Table* table);
+
 MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
   if (strcmp(input_buffer->buffer, ".exit") == 0) {
     close_input_buffer(input_buffer);
@@ -990,856 +1946,6998 @@ MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
     printf("Constants:\n");
     print_constants();
     return META_COMMAND_SUCCESS;
-  } else {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  } else if (strncmp(input_buffer->buffer, ".bench parse", 12) == 0) {
+    int iterations = 100000;
+    if (input_buffer->buffer[12] != '\0') {
+      iterations = atoi(input_buffer->buffer + 12);
+    }
+    if (iterations <= 0) {
+      return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+    bench_parse(table, iterations);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".bench lookups", 14) == 0) {
+    int num_lookups = 100000;
+    if (input_buffer->buffer[14] != '\0') {
+      num_lookups = atoi(input_buffer->buffer + 14);
+    }
+    if (num_lookups <= 0) {
+      return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+    bench_lookups(table, num_lookups);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".set", 4) == 0) {
+    return do_set_command(input_buffer, table);
+  } else if (strncmp(input_buffer->buffer, ".stats", 6) == 0) {
+    return do_stats_command(input_buffer, table);
+  } else if (strcmp(input_buffer->buffer, ".memory") == 0) {
+    print_memory();
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".rebuild sketches") == 0) {
+    printf("sketches: rebuilt from %u rows\n", sketches_rebuild(table));
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".analyze") == 0) {
+    if (!table_analyze(table)) {
+      printf("Error: Out of memory.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    print_stats(&table->stats);
+    return META_COMMAND_SUCCESS;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-  statement->type = STATEMENT_INSERT;
+typedef enum {
+  TOKEN_END,
+  TOKEN_WORD,
+  TOKEN_INTEGER,
+  TOKEN_STRING,
+  TOKEN_INSERT,
+  TOKEN_SELECT,
+  TOKEN_DELETE,
+  TOKEN_PREPARE,
+  TOKEN_EXECUTE,
+  TOKEN_EXPLAIN,
+  TOKEN_CREATE,
+  TOKEN_INDEX,
+  TOKEN_ON,
+  TOKEN_WHERE,
+  TOKEN_AND,
+  TOKEN_LIMIT,
+  TOKEN_GROUP,
+  TOKEN_ORDER,
+  TOKEN_BY,
+  TOKEN_ASC,
+  TOKEN_DESC,
+  TOKEN_COMMA,
+  TOKEN_LEFT_PAREN,
+  TOKEN_RIGHT_PAREN,
+  TOKEN_STAR,
+  TOKEN_EQUAL,
+  TOKEN_NOT_EQUAL,
+  TOKEN_LESS,
+  TOKEN_LESS_EQUAL,
+  TOKEN_GREATER,
+  TOKEN_GREATER_EQUAL,
+  TOKEN_INVALID
+} TokenType;
+
+/*
+Tokens never own their text: start points into the input buffer and the
+token is length bytes long. Quoted strings exclude their quotes.
+*/
+typedef struct {
+  TokenType type;
+  const char* start;
+  uint32_t length;
+  uint32_t integer;  // only used by integer tokens
+  bool negative;     // only used by integer tokens
+  bool overflow;     // only used by integer tokens
+} Token;
 
-  strtok(input_buffer->buffer, " ");
-  char* id_string = strtok(NULL, " ");
-  char* username = strtok(NULL, " ");
-  char* email = strtok(NULL, " ");
+typedef struct {
+  const char* position;
+  const char* end;
+} Lexer;
 
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+void lexer_init(Lexer* lexer, const char* input, size_t length) {
+  lexer->position = input;
+  lexer->end = input + length;
+}
+
+/* Spaces, tabs, newlines and other control characters all separate tokens */
+bool is_space(char c) {
+  return (unsigned char)c <= ' ';
+}
+
+/* Punctuation and comparison operators end a bare word; quote values that contain them */
+bool is_delimiter(char c) {
+  switch (c) {
+    case (','):
+    case ('('):
+    case (')'):
+    case ('='):
+    case ('<'):
+    case ('>'):
+    case ('!'):
+      return true;
+    default:
+      return is_space(c);
   }
+}
 
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
+#define token_is_keyword(start, length, keyword) \
+  ((length) == sizeof(keyword) - 1 && memcmp(start, keyword, length) == 0)
+
+TokenType keyword_type(const char* start, uint32_t length) {
+  switch (start[0]) {
+    case ('*'):
+      if (length == 1) return TOKEN_STAR;
+      break;
+    case ('a'):
+      if (token_is_keyword(start, length, "and")) return TOKEN_AND;
+      if (token_is_keyword(start, length, "asc")) return TOKEN_ASC;
+      break;
+    case ('b'):
+      if (token_is_keyword(start, length, "by")) return TOKEN_BY;
+      break;
+    case ('c'):
+      if (token_is_keyword(start, length, "create")) return TOKEN_CREATE;
+      break;
+    case ('g'):
+      if (token_is_keyword(start, length, "group")) return TOKEN_GROUP;
+      break;
+    case ('o'):
+      if (token_is_keyword(start, length, "order")) return TOKEN_ORDER;
+      if (token_is_keyword(start, length, "on")) return TOKEN_ON;
+      break;
+    case ('l'):
+      if (token_is_keyword(start, length, "limit")) return TOKEN_LIMIT;
+      break;
+    case ('w'):
+      if (token_is_keyword(start, length, "where")) return TOKEN_WHERE;
+      break;
+    case ('d'):
+      if (token_is_keyword(start, length, "delete")) return TOKEN_DELETE;
+      if (token_is_keyword(start, length, "desc")) return TOKEN_DESC;
+      break;
+    case ('e'):
+      if (token_is_keyword(start, length, "execute")) return TOKEN_EXECUTE;
+      if (token_is_keyword(start, length, "explain")) return TOKEN_EXPLAIN;
+      break;
+    case ('i'):
+      if (token_is_keyword(start, length, "insert")) return TOKEN_INSERT;
+      if (token_is_keyword(start, length, "index")) return TOKEN_INDEX;
+      break;
+    case ('p'):
+      if (token_is_keyword(start, length, "prepare")) return TOKEN_PREPARE;
+      break;
+    case ('s'):
+      if (token_is_keyword(start, length, "select")) return TOKEN_SELECT;
+      break;
   }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  return TOKEN_WORD;
+}
+
+/*
+Return the next token and advance past it. Words and integers are
+classified in the same pass that finds where they end, and integers are
+accumulated with overflow detection instead of atoi.
+*/
+Token lexer_next(Lexer* lexer) {
+  const char* p = lexer->position;
+  const char* end = lexer->end;
+  Token token = {TOKEN_END, NULL, 0, 0, false, false};
+
+  while (p < end && is_space(*p)) {
+    p++;
   }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  token.start = p;
+  if (p == end) {
+    lexer->position = p;
+    return token;
   }
 
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
-
-  return PREPARE_SUCCESS;
-}
+  if (*p == '\'' || *p == '"') {
+    char quote = *p++;
+    token.start = p;
+    while (p < end && *p != quote) {
+      p++;
+    }
+    if (p == end) {
+      token.type = TOKEN_INVALID;
+      lexer->position = p;
+      return token;
+    }
+    token.type = TOKEN_STRING;
+    token.length = p - token.start;
+    lexer->position = p + 1;
+    return token;
+  }
 
-PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement) {
-   statement->type = STATEMENT_DELETE;
-   strtok(input_buffer->buffer, " ");
-   char* id_string = strtok(NULL, " ");
+  switch (*p) {
+    case (','):
+      token.type = TOKEN_COMMA;
+      break;
+    case ('('):
+      token.type = TOKEN_LEFT_PAREN;
+      break;
+    case (')'):
+      token.type = TOKEN_RIGHT_PAREN;
+      break;
+    case ('='):
+      token.type = TOKEN_EQUAL;
+      break;
+    case ('<'):
+      token.type = TOKEN_LESS;
+      if (p + 1 < end && p[1] == '=') {
+        token.type = TOKEN_LESS_EQUAL;
+      } else if (p + 1 < end && p[1] == '>') {
+        token.type = TOKEN_NOT_EQUAL;
+      }
+      break;
+    case ('>'):
+      token.type = TOKEN_GREATER;
+      if (p + 1 < end && p[1] == '=') {
+        token.type = TOKEN_GREATER_EQUAL;
+      }
+      break;
+    case ('!'):
+      token.type = TOKEN_INVALID;
+      if (p + 1 < end && p[1] == '=') {
+        token.type = TOKEN_NOT_EQUAL;
+      }
+      break;
+  }
+  if (token.type != TOKEN_END) {
+    bool two_characters = token.type == TOKEN_LESS_EQUAL ||
+                          token.type == TOKEN_GREATER_EQUAL ||
+                          token.type == TOKEN_NOT_EQUAL;
+    token.length = two_characters ? 2 : 1;
+    lexer->position = p + token.length;
+    return token;
+  }
 
-   if (id_string == NULL) {
-    return PREPARE_SYNTAX_ERROR;
-   }
+  const char* digits = p;
+  if (*p == '-') {
+    token.negative = true;
+    digits++;
+  }
+  uint64_t value = 0;
+  const char* q = digits;
+  while (q < end && *q >= '0' && *q <= '9') {
+    if (value <= UINT32_MAX) {
+      value = value * 10 + (*q - '0');
+    }
+    q++;
+  }
+  bool all_digits = q > digits && (q == end || is_delimiter(*q));
+  while (q < end && !is_delimiter(*q)) {
+    q++;
+  }
+  token.length = q - p;
+  lexer->position = q;
 
-   int id = atoi(id_string);
-    if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
+  if (all_digits) {
+    token.type = TOKEN_INTEGER;
+    token.overflow = value > UINT32_MAX;
+    token.integer = (uint32_t)value;
+  } else {
+    token.negative = false;
+    token.type = keyword_type(p, token.length);
   }
+  return token;
+}
 
-  statement->delete_id = id;
+/* Any word, number or string can be used as a column value, including keywords */
+bool token_is_value(Token* token) {
+  switch (token->type) {
+    case (TOKEN_END):
+    case (TOKEN_INVALID):
+    case (TOKEN_COMMA):
+    case (TOKEN_LEFT_PAREN):
+    case (TOKEN_RIGHT_PAREN):
+    case (TOKEN_STAR):
+    case (TOKEN_EQUAL):
+    case (TOKEN_NOT_EQUAL):
+    case (TOKEN_LESS):
+    case (TOKEN_LESS_EQUAL):
+    case (TOKEN_GREATER):
+    case (TOKEN_GREATER_EQUAL):
+      return false;
+    default:
+      return true;
+  }
+}
 
-  return PREPARE_SUCCESS;
+bool token_is_parameter(Token* token) {
+  return token->type == TOKEN_WORD && token->length == 1 && token->start[0] == '?';
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buffer,
-                                Statement* statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement);
+PrepareResult token_to_id(Token* token, uint32_t* id) {
+  if (token->type != TOKEN_INTEGER) {
+    return PREPARE_SYNTAX_ERROR;
   }
-  if (strcmp(input_buffer->buffer, "select") == 0) {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+  if (token->negative && token->integer != 0) {
+    return PREPARE_NEGATIVE_ID;
   }
-  if (strncmp(input_buffer->buffer, "delete", 6) == 0) {
-    return prepare_delete(input_buffer, statement);
+  if (token->overflow || token->integer > INT32_MAX) {
+    return PREPARE_ID_TOO_LARGE;
   }
+  *id = token->integer;
+  return PREPARE_SUCCESS;
+}
 
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+PrepareResult expect_end(Lexer* lexer) {
+  Token token = lexer_next(lexer);
+  return token.type == TOKEN_END ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
 }
 
-/*
-Until we start recycling free pages, new pages will always
-go onto the end of the database file
-*/
-uint32_t get_unused_page_num(Pager* pager) { 
-  if (!is_empty_stack(pager)) {
-    return pop_free_page(pager);
-  }
-  else {
-    return pager->num_pages;
+PrepareResult copy_token_text(char* destination, Token* token, uint32_t max_length) {
+  if (token->length > max_length) {
+    return PREPARE_STRING_TOO_LONG;
   }
+  memcpy(destination, token->start, token->length);
+  destination[token->length] = '\0';
+  return PREPARE_SUCCESS;
 }
 
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-  PinnedPages* tracker = init_pinned_pages();
-
-  /*
-  Handle splitting the root.
-  Old root copied to new page, becomes left child.
-  Address of right child passed in.
-  Re-initialize root page to contain the new root node.
-  
-  New root node points to two children.
-  */
+PrepareResult bind_text(char* destination, const char* value, size_t length,
+                        uint32_t max_length, uint32_t column_size) {
+  if (length > max_length) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  memcpy(destination, value, length);
+  memset(destination + length, 0, column_size - length);
+  return PREPARE_SUCCESS;
+}
 
-  char* root = get_page(table->pager, table->root_page_num, tracker);
-  char* right_child = get_page(table->pager, right_child_page_num, tracker);
-  uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  char* left_child = get_page(table->pager, left_child_page_num, tracker);
+/*
+The values are validated and encoded straight into the statement's row
+buffer in the leaf cell format, so the tree copies them only once more,
+into the cell they end up in.
+*/
+PrepareResult prepare_insert(Lexer* lexer, Statement* statement) {
+  statement->type = STATEMENT_INSERT;
+  Token id_token = lexer_next(lexer);
+  Token username = lexer_next(lexer);
+  Token email = lexer_next(lexer);
 
-  if (get_node_type(root) == NODE_INTERNAL) {
-    initialize_internal_node(right_child);
-    initialize_internal_node(left_child);
+  if (!token_is_value(&id_token) || !token_is_value(&username) ||
+      !token_is_value(&email)) {
+    return PREPARE_SYNTAX_ERROR;
   }
 
-  /* Left child has data copied from old root */
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
-
-  if (get_node_type(left_child) == NODE_INTERNAL) {
-    char* child;
-    for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
-      child = get_page(table->pager, *internal_node_child(left_child,i), tracker);
-      *node_parent(child) = left_child_page_num;
-    }
-    child = get_page(table->pager, *internal_node_right_child(left_child), tracker);
-    *node_parent(child) = left_child_page_num;
+  uint32_t id;
+  PrepareResult result = token_to_id(&id_token, &id);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  memcpy(statement->row_value + ID_OFFSET, &id, ID_SIZE);
+  result = bind_text(statement->row_value + USERNAME_OFFSET, username.start,
+                     username.length, COLUMN_USERNAME_SIZE, USERNAME_SIZE);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  result = bind_text(statement->row_value + EMAIL_OFFSET, email.start, email.length,
+                     COLUMN_EMAIL_SIZE, EMAIL_SIZE);
+  if (result != PREPARE_SUCCESS) {
+    return result;
   }
 
-  /* Root node is a new internal node with one key and two children */
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
+  return expect_end(lexer);
+}
 
-  unpin_all_pages(table->pager, tracker);
+PrepareResult prepare_delete(Lexer* lexer, Statement* statement) {
+  statement->type = STATEMENT_DELETE;
+  Token id_token = lexer_next(lexer);
 
-}
+  if (!token_is_value(&id_token)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
 
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num);
+  uint32_t id;
+  PrepareResult result = token_to_id(&id_token, &id);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
 
-void update_internal_node_key(char* node, uint32_t old_key, uint32_t new_key);
+  statement->delete_id = id;
 
-void internal_node_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num) {
+  return expect_end(lexer);
+}
 
-  PinnedPages* tracker = init_pinned_pages();
+bool token_to_column(Token* token, Column* column) {
+  if (token->type != TOKEN_WORD) {
+    return false;
+  }
+  if (token_is_keyword(token->start, token->length, "id")) {
+    *column = COLUMN_ID;
+  } else if (token_is_keyword(token->start, token->length, "username")) {
+    *column = COLUMN_USERNAME;
+  } else if (token_is_keyword(token->start, token->length, "email")) {
+    *column = COLUMN_EMAIL;
+  } else {
+    return false;
+  }
+  return true;
+}
 
-  /*
-  Add a new child/key pair to parent that corresponds to child
-  */
+AggregateType token_to_aggregate(Token* token) {
+  if (token->type != TOKEN_WORD) {
+    return AGGREGATE_NONE;
+  }
+  if (token_is_keyword(token->start, token->length, "count")) return AGGREGATE_COUNT;
+  if (token_is_keyword(token->start, token->length, "sum")) return AGGREGATE_SUM;
+  if (token_is_keyword(token->start, token->length, "min")) return AGGREGATE_MIN;
+  if (token_is_keyword(token->start, token->length, "max")) return AGGREGATE_MAX;
+  if (token_is_keyword(token->start, token->length, "approx_count_distinct")) {
+    return AGGREGATE_APPROX_DISTINCT;
+  }
+  return AGGREGATE_NONE;
+}
 
-  char* parent = get_page(table->pager, parent_page_num, tracker);
-  char* child = get_page(table->pager, child_page_num, tracker);
+bool token_to_compare_op(Token* token, CompareOp* op) {
+  switch (token->type) {
+    case (TOKEN_EQUAL):
+      *op = COMPARE_EQUAL;
+      return true;
+    case (TOKEN_NOT_EQUAL):
+      *op = COMPARE_NOT_EQUAL;
+      return true;
+    case (TOKEN_LESS):
+      *op = COMPARE_LESS;
+      return true;
+    case (TOKEN_LESS_EQUAL):
+      *op = COMPARE_LESS_EQUAL;
+      return true;
+    case (TOKEN_GREATER):
+      *op = COMPARE_GREATER;
+      return true;
+    case (TOKEN_GREATER_EQUAL):
+      *op = COMPARE_GREATER_EQUAL;
+      return true;
+    case (TOKEN_WORD):
+      if (token_is_keyword(token->start, token->length, "prefix")) {
+        *op = COMPARE_PREFIX;
+        return true;
+      }
+      if (token_is_keyword(token->start, token->length, "suffix")) {
+        *op = COMPARE_SUFFIX;
+        return true;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
 
-  uint32_t child_max_key = get_node_max_key(table->pager, child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
+/* A column name, or domain(email) for the part of an email after its '@' */
+PrepareResult prepare_expression(Lexer* lexer, Token* token, Column* column,
+                                 ColumnFunction* function) {
+  *function = FUNCTION_NONE;
+  if (token->type != TOKEN_WORD ||
+      !token_is_keyword(token->start, token->length, "domain")) {
+    return token_to_column(token, column) ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+  }
 
-  if (original_num_keys >= INTERNAL_NODE_MAX_KEYS) {
-    internal_node_split_and_insert(table, parent_page_num, child_page_num);
-    return;
+  if (lexer_next(lexer).type != TOKEN_LEFT_PAREN) {
+    return PREPARE_SYNTAX_ERROR;
   }
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  /*
-  An internal node with a right child of INVALID_PAGE_NUM is empty
-  */
-  if (right_child_page_num == INVALID_PAGE_NUM) {
-    *internal_node_right_child(parent) = child_page_num;
-    unpin_all_pages(table->pager, tracker);
-    return;
+  Token argument = lexer_next(lexer);
+  if (!token_to_column(&argument, column) || *column != COLUMN_EMAIL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (lexer_next(lexer).type != TOKEN_RIGHT_PAREN) {
+    return PREPARE_SYNTAX_ERROR;
   }
+  *function = FUNCTION_DOMAIN;
+  return PREPARE_SUCCESS;
+}
 
-  char* right_child = get_page(table->pager, right_child_page_num, tracker);  
-  /*
-  If we are already at the max number of cells for a node, we cannot increment
-  before splitting. Incrementing without inserting a new key/child pair
-  and immediately calling internal_node_split_and_insert has the effect
-  of creating a new key at (max_cells + 1) with an uninitialized value
-  */
-  *internal_node_num_keys(parent) = original_num_keys + 1;
+/*
+Parse one projection starting at token: '*', an expression, or an
+aggregate such as count(*) or max(id). Sums, minimums and maximums are
+only defined over id.
+*/
+PrepareResult prepare_projection(Lexer* lexer, Token* token, SelectQuery* query) {
+  if (token->type == TOKEN_STAR) {
+    Column columns[] = {COLUMN_ID, COLUMN_USERNAME, COLUMN_EMAIL};
+    for (uint32_t i = 0; i < 3; i++) {
+      if (query->num_projections >= MAX_PROJECTIONS) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      query->projections[query->num_projections].aggregate = AGGREGATE_NONE;
+      query->projections[query->num_projections].column = columns[i];
+      query->projections[query->num_projections].function = FUNCTION_NONE;
+      query->num_projections += 1;
+    }
+    return PREPARE_SUCCESS;
+  }
+  if (query->num_projections >= MAX_PROJECTIONS) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Projection* projection = &query->projections[query->num_projections];
+
+  projection->aggregate = token_to_aggregate(token);
+  projection->function = FUNCTION_NONE;
+  if (projection->aggregate == AGGREGATE_NONE) {
+    PrepareResult result = prepare_expression(lexer, token, &projection->column,
+                                              &projection->function);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    query->num_projections += 1;
+    return PREPARE_SUCCESS;
+  }
 
-  if (child_max_key > get_node_max_key(table->pager, right_child)) {
-    /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(table->pager, right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  } else {
-    /* Make room for the new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      char* destination = (char*)internal_node_cell(parent, i);
-      char* source = (char*)internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+  Token argument;
+  if (lexer_next(lexer).type != TOKEN_LEFT_PAREN) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  argument = lexer_next(lexer);
+  if (projection->aggregate == AGGREGATE_APPROX_DISTINCT) {
+    PrepareResult result = prepare_expression(lexer, &argument, &projection->column,
+                                              &projection->function);
+    if (result != PREPARE_SUCCESS || projection->column == COLUMN_ID) {
+      return PREPARE_SYNTAX_ERROR;
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+  } else if (argument.type == TOKEN_STAR && projection->aggregate == AGGREGATE_COUNT) {
+    projection->column = COLUMN_ID;
+  } else if (!token_to_column(&argument, &projection->column)) {
+    return PREPARE_SYNTAX_ERROR;
+  } else if (projection->aggregate != AGGREGATE_COUNT &&
+             projection->column != COLUMN_ID) {
+    return PREPARE_SYNTAX_ERROR;
   }
-  unpin_all_pages(table->pager, tracker);
+  if (lexer_next(lexer).type != TOKEN_RIGHT_PAREN) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  query->has_aggregates = true;
+  query->num_projections += 1;
+  return PREPARE_SUCCESS;
 }
 
-void update_internal_node_key(char* node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+/*
+A like pattern may only have '%' at its start and end: 'x%' is a prefix,
+'%x' a suffix and '%x%' a substring search. '_' matches itself.
+*/
+PrepareResult like_pattern_to_predicate(Predicate* predicate) {
+  char* text = predicate->text;
+  size_t length = strlen(text);
+  bool leading = length > 0 && text[0] == '%';
+  bool trailing = length > leading && text[length - 1] == '%';
+  memmove(text, text + leading, length - leading - trailing);
+  text[length - leading - trailing] = '\0';
+  if (strchr(text, '%') != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (leading && trailing) {
+    predicate->op = COMPARE_CONTAINS;
+  } else if (leading) {
+    predicate->op = COMPARE_SUFFIX;
+  } else if (trailing) {
+    predicate->op = COMPARE_PREFIX;
+  } else {
+    predicate->op = COMPARE_EQUAL;
+  }
+  return PREPARE_SUCCESS;
 }
 
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num) {
+int compare_ids(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
 
-  PinnedPages* tracker = init_pinned_pages();
+/*
+id in (<id>, ...), kept sorted and without duplicates for the batched lookup.
+The list is counted first so it takes only the arena space it needs.
+*/
+PrepareResult prepare_in_list(Lexer* lexer, SelectQuery* query, Arena* arena) {
+  if (query->num_in_ids > 0 || lexer_next(lexer).type != TOKEN_LEFT_PAREN) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Lexer counter = *lexer;
+  uint32_t capacity = 1;
+  for (Token token = lexer_next(&counter);
+       token.type != TOKEN_RIGHT_PAREN && token.type != TOKEN_END; token = lexer_next(&counter)) {
+    capacity += token.type == TOKEN_COMMA;
+  }
+  if (capacity > MAX_IN_IDS) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  query->in_ids = arena_alloc(arena, capacity * sizeof(uint32_t));
 
-  uint32_t old_page_num = parent_page_num;
-
-  char* old_node = get_page(table->pager, parent_page_num, tracker);
-  uint32_t old_max = get_node_max_key(table->pager, old_node);
-  char* child = get_page(table->pager, child_page_num, tracker); 
-  uint32_t child_max = get_node_max_key(table->pager, child);
+  uint32_t count = 0;
+  while (true) {
+    Token value = lexer_next(lexer);
+    if (count >= capacity) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    PrepareResult result = token_to_id(&value, &query->in_ids[count]);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    count++;
+    Token token = lexer_next(lexer);
+    if (token.type == TOKEN_RIGHT_PAREN) {
+      break;
+    }
+    if (token.type != TOKEN_COMMA) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  qsort(query->in_ids, count, sizeof(uint32_t), compare_ids);
+  query->num_in_ids = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (i == 0 || query->in_ids[i] != query->in_ids[i - 1]) {
+      query->in_ids[query->num_in_ids++] = query->in_ids[i];
+    }
+  }
+  return PREPARE_SUCCESS;
+}
 
-  uint32_t new_page_num = get_unused_page_num(table->pager);
+PrepareResult prepare_predicate(Lexer* lexer, Token* token, SelectQuery* query, Arena* arena) {
+  if (query->num_predicates >= MAX_PREDICATES) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Predicate* predicate = &query->predicates[query->num_predicates];
 
-  /*
-  Declaring a flag before updating pointers which
-  records whether this operation involves splitting the root -
-  if it does, we will insert our newly created node during
-  the step where the table's new root is created. If it does
-  not, we have to insert the newly created node into its parent
-  after the old node's keys have been transferred over. We are not
-  able to do this if the newly created node's parent is not a newly
-  initialized root node, because in that case its parent may have existing
-  keys aside from our old node which we are splitting. If that is true, we
-  need to find a place for our newly created node in its parent, and we
-  cannot insert it at the correct index if it does not yet have any keys
-  */
-  uint32_t splitting_root = is_node_root(old_node);
+  if (!token_to_column(token, &predicate->column)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Token op = lexer_next(lexer);
+  if (predicate->column == COLUMN_ID && token_is_keyword(op.start, op.length, "in")) {
+    predicate->op = COMPARE_IN;
+    predicate->integer = 0;
+    PrepareResult result = prepare_in_list(lexer, query, arena);
+    if (result == PREPARE_SUCCESS) {
+      query->num_predicates += 1;
+    }
+    return result;
+  }
+  bool like = token_is_keyword(op.start, op.length, "like");
+  if (!like && !token_to_compare_op(&op, &predicate->op)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (predicate->column == COLUMN_ID &&
+      (like || predicate->op == COMPARE_PREFIX || predicate->op == COMPARE_SUFFIX)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Token value = lexer_next(lexer);
+  if (!token_is_value(&value)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
 
-  char* parent;
-  char* new_node;
-  if (splitting_root) {
-    create_new_root(table, new_page_num);
-    parent = get_page(table->pager,table->root_page_num, tracker);
-    /*
-    If we are splitting the root, we need to update old_node to point
-    to the new root's left child, new_page_num will already point to
-    the new root's right child
-    */
-    old_page_num = *internal_node_child(parent,0);
+  PrepareResult result;
+  switch (predicate->column) {
+    case (COLUMN_ID):
+      result = token_to_id(&value, &predicate->integer);
+      break;
+    case (COLUMN_USERNAME):
+      result = copy_token_text(predicate->text, &value, COLUMN_USERNAME_SIZE);
+      break;
+    default:
+      result = copy_token_text(predicate->text, &value, COLUMN_EMAIL_SIZE);
+      break;
+  }
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  if (like) {
+    result = like_pattern_to_predicate(predicate);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  }
+  query->num_predicates += 1;
+  return PREPARE_SUCCESS;
+}
 
-    old_node = get_page(table->pager, old_page_num, tracker);
+PrepareResult prepare_select(Lexer* lexer, Statement* statement, Table* table) {
+  statement->type = STATEMENT_SELECT;
+  SelectQuery* query = &statement->select;
+  query->num_projections = 0;
+  query->num_predicates = 0;
+  query->has_aggregates = false;
+  query->has_group_by = false;
+  query->has_order_by = false;
+  query->order_descending = false;
+  query->has_limit = false;
+  query->limit = 0;
+  query->num_in_ids = 0;
+  query->in_ids = NULL;
+  query->has_sample = false;
+
+  PrepareResult result;
+  Token token = lexer_next(lexer);
+
+  if (token.type != TOKEN_WHERE && token.type != TOKEN_GROUP &&
+      token.type != TOKEN_ORDER && token.type != TOKEN_LIMIT &&
+      token.type != TOKEN_END && !token_is_keyword(token.start, token.length, "sample")) {
+    while (true) {
+      result = prepare_projection(lexer, &token, query);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+      token = lexer_next(lexer);
+      if (token.type != TOKEN_COMMA) {
+        break;
+      }
+      token = lexer_next(lexer);
+    }
+  }
+  if (query->num_projections == 0) {
+    Token star = {TOKEN_STAR, "*", 1, 0, false, false};
+    prepare_projection(lexer, &star, query);
+  }
 
-  } else {
-    parent = get_page(table->pager,*node_parent(old_node), tracker);
-    new_node = get_page(table->pager, new_page_num, tracker);
-    initialize_internal_node(new_node);
+  /* select [<projection>, ...] sample <n> stands alone */
+  if (token_is_keyword(token.start, token.length, "sample")) {
+    Token size = lexer_next(lexer);
+    if (query->has_aggregates || token_to_id(&size, &query->sample_size) != PREPARE_SUCCESS ||
+        query->sample_size == 0 || query->sample_size > MAX_SAMPLE_SIZE) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    query->has_sample = true;
+    return expect_end(lexer);
   }
-  uint32_t* old_num_keys = internal_node_num_keys(old_node);
 
-  uint32_t cur_page_num = *internal_node_right_child(old_node);
-  char* cur = get_page(table->pager, cur_page_num, tracker);
+  if (token.type == TOKEN_WHERE) {
+    while (true) {
+      token = lexer_next(lexer);
+      result = prepare_predicate(lexer, &token, query, &table->pager->arena);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+      token = lexer_next(lexer);
+      if (token.type != TOKEN_AND) {
+        break;
+      }
+    }
+  }
 
-  /*
-  First put right child into new node and set right child of old node to invalid page number
-  */
-  internal_node_insert(table, new_page_num, cur_page_num);
-  *node_parent(cur) = new_page_num;
-  *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
+  if (token.type == TOKEN_GROUP) {
+    if (lexer_next(lexer).type != TOKEN_BY) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    token = lexer_next(lexer);
+    result = prepare_expression(lexer, &token, &query->group_column,
+                                &query->group_function);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    query->has_group_by = true;
+    token = lexer_next(lexer);
+  }
+  for (uint32_t i = 0; i < query->num_projections; i++) {
+    Projection* projection = &query->projections[i];
+    if (projection->aggregate != AGGREGATE_NONE) {
+      continue;
+    }
+    if (query->has_group_by) {
+      /* Every plain projection of a group by must be the grouped expression */
+      if (projection->column != query->group_column ||
+          projection->function != query->group_function) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+    } else if (query->has_aggregates) {
+      /* Mixing plain columns with aggregates needs a group by */
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  /* Sketches cover whole columns, so approximate counts stand alone */
+  for (uint32_t i = 0; i < query->num_projections; i++) {
+    bool approximate = query->projections[i].aggregate == AGGREGATE_APPROX_DISTINCT;
+    if (approximate != (query->projections[0].aggregate == AGGREGATE_APPROX_DISTINCT) ||
+        (approximate && (query->num_predicates > 0 || query->has_group_by))) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
 
-  /*
-  For each key until you get to the middle key, move the key and the child to the new node
-  */
-  for (int i = INTERNAL_NODE_MAX_KEYS - 1; i 
-    > INTERNAL_NODE_MAX_KEYS / 2; i--) {
-    cur_page_num = *internal_node_child(old_node, i);
-    cur = get_page(table->pager, cur_page_num, tracker);
-    internal_node_insert(table, new_page_num, cur_page_num);
-    *node_parent(cur) = new_page_num;
-    (*old_num_keys)--;
+  if (token.type == TOKEN_ORDER) {
+    if (query->has_aggregates || query->has_group_by ||
+        lexer_next(lexer).type != TOKEN_BY) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    token = lexer_next(lexer);
+    if (!token_to_column(&token, &query->order_column)) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    query->has_order_by = true;
+    token = lexer_next(lexer);
+    if (token.type == TOKEN_ASC || token.type == TOKEN_DESC) {
+      query->order_descending = token.type == TOKEN_DESC;
+      token = lexer_next(lexer);
+    }
   }
 
-  /*
-  Set child before middle key, which is now the highest key, to be node's right child,
-  and decrement number of keys
-  */
-  *internal_node_right_child(old_node) = *internal_node_child(old_node,*old_num_keys - 1);
-  (*old_num_keys)--;
+  if (token.type == TOKEN_LIMIT) {
+    Token limit = lexer_next(lexer);
+    result = token_to_id(&limit, &query->limit);
+    if (result != PREPARE_SUCCESS) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    query->has_limit = true;
+    token = lexer_next(lexer);
+  }
 
-  /*
-  Determine which of the two nodes after the split should contain the child to be inserted,
-  and insert the child
-  */
-  uint32_t max_after_split = get_node_max_key(table->pager, old_node);
+  return token.type == TOKEN_END ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
 
-  uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
+PreparedStatement* find_prepared_statement(Table* table, const char* name,
+                                           size_t length) {
+  for (uint32_t i = 0; i < table->num_prepared_statements; i++) {
+    char* candidate = table->prepared_statements[i].name;
+    if (strlen(candidate) == length && memcmp(candidate, name, length) == 0) {
+      return &table->prepared_statements[i];
+    }
+  }
+  return NULL;
+}
 
-  internal_node_insert(table, destination_page_num, child_page_num);
-  *node_parent(child) = destination_page_num;
-  update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
-  if (!splitting_root) {
-    internal_node_insert(table,*node_parent(old_node),new_page_num);
-    *node_parent(new_node) = *node_parent(old_node);
+PrepareResult bind_id(PreparedStatement* prepared, uint32_t id) {
+  if (prepared->type == STATEMENT_DELETE) {
+    prepared->delete_id = id;
+  } else {
+    memcpy(prepared->row_value + ID_OFFSET, &id, ID_SIZE);
   }
-  unpin_all_pages(table->pager, tracker);
+  return PREPARE_SUCCESS;
 }
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
+PrepareResult bind_column(PreparedStatement* prepared, Column column,
+                          Token* value) {
+  uint32_t id;
+  PrepareResult result;
+
+  switch (column) {
+    case (COLUMN_ID):
+      result = token_to_id(value, &id);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+      return bind_id(prepared, id);
+    case (COLUMN_USERNAME):
+      return bind_text(prepared->row_value + USERNAME_OFFSET, value->start,
+                       value->length, COLUMN_USERNAME_SIZE, USERNAME_SIZE);
+    case (COLUMN_EMAIL):
+      return bind_text(prepared->row_value + EMAIL_OFFSET, value->start,
+                       value->length, COLUMN_EMAIL_SIZE, EMAIL_SIZE);
+  }
+  return PREPARE_SYNTAX_ERROR;
+}
 
-  PinnedPages* tracker = init_pinned_pages();
+/*
+Parse a statement template such as "insert ? ? ?" or "delete ?" once.
+Literal values in the template are bound immediately; every '?' becomes
+a parameter that has to be bound before each execution.
+*/
+PrepareResult prepare_template(Lexer* lexer, PreparedStatement* prepared) {
+  Column columns[MAX_STATEMENT_PARAMETERS] = {
+      COLUMN_ID, COLUMN_USERNAME, COLUMN_EMAIL};
+  uint32_t num_columns;
+
+  Token keyword = lexer_next(lexer);
+  switch (keyword.type) {
+    case (TOKEN_INSERT):
+      prepared->type = STATEMENT_INSERT;
+      num_columns = 3;
+      break;
+    case (TOKEN_DELETE):
+      prepared->type = STATEMENT_DELETE;
+      num_columns = 1;
+      break;
+    case (TOKEN_END):
+      return PREPARE_SYNTAX_ERROR;
+    default:
+      return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
 
-  /*
-  Create a new node and move half the cells over.
-  Insert the new value in one of the two nodes.
-  Update parent or create a new parent.
- 
-  */
-  char* old_node = get_page(cursor->table->pager, cursor->page_num, tracker);
-  uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  char* new_node = get_page(cursor->table->pager, new_page_num, tracker);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
+  prepared->num_parameters = 0;
+  prepared->delete_id = 0;
+  memset(prepared->row_value, 0, ROW_VALUE_SIZE);
 
-  /*
-  All existing keys plus new key should should be divided
-  evenly between old (left) and new (right) nodes.
-  Starting from the right, move each key to correct position.
-  */
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    char* destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = new_node;
-    } else {
-      destination_node = old_node;
+  for (uint32_t i = 0; i < num_columns; i++) {
+    Token token = lexer_next(lexer);
+    if (!token_is_value(&token)) {
+      return PREPARE_SYNTAX_ERROR;
     }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    char* destination = leaf_node_cell(destination_node, index_within_node);
-
-    if (i == cursor->cell_num) {
-      serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+    if (token_is_parameter(&token)) {
+      prepared->parameters[prepared->num_parameters] = columns[i];
+      prepared->num_parameters += 1;
+      continue;
+    }
+    PrepareResult result = bind_column(prepared, columns[i], &token);
+    if (result != PREPARE_SUCCESS) {
+      return result;
     }
   }
+  return expect_end(lexer);
+}
 
-  /* Update cell count on both leaf nodes */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-  if (is_node_root(old_node)) {
-    create_new_root(cursor->table, new_page_num);
-    unpin_all_pages(cursor->table->pager, tracker);
-  } else {
-    uint32_t parent_page_num = *node_parent(old_node);
+PrepareResult prepare_name(Token* token, char* name) {
+  if (token->type == TOKEN_END || token->type == TOKEN_INVALID) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return copy_token_text(name, token, PREPARED_STATEMENT_NAME_SIZE);
+}
 
-    uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-    char* parent = get_page(cursor->table->pager, parent_page_num, tracker);
+PrepareResult prepare_prepare(Lexer* lexer, Statement* statement) {
+  statement->type = STATEMENT_PREPARE;
+  Token name = lexer_next(lexer);
 
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
-    unpin_all_pages(cursor->table->pager, tracker);
-    return;
+  PrepareResult result = prepare_name(&name, statement->to_prepare.name);
+  if (result != PREPARE_SUCCESS) {
+    return result;
   }
+  return prepare_template(lexer, &statement->to_prepare);
 }
 
+PrepareResult prepare_execute(Lexer* lexer, Statement* statement, Table* table) {
+  statement->type = STATEMENT_EXECUTE;
+  Token name = lexer_next(lexer);
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
+  if (!token_is_value(&name)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  PreparedStatement* prepared = find_prepared_statement(table, name.start, name.length);
+  if (prepared == NULL) {
+    return PREPARE_UNKNOWN_PREPARED_STATEMENT;
+  }
 
-  PinnedPages* tracker = init_pinned_pages();
+  /* Bind into a copy so a bad value leaves the earlier bindings as they were */
+  PreparedStatement bound = *prepared;
+  for (uint32_t i = 0; i < bound.num_parameters; i++) {
+    Token value = lexer_next(lexer);
+    if (!token_is_value(&value)) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    PrepareResult result = bind_column(&bound, bound.parameters[i], &value);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  }
+  PrepareResult result = expect_end(lexer);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
 
-  char* node = get_page(cursor->table->pager, cursor->page_num, tracker);
+  *prepared = bound;
+  statement->prepared = prepared;
+  return PREPARE_SUCCESS;
+}
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    // Node full
-    leaf_node_split_and_insert(cursor, key, value);
-    unpin_all_pages(cursor->table->pager, tracker);
-    return;
+/*
+create [reverse | trigram] index on <username | email>
+create hash index on id
+id is already the key of the table's own B+tree, so only a hash index can be built on it.
+A reverse index orders rows by their value read backwards, for suffix searches;
+a trigram index posts every row under each three byte sequence of its value.
+*/
+/* create aggregate view on <expression>, after the word aggregate */
+PrepareResult prepare_create_view(Lexer* lexer, Statement* statement) {
+  statement->type = STATEMENT_CREATE_VIEW;
+  Token token = lexer_next(lexer);
+  if (!token_is_keyword(token.start, token.length, "view") ||
+      lexer_next(lexer).type != TOKEN_ON) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  token = lexer_next(lexer);
+  PrepareResult result =
+      prepare_expression(lexer, &token, &statement->index_column, &statement->view_function);
+  if (result != PREPARE_SUCCESS) {
+    return result;
   }
+  if (statement->index_column == COLUMN_ID) {
+    return PREPARE_SYNTAX_ERROR;  // every id is its own group
+  }
+  return expect_end(lexer);
+}
 
-  if (cursor->cell_num < num_cells) {
-    // Make room for new cell
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
-    } 
+PrepareResult prepare_create(Lexer* lexer, Statement* statement) {
+  statement->type = STATEMENT_CREATE_INDEX;
+  Token token = lexer_next(lexer);
+  if (token_is_keyword(token.start, token.length, "aggregate")) {
+    return prepare_create_view(lexer, statement);
+  }
+  statement->hash_index = token_is_keyword(token.start, token.length, "hash");
+  statement->reverse_index = token_is_keyword(token.start, token.length, "reverse");
+  statement->trigram_index = token_is_keyword(token.start, token.length, "trigram");
+  if (statement->hash_index || statement->reverse_index || statement->trigram_index) {
+    token = lexer_next(lexer);
+  }
+  if (token.type != TOKEN_INDEX || lexer_next(lexer).type != TOKEN_ON) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Token column = lexer_next(lexer);
+  if (!token_to_column(&column, &statement->index_column) ||
+      (statement->index_column == COLUMN_ID) != statement->hash_index) {
+    return PREPARE_SYNTAX_ERROR;
   }
+  return expect_end(lexer);
+}
 
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
-  unpin_all_pages(cursor->table->pager, tracker);
+/*
+Parse a statement in a single pass over the input buffer. The buffer is
+not modified, and no token text is allocated or copied until a value is
+stored into the statement.
+*/
+PrepareResult prepare_statement(InputBuffer* input_buffer,
+                                Statement* statement, Table* table) {
+  Lexer lexer;
+  lexer_init(&lexer, input_buffer->buffer, input_buffer->input_length);
+
+  Token keyword = lexer_next(&lexer);
+  statement->explain = keyword.type == TOKEN_EXPLAIN;
+  if (statement->explain) {
+    keyword = lexer_next(&lexer);
+    if (keyword.type == TOKEN_PREPARE || keyword.type == TOKEN_EXECUTE ||
+        keyword.type == TOKEN_CREATE) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  switch (keyword.type) {
+    case (TOKEN_INSERT):
+      return prepare_insert(&lexer, statement);
+    case (TOKEN_SELECT):
+      return prepare_select(&lexer, statement, table);
+    case (TOKEN_DELETE):
+      return prepare_delete(&lexer, statement);
+    case (TOKEN_PREPARE):
+      return prepare_prepare(&lexer, statement);
+    case (TOKEN_EXECUTE):
+      return prepare_execute(&lexer, statement, table);
+    case (TOKEN_CREATE):
+      return prepare_create(&lexer, statement);
+    default:
+      return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
 }
 
-void internal_node_merge(Table* table, uint32_t page_num);
+/*
+Time prepare_statement alone over a fixed mix of statements so parsing
+cost can be tracked separately from execution.
+*/
+void bench_parse(Table* table, uint32_t iterations) {
+  const char* statements[] = {
+      "insert 12345 user12345 person12345@example.com",
+      "insert 7 'john smith' \"john.smith@example.com\"",
+      "delete 12345",
+      "select",
+  };
+  uint32_t num_statements = sizeof(statements) / sizeof(statements[0]);
+  InputBuffer input_buffer;
+  Statement statement;
+  uint32_t failures = 0;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < iterations; i++) {
+    for (uint32_t j = 0; j < num_statements; j++) {
+      input_buffer.buffer = (char*)statements[j];
+      input_buffer.input_length = strlen(statements[j]);
+      if (prepare_statement(&input_buffer, &statement, table) != PREPARE_SUCCESS) {
+        failures += 1;
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  uint64_t total = (uint64_t)iterations * num_statements;
+  double elapsed_ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  printf("parse: %lu statements, %.1f ns/statement", (unsigned long)total,
+         total ? elapsed_ns / total : 0.0);
+  if (failures) {
+    printf(", %u failed", failures);
+  }
+  printf("\n");
+}
 
-void internal_node_delete(Table* table, uint32_t parent_page_num, uint32_t child_page_num, uint32_t index) {
+bool table_find_row(Table* table, uint32_t id, Row* row);
+uint32_t table_find_rows_interleaved(Table* table, const uint32_t* ids, uint32_t num_ids,
+                                     Row* rows, bool* found);
+void key_filter_hashes(uint32_t id, uint64_t* h1, uint64_t* h2);
 
-  PinnedPages* tracker = init_pinned_pages();
+/*
+Time the same random point lookups done one descent at a time and
+interleaved, to show what overlapping the descents saves. Ids are drawn up
+to the largest key, so sparse tables include misses.
+*/
+void bench_lookups(Table* table, uint32_t num_lookups) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  char* root = get_page(table->pager, table->root_page_num, tracker);
+  uint32_t max_key = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0
+                         ? 0
+                         : get_node_max_key(table->pager, root);
+  unpin_all_pages(table->pager, tracker);
+  if (max_key == 0) {
+    printf("lookups: table is empty\n");
+    return;
+  }
 
-  /* Fetch the child to be deleted and its internal node. */
+  uint32_t* ids = memory_alloc(MEMORY_SCRATCH, sizeof(uint32_t) * num_lookups);
+  Row* rows = memory_alloc(MEMORY_SCRATCH, sizeof(Row) * num_lookups);
+  bool* found = memory_alloc(MEMORY_SCRATCH, sizeof(bool) * num_lookups);
+  if (ids == NULL || rows == NULL || found == NULL) {
+    printf("lookups: out of memory\n");
+    memory_free(ids);
+    memory_free(rows);
+    memory_free(found);
+    return;
+  }
+  for (uint32_t i = 0; i < num_lookups; i++) {
+    uint64_t h1, h2;
+    key_filter_hashes(i, &h1, &h2);
+    ids[i] = 1 + h1 % max_key;
+  }
 
-  char* child = get_page(table->pager, child_page_num, tracker);
-  char* parent = get_page(table->pager, parent_page_num, tracker);
+  struct timespec start, middle, end;
+  uint32_t serial_found = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < num_lookups; i++) {
+    serial_found += table_find_row(table, ids[i], &rows[i]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &middle);
+  uint32_t interleaved_found =
+      table_find_rows_interleaved(table, ids, num_lookups, rows, found);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double serial_ns =
+      (middle.tv_sec - start.tv_sec) * 1e9 + (middle.tv_nsec - start.tv_nsec);
+  double interleaved_ns = (end.tv_sec - middle.tv_sec) * 1e9 + (end.tv_nsec - middle.tv_nsec);
+  printf("lookups: %u ids, %u found, %.1f ns/lookup one at a time, %.1f ns/lookup interleaved",
+         num_lookups, serial_found, serial_ns / num_lookups, interleaved_ns / num_lookups);
+  if (interleaved_found != serial_found) {
+    printf(", interleaved found %u", interleaved_found);
+  }
+  printf("\n");
+  memory_free(ids);
+  memory_free(rows);
+  memory_free(found);
+}
 
-    /* If the child is the right child of its parent, we update the parent's right child pointer to the child directly left of the right child. */
-    if (index == *internal_node_num_keys(parent)) {
-      *internal_node_right_child(parent) = *internal_node_child(parent, index - 1);
-    }
-      
-    /* If the child is not the right child of its parent, we shift all the children after the child's position in the parent one step to the left.*/
-      
-    else {
-      for (uint32_t i = index; i + 1 < *internal_node_num_keys(parent); i++) {
-        memcpy((char*)internal_node_cell(parent, i), (char*)internal_node_cell(parent, i + 1), INTERNAL_NODE_CELL_SIZE);
-      }
-    }
-    /* If the child was the right child of its parent, then we also need to update its key in its parent and
-      so on if the parent is the right child of its own parent. */
+void print_settings(Settings* settings) {
+  printf("sort_memory: %u\n", settings->sort_memory);
+  printf("group_memory: %u\n", settings->group_memory);
+  printf("group_threads: %u\n", settings->group_threads);
+  printf("row_cache: %u\n", settings->row_cache_rows);
+  printf("memory_limit: %u\n", settings->memory_limit);
+}
+
+/*
+.set                 prints every setting
+.set <name> <value>  changes one
+*/
+MetaCommandResult do_set_command(InputBuffer* input_buffer, Table* table) {
+  Lexer lexer;
+  lexer_init(&lexer, input_buffer->buffer, input_buffer->input_length);
+
+  Token command = lexer_next(&lexer);
+  if (!token_is_keyword(command.start, command.length, ".set")) {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  Token name = lexer_next(&lexer);
+  if (name.type == TOKEN_END) {
+    print_settings(&table->settings);
+    return META_COMMAND_SUCCESS;
+  }
+  Token value = lexer_next(&lexer);
+  if (value.type != TOKEN_INTEGER || value.negative || value.overflow ||
+      expect_end(&lexer) != PREPARE_SUCCESS) {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+
+  if (token_is_keyword(name.start, name.length, "sort_memory")) {
+    if (value.integer < 2 * PAGE_SIZE) {
+      printf("sort_memory must be at least %u bytes.\n", 2 * PAGE_SIZE);
+      return META_COMMAND_SUCCESS;
+    }
+    table->settings.sort_memory = value.integer;
+  } else if (token_is_keyword(name.start, name.length, "group_memory")) {
+    if (value.integer < 2 * PAGE_SIZE) {
+      printf("group_memory must be at least %u bytes.\n", 2 * PAGE_SIZE);
+      return META_COMMAND_SUCCESS;
+    }
+    table->settings.group_memory = value.integer;
+  } else if (token_is_keyword(name.start, name.length, "group_threads")) {
+    if (value.integer < 1 || value.integer > MAX_GROUP_THREADS) {
+      printf("group_threads must be between 1 and %d.\n", MAX_GROUP_THREADS);
+      return META_COMMAND_SUCCESS;
+    }
+    table->settings.group_threads = value.integer;
+  } else if (token_is_keyword(name.start, name.length, "row_cache")) {
+    if (value.integer > MAX_ROW_CACHE_ROWS) {
+      printf("row_cache must be at most %d rows.\n", MAX_ROW_CACHE_ROWS);
+      return META_COMMAND_SUCCESS;
+    }
+    table->settings.row_cache_rows = value.integer;
+    row_cache_resize(&table->row_cache, value.integer);
+  } else if (token_is_keyword(name.start, name.length, "memory_limit")) {
+    table->settings.memory_limit = value.integer;
+    memory_accounts.limit = value.integer;
+    table->key_filter.refused = false;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  return META_COMMAND_SUCCESS;
+}
+
+void print_insert_stats(InsertStats* stats) {
+  printf("inserts: %lu rows, %.1f bytes copied/insert\n", (unsigned long)stats->rows,
+         stats->rows ? (double)stats->bytes_copied / stats->rows : 0.0);
+}
+
+void print_row_cache_stats(RowCache* cache) {
+  uint64_t lookups = cache->hits + cache->misses;
+  printf("row cache: %u slots, %lu hits, %lu misses, %.1f%% hit rate\n", cache->num_slots,
+         (unsigned long)cache->hits, (unsigned long)cache->misses,
+         lookups ? 100.0 * cache->hits / lookups : 0.0);
+}
+
+typedef struct {
+  uint32_t loaded;
+  uint32_t pinned;
+  uint32_t internal;
+  uint32_t leaf;
+  uint32_t other;  // catalog, sketch, hash index and free pages
+} PagerResidency;
+
+/* Which kinds of pages the frames hold right now */
+PagerResidency pager_residency(Table* table) {
+  Pager* pager = table->pager;
+  PagerResidency residency = {0, 0, 0, 0, 0};
+  for (LRUNode* node = pager->lru_list.head; node; node = node->next) {
+    uint32_t page_num = node->page_num;
+    residency.loaded += 1;
+    residency.pinned += pager->pinned[page_num] > 0;
+
+    /* Page 0 is always the root, and 0 also stands for no catalog or sketch page */
+    bool other = page_num != 0 && (page_num == *pager_catalog_page_num(pager) ||
+                                   page_num == table->sketches.page_num ||
+                                   page_num == table->key_filter.page_num ||
+                                   page_is_free(pager, page_num));
+    if (table->hash_index && !other) {
+      other = page_num == table->hash_index->directory_page_num;
+      for (uint32_t i = 0; i < (1u << table->hash_index->global_depth) && !other; i++) {
+        other = page_num == table->hash_index->buckets[i];
+      }
+      for (uint32_t i = 0; i < table->hash_index->num_overflow && !other; i++) {
+        other = page_num == table->hash_index->overflow[i];
+      }
+    }
+    if (other) {
+      residency.other += 1;
+    } else if (get_node_type(pager->pages[pager->page_numbers[page_num]]) == NODE_INTERNAL) {
+      residency.internal += 1;
+    } else {
+      residency.leaf += 1;
+    }
+  }
+  return residency;
+}
+
+void print_pager_stats(Table* table) {
+  PagerStats* stats = &table->pager->stats;
+  PagerResidency residency = pager_residency(table);
+  uint64_t lookups = stats->hits + stats->misses;
+  printf("pager: %lu hits, %lu misses, %.1f%% hit rate\n", (unsigned long)stats->hits,
+         (unsigned long)stats->misses, lookups ? 100.0 * stats->hits / lookups : 0.0);
+  printf("file: %lu reads, %lu evictions, %lu write-backs\n", (unsigned long)stats->reads,
+         (unsigned long)stats->evictions, (unsigned long)stats->write_backs);
+  printf("frames: %u of %d loaded (%u internal, %u leaf, %u other), %u pinned, "
+         "%u left pinned by the last statement\n",
+         residency.loaded, MAX_NUM_LOADED_PAGES, residency.internal, residency.leaf,
+         residency.other, residency.pinned, stats->stale_pins);
+  printf("free pages: %u\n", table->pager->freed_pages_count);
+}
+
+/* The same numbers as one JSON object, for scripts */
+void print_pager_stats_json(Table* table) {
+  PagerStats* stats = &table->pager->stats;
+  PagerResidency residency = pager_residency(table);
+  printf("{\"hits\": %lu, \"misses\": %lu, \"reads\": %lu, \"evictions\": %lu, "
+         "\"write_backs\": %lu, \"frames\": %d, \"loaded\": %u, \"internal\": %u, "
+         "\"leaf\": %u, \"other\": %u, \"pinned\": %u, \"stale_pins\": %u, "
+         "\"free_pages\": %u}\n",
+         (unsigned long)stats->hits, (unsigned long)stats->misses, (unsigned long)stats->reads,
+         (unsigned long)stats->evictions, (unsigned long)stats->write_backs,
+         MAX_NUM_LOADED_PAGES, residency.loaded, residency.internal, residency.leaf,
+         residency.other, residency.pinned, stats->stale_pins, table->pager->freed_pages_count);
+}
+
+/* The value at or below which fraction of the samples fall, to the histogram's precision */
+uint64_t latency_percentile(LatencyHistogram* histogram, double fraction) {
+  uint64_t rank = (uint64_t)ceil(fraction * histogram->count);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      uint64_t highest = latency_bucket_highest(i);
+      return highest < histogram->max ? highest : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+void print_latency_stats(Table* table) {
+  for (uint32_t i = 0; i < NUM_LATENCY_KINDS; i++) {
+    LatencyHistogram* histogram = &table->latency[i];
+    if (histogram->count == 0) {
+      /* Calls that were counted but never timed have no latency to report */
+      printf("%s: %lu calls, 0 timed, p50 n/a, p99 n/a, p999 n/a, max n/a\n",
+             latency_kind_names[i], (unsigned long)histogram->calls);
+      continue;
+    }
+    printf("%s: %lu calls, %lu timed, p50 %lu ns, p99 %lu ns, p999 %lu ns, max %lu ns\n",
+           latency_kind_names[i], (unsigned long)histogram->calls, (unsigned long)histogram->count,
+           (unsigned long)latency_percentile(histogram, 0.5),
+           (unsigned long)latency_percentile(histogram, 0.99),
+           (unsigned long)latency_percentile(histogram, 0.999), (unsigned long)histogram->max);
+  }
+}
+
+/*
+.stats cache          prints the row cache's size and hit rate since it was last sized
+.stats inserts        prints the rows inserted and the row bytes copied per insert
+.stats latency        prints how many statements and tree splits and merges ran, with
+                      their p50, p99, p999 and max latency
+.stats latency reset  empties the latency histograms
+.stats pager          prints the pager's hit rate, file traffic and what the frames hold
+.stats pager json     prints the same as one JSON object
+.stats programs       prints how many compiled programs are cached and the cache's hits
+                      and misses
+*/
+MetaCommandResult do_stats_command(InputBuffer* input_buffer, Table* table) {
+  Lexer lexer;
+  lexer_init(&lexer, input_buffer->buffer, input_buffer->input_length);
+
+  Token command = lexer_next(&lexer);
+  if (!token_is_keyword(command.start, command.length, ".stats")) {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  Token name = lexer_next(&lexer);
+  if (token_is_keyword(name.start, name.length, "pager")) {
+    Token format = lexer_next(&lexer);
+    if (format.type == TOKEN_END) {
+      print_pager_stats(table);
+    } else if (token_is_keyword(format.start, format.length, "json") &&
+               expect_end(&lexer) == PREPARE_SUCCESS) {
+      print_pager_stats_json(table);
+    } else {
+      return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (token_is_keyword(name.start, name.length, "latency")) {
+    Token action = lexer_next(&lexer);
+    if (action.type == TOKEN_END) {
+      print_latency_stats(table);
+    } else if (token_is_keyword(action.start, action.length, "reset") &&
+               expect_end(&lexer) == PREPARE_SUCCESS) {
+      memset(table->latency, 0, sizeof(table->latency));
+      printf("latency: reset\n");
+    } else {
+      return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (expect_end(&lexer) != PREPARE_SUCCESS) {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  if (token_is_keyword(name.start, name.length, "cache")) {
+    print_row_cache_stats(&table->row_cache);
+  } else if (token_is_keyword(name.start, name.length, "inserts")) {
+    print_insert_stats(&table->insert_stats);
+  } else if (token_is_keyword(name.start, name.length, "programs")) {
+    print_program_cache_stats(table);
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  return META_COMMAND_SUCCESS;
+}
+
+/*
+Until we start recycling free pages, new pages will always
+go onto the end of the database file
+*/
+uint32_t get_unused_page_num(Pager* pager) { 
+  if (!is_empty_stack(pager)) {
+    return pop_free_page(pager);
+  }
+  else {
+    return pager->num_pages;
+  }
+}
+
+/*
+Point a node at a new parent. The page is pinned only for the write, since
+a split reparents many children and cannot keep them all in the frames.
+*/
+void set_node_parent(Pager* pager, uint32_t page_num, uint32_t parent_page_num) {
+  PinnedPages* tracker = init_pinned_pages(pager);
+  char* node = get_page(pager, page_num, tracker);
+  *node_parent(node) = parent_page_num;
+  unpin_all_pages(pager, tracker);
+}
+
+void create_new_root(Table* table, uint32_t right_child_page_num) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+
+  /*
+  Handle splitting the root.
+  Old root copied to new page, becomes left child.
+  Address of right child passed in.
+  Re-initialize root page to contain the new root node.
   
-    if (index == *internal_node_num_keys(parent)) {
-      uint32_t old_max_key = get_node_max_key(table->pager, child);
-      uint32_t new_max_key = get_node_max_key(table->pager, get_page(table->pager, *internal_node_right_child(parent), tracker));
-      while (*internal_node_right_child(parent) == parent_page_num && !is_node_root(parent)) {
-        parent_page_num = *node_parent(get_page(table->pager, parent_page_num, tracker));
-        parent = get_page(table->pager, *node_parent(parent), tracker);
+  New root node points to two children.
+  */
+
+  char* root = get_page(table->pager, table->root_page_num, tracker);
+  char* right_child = get_page(table->pager, right_child_page_num, tracker);
+  uint32_t left_child_page_num = get_unused_page_num(table->pager);
+  char* left_child = get_page(table->pager, left_child_page_num, tracker);
+
+  if (get_node_type(root) == NODE_INTERNAL) {
+    initialize_internal_node(right_child);
+    initialize_internal_node(left_child);
+  }
+
+  /* Left child has data copied from old root */
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
+      set_node_parent(table->pager, *internal_node_child(left_child,i), left_child_page_num);
+    }
+    set_node_parent(table->pager, *internal_node_right_child(left_child), left_child_page_num);
+  }
+
+  /* Root node is a new internal node with one key and two children */
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
+  *internal_node_key(root, 0) = left_child_max_key;
+  *internal_node_right_child(root) = right_child_page_num;
+  *node_parent(left_child) = table->root_page_num;
+  *node_parent(right_child) = table->root_page_num;
+  bool leaves = get_node_type(left_child) == NODE_LEAF;
+
+  unpin_all_pages(table->pager, tracker);
+  if (leaves) {
+    hash_index_locate_leaf(table, left_child_page_num);
+  }
+
+}
+
+void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num);
+
+void update_internal_node_key(char* node, uint32_t old_key, uint32_t new_key);
+
+void internal_node_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num) {
+
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+
+  /*
+  Add a new child/key pair to parent that corresponds to child
+  */
+
+  char* parent = get_page(table->pager, parent_page_num, tracker);
+  char* child = get_page(table->pager, child_page_num, tracker);
+
+  uint32_t child_max_key = get_node_max_key(table->pager, child);
+  uint32_t index = internal_node_find_child(parent, child_max_key);
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+  if (original_num_keys >= INTERNAL_NODE_MAX_KEYS) {
+    unpin_all_pages(table->pager, tracker);
+    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+    return;
+  }
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  /*
+  An internal node with a right child of INVALID_PAGE_NUM is empty
+  */
+  if (right_child_page_num == INVALID_PAGE_NUM) {
+    *internal_node_right_child(parent) = child_page_num;
+    unpin_all_pages(table->pager, tracker);
+    return;
+  }
+
+  char* right_child = get_page(table->pager, right_child_page_num, tracker);  
+  /*
+  If we are already at the max number of cells for a node, we cannot increment
+  before splitting. Incrementing without inserting a new key/child pair
+  and immediately calling internal_node_split_and_insert has the effect
+  of creating a new key at (max_cells + 1) with an uninitialized value
+  */
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  if (child_max_key > get_node_max_key(table->pager, right_child)) {
+    /* Replace right child */
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    *internal_node_key(parent, original_num_keys) =
+        get_node_max_key(table->pager, right_child);
+    *internal_node_right_child(parent) = child_page_num;
+  } else {
+    /* Make room for the new cell */
+    for (uint32_t i = original_num_keys; i > index; i--) {
+      char* destination = (char*)internal_node_cell(parent, i);
+      char* source = (char*)internal_node_cell(parent, i - 1);
+      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+    }
+    *internal_node_child(parent, index) = child_page_num;
+    *internal_node_key(parent, index) = child_max_key;
+  }
+  unpin_all_pages(table->pager, tracker);
+}
+
+void update_internal_node_key(char* node, uint32_t old_key, uint32_t new_key) {
+  uint32_t old_child_index = internal_node_find_child(node, old_key);
+  *internal_node_key(node, old_child_index) = new_key;
+}
+
+void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num) {
+  uint64_t start = latency_start(&table->latency[LATENCY_INTERNAL_SPLIT], true);
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+
+  /*
+  The inserts below may split every node up to the root, so no page stays
+  pinned across them: each step fetches the nodes it needs and lets go.
+  */
+  uint32_t old_page_num = parent_page_num;
+
+  char* old_node = get_page(table->pager, parent_page_num, tracker);
+  uint32_t old_max = get_node_max_key(table->pager, old_node);
+  PinnedPages* child_tracker = init_pinned_pages(table->pager);
+  char* child = get_page(table->pager, child_page_num, child_tracker);
+  uint32_t child_max = get_node_max_key(table->pager, child);
+  unpin_all_pages(table->pager, child_tracker);
+
+  uint32_t new_page_num = get_unused_page_num(table->pager);
+
+  /*
+  Declaring a flag before updating pointers which
+  records whether this operation involves splitting the root -
+  if it does, we will insert our newly created node during
+  the step where the table's new root is created. If it does
+  not, we have to insert the newly created node into its parent
+  after the old node's keys have been transferred over. We are not
+  able to do this if the newly created node's parent is not a newly
+  initialized root node, because in that case its parent may have existing
+  keys aside from our old node which we are splitting. If that is true, we
+  need to find a place for our newly created node in its parent, and we
+  cannot insert it at the correct index if it does not yet have any keys
+  */
+  uint32_t splitting_root = is_node_root(old_node);
+
+  uint32_t old_parent_page_num;
+  if (splitting_root) {
+    unpin_all_pages(table->pager, tracker);
+    create_new_root(table, new_page_num);
+    tracker = init_pinned_pages(table->pager);
+    char* parent = get_page(table->pager, table->root_page_num, tracker);
+    /*
+    If we are splitting the root, we need to update old_node to point
+    to the new root's left child, new_page_num will already point to
+    the new root's right child
+    */
+    old_page_num = *internal_node_child(parent,0);
+    old_parent_page_num = table->root_page_num;
+
+    old_node = get_page(table->pager, old_page_num, tracker);
+
+  } else {
+    old_parent_page_num = *node_parent(old_node);
+    initialize_internal_node(get_page(table->pager, new_page_num, tracker));
+  }
+
+  /*
+  First put right child into new node and set right child of old node to invalid page number
+  */
+  uint32_t cur_page_num = *internal_node_right_child(old_node);
+  *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
+  unpin_all_pages(table->pager, tracker);
+  internal_node_insert(table, new_page_num, cur_page_num);
+  set_node_parent(table->pager, cur_page_num, new_page_num);
+
+  /*
+  For each key until you get to the middle key, move the key and the child to the new node
+  */
+  for (int i = INTERNAL_NODE_MAX_KEYS - 1; i 
+    > INTERNAL_NODE_MAX_KEYS / 2; i--) {
+    tracker = init_pinned_pages(table->pager);
+    old_node = get_page(table->pager, old_page_num, tracker);
+    cur_page_num = *internal_node_child(old_node, i);
+    (*internal_node_num_keys(old_node))--;
+    unpin_all_pages(table->pager, tracker);
+    internal_node_insert(table, new_page_num, cur_page_num);
+    set_node_parent(table->pager, cur_page_num, new_page_num);
+  }
+
+  /*
+  Set child before middle key, which is now the highest key, to be node's right child,
+  and decrement number of keys
+  */
+  tracker = init_pinned_pages(table->pager);
+  old_node = get_page(table->pager, old_page_num, tracker);
+  uint32_t* old_num_keys = internal_node_num_keys(old_node);
+  *internal_node_right_child(old_node) = *internal_node_child(old_node,*old_num_keys - 1);
+  (*old_num_keys)--;
+
+  /*
+  Determine which of the two nodes after the split should contain the child to be inserted,
+  and insert the child
+  */
+  uint32_t max_after_split = get_node_max_key(table->pager, old_node);
+  unpin_all_pages(table->pager, tracker);
+
+  uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
+
+  internal_node_insert(table, destination_page_num, child_page_num);
+  set_node_parent(table->pager, child_page_num, destination_page_num);
+
+  tracker = init_pinned_pages(table->pager);
+  old_node = get_page(table->pager, old_page_num, tracker);
+  char* parent = get_page(table->pager, old_parent_page_num, tracker);
+  update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
+  unpin_all_pages(table->pager, tracker);
+  if (!splitting_root) {
+    /* Set first: if the parent splits too, it moves the new node and repoints it */
+    set_node_parent(table->pager, new_page_num, old_parent_page_num);
+    internal_node_insert(table, old_parent_page_num, new_page_num);
+  }
+  latency_record(&table->latency[LATENCY_INTERNAL_SPLIT], start);
+}
+
+void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, char* value) {
+  uint64_t start = latency_start(&cursor->table->latency[LATENCY_LEAF_SPLIT], true);
+  PinnedPages* tracker = init_pinned_pages(cursor->table->pager);
+
+  /*
+  Create a new node and move half the cells over.
+  Insert the new value in one of the two nodes.
+  Update parent or create a new parent.
+ 
+  */
+  char* old_node = get_page(cursor->table->pager, cursor->page_num, tracker);
+  uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
+  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
+  char* new_node = get_page(cursor->table->pager, new_page_num, tracker);
+  initialize_leaf_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  /*
+  All existing keys plus new key should should be divided
+  evenly between old (left) and new (right) nodes.
+  Cells left of the split that keep their place are not touched; the
+  others move as whole runs, and the new cell is written once.
+  */
+  uint32_t cell_num = cursor->cell_num;
+  uint32_t split = LEAF_NODE_LEFT_SPLIT_COUNT;
+  char* destination_node;
+  uint32_t destination_cell;
+  uint32_t moved_cells;
+  if (cell_num >= split) {
+    /* The new cell goes right, between the old cells before and after it */
+    memcpy(leaf_node_cell(new_node, 0), leaf_node_cell(old_node, split),
+           (cell_num - split) * LEAF_NODE_CELL_SIZE);
+    memcpy(leaf_node_cell(new_node, cell_num - split + 1), leaf_node_cell(old_node, cell_num),
+           (LEAF_NODE_MAX_CELLS - cell_num) * LEAF_NODE_CELL_SIZE);
+    destination_node = new_node;
+    destination_cell = cell_num - split;
+    moved_cells = LEAF_NODE_MAX_CELLS - split;
+  } else {
+    /* The new cell stays left: the last old cell of the left half moves right with the rest */
+    memcpy(leaf_node_cell(new_node, 0), leaf_node_cell(old_node, split - 1),
+           (LEAF_NODE_MAX_CELLS - split + 1) * LEAF_NODE_CELL_SIZE);
+    memmove(leaf_node_cell(old_node, cell_num + 1), leaf_node_cell(old_node, cell_num),
+            (split - 1 - cell_num) * LEAF_NODE_CELL_SIZE);
+    destination_node = old_node;
+    destination_cell = cell_num;
+    moved_cells = LEAF_NODE_MAX_CELLS - cell_num;
+  }
+  *leaf_node_key(destination_node, destination_cell) = key;
+  memcpy(leaf_node_value(destination_node, destination_cell), value, LEAF_NODE_VALUE_SIZE);
+  cursor->table->insert_stats.bytes_copied += (moved_cells + 1) * LEAF_NODE_CELL_SIZE;
+
+  /* Update cell count on both leaf nodes */
+  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
+  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+
+  if (is_node_root(old_node)) {
+    create_new_root(cursor->table, new_page_num);
+    unpin_all_pages(cursor->table->pager, tracker);
+  } else {
+    uint32_t parent_page_num = *node_parent(old_node);
+
+    uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
+    char* parent = get_page(cursor->table->pager, parent_page_num, tracker);
+
+    update_internal_node_key(parent, old_max, new_max);
+    unpin_all_pages(cursor->table->pager, tracker);
+    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    if (destination_node == old_node) {
+      hash_index_locate(cursor->table, key, cursor->page_num);
+    }
+  }
+  /* The moved half has a new leaf; a split root moved the other half too */
+  hash_index_locate_leaf(cursor->table, new_page_num);
+  latency_record(&cursor->table->latency[LATENCY_LEAF_SPLIT], start);
+}
+
+
+/*
+Insert a row that is already serialized in the leaf cell value format.
+*/
+void leaf_node_insert(Cursor* cursor, uint32_t key, char* value) {
+
+  PinnedPages* tracker = init_pinned_pages(cursor->table->pager);
+
+  char* node = get_page(cursor->table->pager, cursor->page_num, tracker);
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells >= LEAF_NODE_MAX_CELLS) {
+    // Node full
+    leaf_node_split_and_insert(cursor, key, value);
+    unpin_all_pages(cursor->table->pager, tracker);
+    return;
+  }
+
+  if (cursor->cell_num < num_cells) {
+    // Make room for new cell
+    uint32_t tail_size = (num_cells - cursor->cell_num) * LEAF_NODE_CELL_SIZE;
+    memmove(leaf_node_cell(node, cursor->cell_num + 1), leaf_node_cell(node, cursor->cell_num),
+            tail_size);
+    cursor->table->insert_stats.bytes_copied += tail_size;
+  }
+
+  *(leaf_node_num_cells(node)) += 1;
+  *(leaf_node_key(node, cursor->cell_num)) = key;
+  memcpy(leaf_node_value(node, cursor->cell_num), value, LEAF_NODE_VALUE_SIZE);
+  cursor->table->insert_stats.bytes_copied += LEAF_NODE_CELL_SIZE;
+  unpin_all_pages(cursor->table->pager, tracker);
+  hash_index_locate(cursor->table, key, cursor->page_num);
+}
+
+void internal_node_merge(Table* table, uint32_t page_num);
+
+void internal_node_delete(Table* table, uint32_t parent_page_num, uint32_t child_page_num, uint32_t index) {
+
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+
+  /* Fetch the child to be deleted and its internal node. */
+
+  char* child = get_page(table->pager, child_page_num, tracker);
+  char* parent = get_page(table->pager, parent_page_num, tracker);
+
+    /* If the child is the right child of its parent, we update the parent's right child pointer to the child directly left of the right child. */
+    if (index == *internal_node_num_keys(parent)) {
+      *internal_node_right_child(parent) = *internal_node_child(parent, index - 1);
+    }
+      
+    /* If the child is not the right child of its parent, we shift all the children after the child's position in the parent one step to the left.*/
+      
+    else {
+      for (uint32_t i = index; i + 1 < *internal_node_num_keys(parent); i++) {
+        memcpy((char*)internal_node_cell(parent, i), (char*)internal_node_cell(parent, i + 1), INTERNAL_NODE_CELL_SIZE);
+      }
+    }
+    /* If the child was the right child of its parent, then we also need to update its key in its parent and
+      so on if the parent is the right child of its own parent. */
+  
+    if (index == *internal_node_num_keys(parent)) {
+      uint32_t old_max_key = get_node_max_key(table->pager, child);
+      uint32_t new_max_key = get_node_max_key(table->pager, get_page(table->pager, *internal_node_right_child(parent), tracker));
+      uint32_t subtree_page_num = parent_page_num;
+      char* ancestor = parent;
+      while (!is_node_root(ancestor)) {
+        uint32_t ancestor_page_num = *node_parent(ancestor);
+        ancestor = get_page(table->pager, ancestor_page_num, tracker);
+        if (*internal_node_right_child(ancestor) != subtree_page_num) {
+          update_internal_node_key(ancestor, old_max_key, new_max_key);
+          break;
+        }
+        subtree_page_num = ancestor_page_num;
+      }
+    }
+  
+    /* Decrement the number of children in the parent by 1 */
+  
+    parent_page_num = *node_parent(child);
+    *internal_node_num_keys(parent) -= 1;
+    push_free_page(table->pager, child_page_num);
+
+    /* If the parent becomes underfilled after its child was deleted, call internal_node_merge() */
+    bool underfilled = *internal_node_num_keys(parent) < 1 && !is_node_root(parent);
+    unpin_all_pages(table->pager, tracker);
+    if (underfilled) {
+      internal_node_merge(table, parent_page_num);
+    }
+}
+
+void internal_node_merge(Table* table, uint32_t page_num) {
+  uint64_t start = latency_start(&table->latency[LATENCY_INTERNAL_MERGE], true);
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  
+  /* Fetch the underfilled internal node, its parent, its right child, and its index within its own parent.*/
+  
+  char* node = get_page(table->pager, page_num, tracker);
+  char* parent = get_page(table->pager, *node_parent(node), tracker);
+  char* child = get_page(table->pager, *internal_node_right_child(node), tracker);
+  uint32_t index = internal_node_find_child(parent, get_node_max_key(table->pager, node)); 
+  
+  /* Initialize the underfilled internal node's sibling to an invalid page number and 
+  initialize the sibling's index in the parent and its cell number to 0. */
+  
+  uint32_t sibling_page_num = INVALID_PAGE_NUM;
+  uint32_t sibling_index = 0;
+  uint32_t sibling_cell_num = 0;
+  
+  /* Initialize the underfilled internal node's sibling's index to the index of the node directly to the left of it if the underfilled node
+  is the right child of its parent. Otherwise, initialize  underfilled internal node's sibling's index to the index of the node directly to 
+  the right of it.*/
+  
+  if (index == *internal_node_num_keys(parent)) {
+    sibling_index = index - 1;
+  }
+  else {
+    sibling_index = index + 1;
+  }
+  sibling_page_num = *internal_node_child(parent, sibling_index);
+
+  char* sibling = get_page(table->pager, sibling_page_num, tracker);
+
+  /*
+  Deleting a child can merge every node up to the root, so it runs once
+  this merge has released its own pages
+  */
+  uint32_t delete_parent_page_num = INVALID_PAGE_NUM;
+  uint32_t delete_child_page_num = INVALID_PAGE_NUM;
+  uint32_t delete_index = 0;
+  bool moved = false;
+
+  /* If the underfilled internal node's sibling has less more than child, we transfer a child from it to 
+  the underfilled internal node to help fill the underfilled internal node. */
+  
+  if (*internal_node_num_keys(sibling) > 1) {
+    
+    /*If the underfilled internal node's sibling is the index of the node directly to the left of the 
+    underfilled internal node, we initialize the index of the underfilled internal node's sibling's 
+    child to index of the underfilled internal node's sibling's right child. If the underfilled internal 
+    node's sibling is the index of the node directly to the right of the underfilled internal node, we 
+    initialize the index of the underfilled internal node's sibling's child to index of the underfilled 
+    internal node's sibling's first child */
+    
+    if (sibling_index == index - 1) {
+      sibling_cell_num = *internal_node_num_keys(sibling);
+    }
+    char* source = get_page(table->pager, *internal_node_child(sibling, sibling_cell_num), tracker);
+    
+    /* Set the underfilled internal node's sibling's child's parent to be the underfilled internal node and increase 
+    the underfilled internal node's number of keys by 1. */
+    
+    *node_parent(source) = page_num;
+    *internal_node_num_keys(node) += 1;
+
+    /* If the maximum key of the underfilled internal node is less than the maximum key of the underfilled internal node's 
+    sibling's child's maximum key, we need to update the underfilled internal node's maximum key to be the underfilled internal 
+    node's sibling's child's maximum key */
+    
+    if (get_node_max_key(table->pager, source) > get_node_max_key(table->pager, child)) {
+      *internal_node_child(node, 0) = *internal_node_right_child(node);
+      *internal_node_key(node, 0) = get_node_max_key(table->pager, child);
+      *internal_node_right_child(node) = *internal_node_child(sibling, sibling_cell_num);
+
+      uint32_t old_max_key = get_node_max_key(table->pager, child);
+      uint32_t new_max_key = get_node_max_key(table->pager, source); 
+      
+      /* If the underfilled internal node was the right child of its parent, then we also need to update its key in its parent and
+      so on if the parent is the right child of its own parent. */
+      
+      if (*internal_node_right_child(parent) == page_num) {
+        uint32_t parent_page_num = *node_parent(node);
+        parent = get_page(table->pager, *node_parent(parent), tracker);
+        while (*internal_node_right_child(parent) == parent_page_num && !is_node_root(parent)) {
+          parent_page_num = *node_parent(get_page(table->pager, parent_page_num, tracker));
+          parent = get_page(table->pager, *node_parent(parent), tracker);
+        }
+      }
+      update_internal_node_key(parent, old_max_key, new_max_key);
+    }
+      
+    /* Set the first child of the underfilled internal node to the first child of the underfilled internal node's sibling. */
+      
+    else {
+      *internal_node_child(node, 0) = *internal_node_child(sibling, sibling_cell_num);
+      *internal_node_key(node, 0) = get_node_max_key(table->pager, source);
+    }
+    /* Delete from the underfilled internal node's sibling its child that was transferred to the underfilled internla node */
+    
+    delete_parent_page_num = sibling_page_num;
+    delete_child_page_num = *internal_node_child(sibling, sibling_cell_num);
+    delete_index = sibling_cell_num;
+    moved = true;
+  }
+  /* If the underfilled internal node's sibling has only 1 key and the parent of the underfilled internal node is the root, 
+  we transfer the the underfilled internal node's only child to the underfilled node's sibling and set the sibling as the root.*/
+    
+  else if (*internal_node_num_keys(sibling) == 1) {
+    if (*internal_node_num_keys(parent) == 1 && is_node_root(parent)) {
+      internal_node_insert(table, sibling_page_num, *internal_node_right_child(node));
+  
+      for (uint32_t i = 0; i < *internal_node_num_keys(sibling) + 1; i++) {
+        set_node_parent(table->pager, *internal_node_child(sibling, i), *node_parent(node));
+      }
+      memcpy(parent, sibling, PAGE_SIZE);
+      set_node_root(parent, true);
+
+      push_free_page(table->pager, sibling_page_num);
+    }
+
+      /* If the underfilled internal node's sibling has only 1 child and the parent of the underfilled internal node is not the root, 
+      we transfer the the underfilled internal node's only child to the underfilled node's sibling and delete the underfilled internal node
+      from its parent.*/
+      
+    else {
+      internal_node_insert(table, sibling_page_num, *internal_node_right_child(node));
+      *node_parent(child) = sibling_page_num;
+      delete_parent_page_num = *node_parent(node);
+      delete_child_page_num = page_num;
+      delete_index = index;
+    }
+  }
+  unpin_all_pages(table->pager, tracker);
+  if (delete_parent_page_num != INVALID_PAGE_NUM) {
+    internal_node_delete(table, delete_parent_page_num, delete_child_page_num, delete_index);
+  }
+  /* The child moved to the underfilled node, so its page is not free */
+  if (moved) {
+    pop_free_page(table->pager);
+  }
+  latency_record(&table->latency[LATENCY_INTERNAL_MERGE], start);
+}
+
+void leaf_node_merge(Cursor* cursor);
+
+void leaf_node_delete(Cursor* cursor, uint32_t key) {
+
+  PinnedPages* tracker = init_pinned_pages(cursor->table->pager);
+  
+  /* Fetch the leaf node of the row that is to be deleted and how many rows it currently ha.s */
+  
+  char* node = get_page(cursor->table->pager, cursor->page_num, tracker);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  /* If the row to be deleted is not the right child of its leaf node, we shift all the rows 
+  after the deleted one to the left to fill the gap. */
+  
+  if (cursor->cell_num + 1 < num_cells) {
+    for (uint32_t i = cursor->cell_num; i + 1 < num_cells; i++) {
+      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i + 1), LEAF_NODE_CELL_SIZE);
+    }
+  }
+    
+  /* If the row to be deleted is the right child of its leaf node, we decrease the number of rows its leaf node
+  has by 1. */
+    
+  else if (cursor->cell_num + 1 == num_cells && !is_node_root(node)) {
+    
+    /* If the leaf node containing the row to be deleted is not the root, then we must also update the leaf node's key in its own parent 
+    and so on if the parent is the right child of its own parent.*/
+    
+    char* parent = get_page(cursor->table->pager, *node_parent(node), tracker);
+    uint32_t old_max_key = get_node_max_key(cursor->table->pager, node);
+    uint32_t new_max_key = *leaf_node_key(node, cursor->cell_num - 1);
+    uint32_t index = internal_node_find_child(parent, get_node_max_key(cursor->table->pager, node));
+    if (index == *internal_node_num_keys(parent) && !is_node_root(parent)) {
+      uint32_t parent_page_num = *node_parent(node);
+      parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
+      while (*internal_node_right_child(parent) == parent_page_num && !is_node_root(parent)) {
+        parent_page_num = *node_parent(get_page(cursor->table->pager, parent_page_num, tracker));
+        parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
+      }
+    }
+    update_internal_node_key(parent, old_max_key, new_max_key);
+  }
+
+  *(leaf_node_num_cells(node)) -= 1;
+  
+  /* If the leaf node that of the deleted row becomes underfilled after deletion, and it is not the root, we call leaf_node_merge*/
+  
+  bool underfilled = *leaf_node_num_cells(node) < 7 && !is_node_root(node);
+  unpin_all_pages(cursor->table->pager, tracker);
+  if (underfilled) {
+    leaf_node_merge(cursor);
+  }
+}
+
+
+void leaf_node_merge(Cursor* cursor) {
+  uint64_t start = latency_start(&cursor->table->latency[LATENCY_LEAF_MERGE], true);
+  PinnedPages* tracker = init_pinned_pages(cursor->table->pager);
+
+  /* For our underfilled leaf node, we will need to find assign either the node to its left as its sibling
+  if it is the right child. Otherwise, we can just assign the node to the right as the sibling. 
+
+  If the sibling has more than 7 rows, we can safely take a row from it to give to the underfilled road. And 
+  then update the node's max key in the parent internal node.
+
+  However, if the sibling has 7 rows, we insert the underfilled node's rows into the sibling. If, as a result 
+  of this merging, the parent internal node becomes underfilled, we check if the parent internal is the root or not.
+  If it is, then we can simply assign our new sibling node as the root. If it is not, then we insert the underfilled 
+  leaf node's rows into its sibling node. And then update the next leaf pointers for the sibling and the previous node.
+  We then delete the underfilled node from its parent.
+  */
+  
+  /* Fetch the underfilled internal node, its parent, its right child, and its index within its own parent.*/
+  
+  char* node = get_page(cursor->table->pager, cursor->page_num, tracker);
+  uint32_t node_max_key =get_node_max_key(cursor->table->pager, node);
+  char* parent = get_page(cursor->table->pager, *node_parent(node), tracker);
+  uint32_t index = internal_node_find_child(parent, get_node_max_key(cursor->table->pager, node));
+  
+ /* Initialize the underfilled leaf node's sibling to an invalid page number and 
+  initialize sibling's index in the parent and its cell number to 0. */
+  
+  uint32_t sibling_page_num = INVALID_PAGE_NUM;
+  uint32_t sibling_index = 0;
+  uint32_t sibling_cell_num = 0;
+  bool collapsed = false;
+
+   /* Initialize the underfilled leaf node's sibling's index to the index of the node directly to the left of it if the underfilled laef node
+  is the right child of its parent. Otherwise, initialize  underfilled leaf node's sibling's index to the index of the node directly to 
+  the right of it.*/
+  
+  if (index == *internal_node_num_keys(parent)) {
+    sibling_index = index - 1;
+  }
+  else {
+    sibling_index = index + 1;
+  }
+  sibling_page_num = *internal_node_child(parent, sibling_index);
+
+  char* sibling = get_page(cursor->table->pager, sibling_page_num, tracker);
+  uint32_t old_max_key = get_node_max_key(cursor->table->pager, sibling);
+
+  /* If the underfilled leaf node's sibling has more than 7 rows, transfer a row from it to the underfilled leaf node. */
+  
+  uint32_t delete_parent_page_num = INVALID_PAGE_NUM;
+  if (*leaf_node_num_cells(sibling) > 7) {
+    char* value = arena_alloc(&cursor->table->pager->arena, LEAF_NODE_VALUE_SIZE);
+
+    /* If the underfilled leaf node's sibling is the child directly to the left of the underfilled leaf node, transfer the sibling's 
+    right child to the underfilled leaf node by setting the sibling cell number to the index of the sibling's right child. If not, transfer 
+    the sibling's first child to the underfilled leaf node by keeping the cull number as 0. */
+    
+    if (sibling_index == index - 1) {
+      sibling_cell_num = *leaf_node_num_cells(sibling) - 1;
+    }
+
+    uint32_t key = *leaf_node_key(sibling, sibling_cell_num);
+    memcpy(value, leaf_node_value(sibling, sibling_cell_num), LEAF_NODE_VALUE_SIZE);
+
+    Cursor* alternate_cursor = leaf_node_find(cursor->table, cursor->page_num, key);
+    old_max_key = get_node_max_key(cursor->table->pager, node);
+    leaf_node_insert(alternate_cursor, key, value);
+    uint32_t new_max_key = get_node_max_key(cursor->table->pager, node);
+    
+    /* If the underfilled leaf node is the right child of its parent, then we must also update the its key in its own parent 
+    and so on if the parent is the right child of its own parent. */
+    
+    if (index == *internal_node_num_keys(parent) && !is_node_root(parent)) { 
+        uint32_t parent_page_num = *node_parent(node);
+        parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
+        while (*internal_node_right_child(parent) == parent_page_num && !is_node_root(parent)) {
+          parent_page_num = *node_parent(get_page(cursor->table->pager, parent_page_num, tracker));
+          parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
+        }
+    }
+
+    update_internal_node_key(parent, old_max_key, new_max_key);
+
+    Cursor* sibling_cursor = leaf_node_find(cursor->table, sibling_page_num, key);
+    
+    /* Delete the row that was transferred from the underfilled leaf node's sibling to the underfilled leaf node. */
+    
+    leaf_node_delete(sibling_cursor, key);
+  }
+   /* If the underfilled leaf node's sibling has 7 rows, insert the underfilled leaf node's rows into the sibling. */ 
+    
+  else if (*leaf_node_num_cells(sibling) == 7) {
+    char* value = arena_alloc(&cursor->table->pager->arena, LEAF_NODE_VALUE_SIZE);
+    for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++) {
+      uint32_t key = *leaf_node_key(node, i);
+      memcpy(value, leaf_node_value(node, i), LEAF_NODE_VALUE_SIZE);
+      Cursor* sibling_cursor = leaf_node_find(cursor->table, sibling_page_num, key);
+      leaf_node_insert(sibling_cursor, key, value);
+    }
+    
+    /* If the underfilled leaf node's parent has only 1 key and is the root, set the underfilled leaf node's sibling as the root. */
+    
+    if (*internal_node_num_keys(parent) == 1 && is_node_root(parent)) {
+      memcpy(parent, sibling, PAGE_SIZE);
+      set_node_type(parent, NODE_LEAF);
+      set_node_root(parent, true);
+      *leaf_node_next_leaf(parent) = 0;
+      push_free_page(cursor->table->pager, sibling_page_num);
+      push_free_page(cursor->table->pager, cursor->page_num);
+      collapsed = true;
+    }
+    else {
+      /* If the underfilled leaf node is the the right child of its own parent, we need to update the sibling's maximum key in its parent 
+      and so on if the parent is the right child of its parent. */
+      
+      if (index == *internal_node_num_keys(parent) && !is_node_root(parent)) {
+        uint32_t parent_page_num = *node_parent(node);
+        parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
+        while (*internal_node_right_child(parent) == parent_page_num && !is_node_root(parent)) {
+          parent_page_num = *node_parent(get_page(cursor->table->pager, parent_page_num, tracker));
+          parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
+        }
+      }
+      uint32_t new_max_key = get_node_max_key(cursor->table->pager, sibling);
+      update_internal_node_key(parent, old_max_key, new_max_key);
+      parent = get_page(cursor->table->pager, *node_parent(node), tracker);
+
+      /* If the underfilled leaf node is the right child of its parent, set the next leaf pointer of the sibling to
+      point to the next leaf node pointed to by the underfilled leaf node. */
+      
+      if (index == *internal_node_num_keys(parent) ) {
+        *leaf_node_next_leaf(sibling) = *leaf_node_next_leaf(node);
+      }
+      else {
+        
+        /* If the underfilled leaf node was not the right child of its parent, set the next leaf pointer of the leaf node directly to the left of 
+        the underfilled leaf node to point to the sibling. */
+        
+        uint32_t prev_page_num = table_start(cursor->table)->page_num;
+        while (prev_page_num != cursor->page_num && prev_page_num != 0) {
+          PinnedPages* prev_tracker = init_pinned_pages(cursor->table->pager);
+          char* prev_leaf_node = get_page(cursor->table->pager, prev_page_num, prev_tracker);
+          prev_page_num = *leaf_node_next_leaf(prev_leaf_node);
+          if (prev_page_num == cursor->page_num) {
+            *leaf_node_next_leaf(prev_leaf_node) = sibling_page_num;
+          }
+          unpin_all_pages(cursor->table->pager, prev_tracker);
+        }
+      }
+
+      /* Delete the underfilled leaf node from its parent, once this merge has released its pages */
+      
+      delete_parent_page_num = *node_parent(node);
+    }
+  }
+  unpin_all_pages(cursor->table->pager, tracker);
+  if (delete_parent_page_num != INVALID_PAGE_NUM) {
+    internal_node_delete(cursor->table, delete_parent_page_num, cursor->page_num, index);
+  }
+  /* The root took over the merged leaf's cells */
+  if (collapsed) {
+    hash_index_locate_leaf(cursor->table, cursor->table->root_page_num);
+  }
+  latency_record(&cursor->table->latency[LATENCY_LEAF_MERGE], start);
+}
+
+/*
+Secondary indexes on username and email. Each is its own B+tree of
+(value, id) entries in the same pager as the table, found through the
+catalog page. Internal cells keep the largest entry of their child, the
+same convention as the table's internal nodes, so a lookup descends to
+the first entry >= the key it is after. Deletes never rebalance: a leaf
+emptied by deletes stays linked and is filled again by later inserts.
+*/
+typedef struct {
+  const char* value;
+  uint32_t length;
+  uint32_t id;
+} IndexKey;
+
+uint16_t* index_node_num_cells(char* node) {
+  return (uint16_t*)(node + INDEX_NODE_NUM_CELLS_OFFSET);
+}
+
+uint16_t* index_node_cells_start(char* node) {
+  return (uint16_t*)(node + INDEX_NODE_CELLS_START_OFFSET);
+}
+
+uint32_t* index_node_next(char* node) {
+  return (uint32_t*)(node + INDEX_NODE_NEXT_OFFSET);
+}
+
+uint16_t* index_node_slot(char* node, uint32_t cell_num) {
+  return (uint16_t*)(node + INDEX_NODE_HEADER_SIZE + cell_num * INDEX_NODE_SLOT_SIZE);
+}
+
+char* index_node_cell(char* node, uint32_t cell_num) {
+  return node + *index_node_slot(node, cell_num);
+}
+
+/* The (id, length, value) part of a cell */
+char* index_node_entry(char* node, uint32_t cell_num) {
+  char* cell = index_node_cell(node, cell_num);
+  return get_node_type(node) == NODE_LEAF ? cell : cell + INDEX_INTERNAL_CHILD_SIZE;
+}
+
+uint32_t index_entry_id(char* entry) { return *(uint32_t*)entry; }
+
+uint32_t index_entry_length(char* entry) {
+  return *(uint16_t*)(entry + sizeof(uint32_t));
+}
+
+char* index_entry_value(char* entry) { return entry + INDEX_ENTRY_HEADER_SIZE; }
+
+uint32_t index_cell_size(NodeType type, uint32_t value_length) {
+  uint32_t size = INDEX_ENTRY_HEADER_SIZE + value_length;
+  if (type == NODE_INTERNAL) {
+    size += INDEX_INTERNAL_CHILD_SIZE;
+  }
+  return (size + 3) & ~3u;
+}
+
+uint32_t index_node_cell_size(char* node, uint32_t cell_num) {
+  return index_cell_size(get_node_type(node),
+                         index_entry_length(index_node_entry(node, cell_num)));
+}
+
+uint32_t index_node_free_space(char* node) {
+  return *index_node_cells_start(node) - INDEX_NODE_HEADER_SIZE -
+         *index_node_num_cells(node) * INDEX_NODE_SLOT_SIZE;
+}
+
+/* Child cell_num of an internal node; cell_num == num_cells is the right child */
+uint32_t index_node_child(char* node, uint32_t cell_num) {
+  if (cell_num == *index_node_num_cells(node)) {
+    return *index_node_next(node);
+  }
+  return *(uint32_t*)index_node_cell(node, cell_num);
+}
+
+void initialize_index_node(char* node, NodeType type) {
+  memset(node, 0, PAGE_SIZE);
+  set_node_type(node, type);
+  *index_node_num_cells(node) = 0;
+  *index_node_cells_start(node) = PAGE_SIZE;
+  *index_node_next(node) = type == NODE_LEAF ? 0 : INVALID_PAGE_NUM;
+}
+
+int index_key_compare(IndexKey* key, char* entry) {
+  uint32_t length = index_entry_length(entry);
+  int result = memcmp(key->value, index_entry_value(entry),
+                      key->length < length ? key->length : length);
+  if (result == 0) {
+    result = (key->length > length) - (key->length < length);
+  }
+  if (result == 0) {
+    uint32_t id = index_entry_id(entry);
+    result = (key->id > id) - (key->id < id);
+  }
+  return result;
+}
+
+/* Index of the first cell whose entry is >= key (num_cells if there is none) */
+uint32_t index_node_find(char* node, IndexKey* key) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *index_node_num_cells(node);
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (index_key_compare(key, index_node_entry(node, index)) <= 0) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+/* Serialize key as a cell of the given type; child is only used by internal cells */
+uint32_t index_build_cell(char* cell, NodeType type, uint32_t child, IndexKey* key) {
+  uint32_t size = index_cell_size(type, key->length);
+  char* entry = cell;
+  memset(cell, 0, size);
+  if (type == NODE_INTERNAL) {
+    memcpy(cell, &child, INDEX_INTERNAL_CHILD_SIZE);
+    entry += INDEX_INTERNAL_CHILD_SIZE;
+  }
+  uint16_t length = key->length;
+  memcpy(entry, &key->id, sizeof(uint32_t));
+  memcpy(entry + sizeof(uint32_t), &length, sizeof(uint16_t));
+  memcpy(entry + INDEX_ENTRY_HEADER_SIZE, key->value, key->length);
+  return size;
+}
+
+/* Caller makes sure the cell fits */
+void index_node_insert_cell(char* node, uint32_t cell_num, char* cell, uint32_t size) {
+  uint16_t num_cells = *index_node_num_cells(node);
+  uint16_t start = *index_node_cells_start(node) - size;
+  memcpy(node + start, cell, size);
+  memmove(index_node_slot(node, cell_num + 1), index_node_slot(node, cell_num),
+          (num_cells - cell_num) * INDEX_NODE_SLOT_SIZE);
+  *index_node_slot(node, cell_num) = start;
+  *index_node_cells_start(node) = start;
+  *index_node_num_cells(node) = num_cells + 1;
+}
+
+/* Remove a cell and close the gap it leaves in the cell area */
+void index_node_remove_cell(char* node, uint32_t cell_num) {
+  uint16_t num_cells = *index_node_num_cells(node);
+  uint16_t offset = *index_node_slot(node, cell_num);
+  uint16_t size = index_node_cell_size(node, cell_num);
+  uint16_t start = *index_node_cells_start(node);
+
+  memmove(node + start + size, node + start, offset - start);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    if (*index_node_slot(node, i) < offset) {
+      *index_node_slot(node, i) += size;
+    }
+  }
+  memmove(index_node_slot(node, cell_num), index_node_slot(node, cell_num + 1),
+          (num_cells - cell_num - 1) * INDEX_NODE_SLOT_SIZE);
+  *index_node_cells_start(node) = start + size;
+  *index_node_num_cells(node) = num_cells - 1;
+}
+
+/*
+Split a full node while inserting cell at cell_num. The lower half stays
+in node and the upper half moves to the empty page right; separator gets
+the internal cell (node's page, largest entry left in node) for the parent.
+*/
+uint32_t index_node_split(char* node, uint32_t page_num, char* right,
+                          uint32_t right_page_num, uint32_t cell_num, char* cell,
+                          uint32_t cell_size, char* separator) {
+  NodeType type = get_node_type(node);
+  char* old = memory_alloc_required(MEMORY_TABLE, PAGE_SIZE);
+  memcpy(old, node, PAGE_SIZE);
+  uint32_t num_cells = *index_node_num_cells(old) + 1;
+
+  char* cells[INDEX_MAX_CELLS];
+  uint32_t sizes[INDEX_MAX_CELLS];
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    if (i == cell_num) {
+      cells[i] = cell;
+      sizes[i] = cell_size;
+    } else {
+      uint32_t old_num = i < cell_num ? i : i - 1;
+      cells[i] = index_node_cell(old, old_num);
+      sizes[i] = index_node_cell_size(old, old_num);
+    }
+    total += sizes[i] + INDEX_NODE_SLOT_SIZE;
+  }
+
+  /* Split by bytes, leaving at least one cell on each side */
+  uint32_t split = 0;
+  uint32_t left_bytes = 0;
+  while (split < num_cells - 2 && left_bytes + sizes[split] < total / 2) {
+    left_bytes += sizes[split] + INDEX_NODE_SLOT_SIZE;
+    split++;
+  }
+  if (split == 0) {
+    split = 1;
+  }
+
+  initialize_index_node(node, type);
+  initialize_index_node(right, type);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    if (type == NODE_INTERNAL && i == split) {
+      /* The middle child becomes the left node's right child and its entry moves up */
+      memcpy(index_node_next(node), cells[i], INDEX_INTERNAL_CHILD_SIZE);
+      continue;
+    }
+    char* destination = i < split ? node : right;
+    index_node_insert_cell(destination, *index_node_num_cells(destination), cells[i],
+                           sizes[i]);
+  }
+
+  char* largest = type == NODE_LEAF ? cells[split - 1]
+                                    : cells[split] + INDEX_INTERNAL_CHILD_SIZE;
+  IndexKey key = {index_entry_value(largest), index_entry_length(largest),
+                  index_entry_id(largest)};
+  uint32_t separator_size = index_build_cell(separator, NODE_INTERNAL, page_num, &key);
+
+  *index_node_next(right) = *index_node_next(old);
+  if (type == NODE_LEAF) {
+    *index_node_next(node) = right_page_num;
+  }
+  memory_free(old);
+  return separator_size;
+}
+
+void table_save_catalog(Table* table) {
+  Pager* pager = table->pager;
+  PinnedPages* tracker = init_pinned_pages(pager);
+  uint32_t* catalog_page_num = pager_catalog_page_num(pager);
+  if (*catalog_page_num == 0) {
+    *catalog_page_num = get_unused_page_num(pager);
+    memset(get_page(pager, *catalog_page_num, tracker), 0, PAGE_SIZE);
+  }
+  char* catalog = get_page(pager, *catalog_page_num, tracker);
+  memcpy(catalog + CATALOG_INDEX_ROOTS_OFFSET, table->index_roots,
+         sizeof(table->index_roots));
+  memcpy(catalog + CATALOG_REVERSE_INDEX_ROOTS_OFFSET, table->reverse_index_roots,
+         sizeof(table->reverse_index_roots));
+  memcpy(catalog + CATALOG_TRIGRAM_INDEX_ROOTS_OFFSET, table->trigram_index_roots,
+         sizeof(table->trigram_index_roots));
+  *(uint32_t*)(catalog + CATALOG_HASH_INDEX_OFFSET) =
+      table->hash_index ? table->hash_index->directory_page_num : 0;
+  memcpy(catalog + CATALOG_NUM_VIEWS_OFFSET, &table->num_views, sizeof(uint32_t));
+  memcpy(catalog + CATALOG_VIEWS_OFFSET, table->views,
+         table->num_views * sizeof(AggregateView));
+  memcpy(catalog + CATALOG_SKETCH_PAGE_OFFSET, &table->sketches.page_num, sizeof(uint32_t));
+  /* Zero bits tells the next open that the saved filter cannot be trusted */
+  KeyFilter* filter = &table->key_filter;
+  uint32_t saved_filter[4] = {filter->page_num, filter->saved ? filter->num_bits : 0,
+                              filter->num_keys, filter->num_deleted};
+  memcpy(catalog + CATALOG_KEY_FILTER_OFFSET, saved_filter, sizeof(saved_filter));
+  unpin_all_pages(pager, tracker);
+}
+
+/* root_slot holds the index's root page in the table and is updated when the root splits */
+void index_insert(Table* table, uint32_t* root_slot, IndexKey* key) {
+  Pager* pager = table->pager;
+  PinnedPages* tracker = init_pinned_pages(pager);
+  uint32_t path[INDEX_MAX_DEPTH];
+  uint32_t depth = 0;
+
+  uint32_t page_num = *root_slot;
+  char* node = get_page(pager, page_num, tracker);
+  while (get_node_type(node) == NODE_INTERNAL && depth < INDEX_MAX_DEPTH) {
+    path[depth++] = page_num;
+    page_num = index_node_child(node, index_node_find(node, key));
+    node = get_page(pager, page_num, tracker);
+  }
+
+  char cell[INDEX_MAX_CELL_SIZE];
+  char separator[INDEX_MAX_CELL_SIZE];
+  uint32_t cell_size = index_build_cell(cell, NODE_LEAF, 0, key);
+  uint32_t cell_num = index_node_find(node, key);
+
+  while (index_node_free_space(node) < cell_size + INDEX_NODE_SLOT_SIZE) {
+    uint32_t right_page_num = get_unused_page_num(pager);
+    char* right = get_page(pager, right_page_num, tracker);
+    uint32_t separator_size = index_node_split(node, page_num, right, right_page_num,
+                                               cell_num, cell, cell_size, separator);
+
+    if (depth == 0) {
+      /* Split the root: a new root points at both halves */
+      uint32_t root_page_num = get_unused_page_num(pager);
+      char* root = get_page(pager, root_page_num, tracker);
+      initialize_index_node(root, NODE_INTERNAL);
+      index_node_insert_cell(root, 0, separator, separator_size);
+      *index_node_next(root) = right_page_num;
+      *root_slot = root_page_num;
+      table_save_catalog(table);
+      unpin_all_pages(pager, tracker);
+      return;
+    }
+
+    /*
+    The parent's pointer to the split node now leads to the upper half,
+    and the lower half goes in just before it
+    */
+    page_num = path[--depth];
+    node = get_page(pager, page_num, tracker);
+    uint32_t num_cells = *index_node_num_cells(node);
+    cell_num = 0;
+    while (cell_num < num_cells && index_node_child(node, cell_num) != *(uint32_t*)separator) {
+      cell_num++;
+    }
+    if (cell_num == num_cells) {
+      *index_node_next(node) = right_page_num;
+    } else {
+      memcpy(index_node_cell(node, cell_num), &right_page_num, INDEX_INTERNAL_CHILD_SIZE);
+    }
+    memcpy(cell, separator, separator_size);
+    cell_size = separator_size;
+  }
+
+  index_node_insert_cell(node, cell_num, cell, cell_size);
+  unpin_all_pages(pager, tracker);
+}
+
+void index_delete(Table* table, uint32_t root, IndexKey* key) {
+  Pager* pager = table->pager;
+  PinnedPages* tracker = init_pinned_pages(pager);
+
+  char* node = get_page(pager, root, tracker);
+  for (uint32_t depth = 0; get_node_type(node) == NODE_INTERNAL && depth < INDEX_MAX_DEPTH;
+       depth++) {
+    uint32_t child = index_node_child(node, index_node_find(node, key));
+    node = get_page(pager, child, tracker);
+  }
+  uint32_t cell_num = index_node_find(node, key);
+  if (cell_num < *index_node_num_cells(node) &&
+      index_key_compare(key, index_node_entry(node, cell_num)) == 0) {
+    index_node_remove_cell(node, cell_num);
+  }
+  unpin_all_pages(pager, tracker);
+}
+
+IndexKey index_key_from_row(char* value, Column column, uint32_t id) {
+  IndexKey key;
+  uint32_t size = column == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+  key.value = value + (column == COLUMN_USERNAME ? USERNAME_OFFSET : EMAIL_OFFSET);
+  key.length = strnlen(key.value, size);
+  key.id = id;
+  return key;
+}
+
+/* Point key at a reversed copy of its value in buffer */
+void index_key_reverse(IndexKey* key, char* buffer) {
+  for (uint32_t i = 0; i < key->length; i++) {
+    buffer[i] = key->value[key->length - 1 - i];
+  }
+  key->value = buffer;
+}
+
+void trigram_index_row(Table* table, uint32_t* root_slot, Column column, uint32_t id,
+                       char* value, bool insert);
+void aggregate_view_fold(Table* table, AggregateView* view, uint32_t id, char* value,
+                         bool insert);
+
+/* Add or remove a row, given in the leaf cell value format, in every index and view */
+void table_index_row(Table* table, uint32_t id, char* value, bool insert) {
+  for (uint32_t i = 0; i < table->num_views; i++) {
+    aggregate_view_fold(table, &table->views[i], id, value, insert);
+  }
+  for (Column column = COLUMN_USERNAME; column <= COLUMN_EMAIL; column++) {
+    if (table->trigram_index_roots[column] != 0) {
+      trigram_index_row(table, &table->trigram_index_roots[column], column, id, value,
+                        insert);
+    }
+    for (uint32_t reversed = 0; reversed < 2; reversed++) {
+      uint32_t* root = reversed ? &table->reverse_index_roots[column]
+                                : &table->index_roots[column];
+      if (*root == 0) {
+        continue;
+      }
+      char buffer[COLUMN_EMAIL_SIZE];
+      IndexKey key = index_key_from_row(value, column, id);
+      if (reversed) {
+        index_key_reverse(&key, buffer);
+      }
+      if (insert) {
+        index_insert(table, root, &key);
+      } else {
+        index_delete(table, *root, &key);
+      }
+    }
+  }
+}
+
+/* Walks the entries of an index in order, pinning the leaf it is on */
+typedef struct {
+  PinnedPages* tracker;
+  char* node;
+  uint32_t page_num;
+  uint32_t cell_num;
+} IndexCursor;
+
+void index_cursor_release(Table* table, IndexCursor* cursor) {
+  if (cursor->tracker) {
+    unpin_all_pages(table->pager, cursor->tracker);
+    cursor->tracker = NULL;
+  }
+  cursor->node = NULL;
+}
+
+/* Move to cell_num of leaf page_num or the next entry after it; false past the end */
+bool index_cursor_move_to(Table* table, IndexCursor* cursor, uint32_t page_num,
+                          uint32_t cell_num) {
+  while (true) {
+    index_cursor_release(table, cursor);
+    cursor->tracker = init_pinned_pages(table->pager);
+    cursor->node = get_page(table->pager, page_num, cursor->tracker);
+    cursor->page_num = page_num;
+    cursor->cell_num = cell_num;
+    if (cell_num < *index_node_num_cells(cursor->node)) {
+      return true;
+    }
+    page_num = *index_node_next(cursor->node);
+    if (page_num == 0) {
+      index_cursor_release(table, cursor);
+      return false;
+    }
+    cell_num = 0;
+  }
+}
+
+/* Position the cursor on the first entry >= key */
+bool index_cursor_seek(Table* table, IndexCursor* cursor, uint32_t root, IndexKey* key) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  uint32_t page_num = root;
+  char* node = get_page(table->pager, page_num, tracker);
+  for (uint32_t depth = 0; get_node_type(node) == NODE_INTERNAL && depth < INDEX_MAX_DEPTH;
+       depth++) {
+    page_num = index_node_child(node, index_node_find(node, key));
+    node = get_page(table->pager, page_num, tracker);
+  }
+  uint32_t cell_num = index_node_find(node, key);
+  unpin_all_pages(table->pager, tracker);
+  return index_cursor_move_to(table, cursor, page_num, cell_num);
+}
+
+bool index_cursor_advance(Table* table, IndexCursor* cursor) {
+  return index_cursor_move_to(table, cursor, cursor->page_num, cursor->cell_num + 1);
+}
+
+char* index_cursor_entry(IndexCursor* cursor) {
+  return index_node_entry(cursor->node, cursor->cell_num);
+}
+
+/*
+Decode the row with id from its leaf; false if there is none. The cursor
+and trackers of the descent are given back before returning, since callers
+look rows up one at a time for the whole of a statement.
+*/
+bool table_find_row(Table* table, uint32_t id, Row* row) {
+  Arena* arena = &table->pager->arena;
+  ArenaMark mark = arena_mark(arena);
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  Cursor* cursor = table_find(table, id);
+  char* node = get_page(table->pager, cursor->page_num, tracker);
+  bool found = cursor->cell_num < *leaf_node_num_cells(node) &&
+               *leaf_node_key(node, cursor->cell_num) == id;
+  if (found) {
+    deserialize_row(leaf_node_value(node, cursor->cell_num), row);
+  }
+  unpin_all_pages(table->pager, tracker);
+  arena_release(arena, mark);
+  return found;
+}
+
+/*
+Trigram index for substring search. Every distinct three byte sequence of
+a value posts the row's id. A trigram's posting list is split into blocks
+of sorted ids, one index entry each, keyed by the trigram and the largest
+id the block may hold: a block covers the ids after the previous block's
+key up to its own. The final block is keyed by TRIGRAM_TAIL_ID, so any new
+id has exactly one block to go in, found by a single seek.
+*/
+uint32_t varint_encode(uint32_t value, uint8_t* out) {
+  uint32_t length = 0;
+  while (value >= 0x80) {
+    out[length++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[length++] = value;
+  return length;
+}
+
+uint32_t varint_decode(const uint8_t* in, uint32_t* value) {
+  uint32_t length = 0;
+  *value = 0;
+  do {
+    *value |= (uint32_t)(in[length] & 0x7F) << (7 * length);
+  } while (in[length++] & 0x80);
+  return length;
+}
+
+void trigram_key(char* key, const char* trigram, uint32_t last_id) {
+  memcpy(key, trigram, TRIGRAM_SIZE);
+  for (uint32_t i = 0; i < 4; i++) {
+    key[TRIGRAM_SIZE + i] = last_id >> (24 - 8 * i);
+  }
+}
+
+uint32_t trigram_block_last_id(char* value) {
+  uint8_t* bytes = (uint8_t*)value + TRIGRAM_SIZE;
+  return (uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+/* Append the ids of the block in entry to ids; returns how many there were */
+uint32_t trigram_block_decode(char* entry, uint32_t* ids) {
+  uint8_t* bytes = (uint8_t*)index_entry_value(entry);
+  uint32_t length = index_entry_length(entry);
+  uint32_t count = 0;
+  uint32_t id = 0;
+  for (uint32_t offset = TRIGRAM_KEY_SIZE; offset < length;) {
+    uint32_t delta;
+    offset += varint_decode(bytes + offset, &delta);
+    id += delta;
+    ids[count++] = id;
+  }
+  return count;
+}
+
+/* Write a block entry value for ids and add it to the index */
+void trigram_block_insert(Table* table, uint32_t* root_slot, const char* trigram,
+                          uint32_t last_id, uint32_t* ids, uint32_t count) {
+  char value[TRIGRAM_MAX_ENTRY_SIZE];
+  trigram_key(value, trigram, last_id);
+  uint32_t length = TRIGRAM_KEY_SIZE;
+  uint32_t previous = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    length += varint_encode(ids[i] - previous, (uint8_t*)value + length);
+    previous = ids[i];
+  }
+  IndexKey key = {value, length, 0};
+  index_insert(table, root_slot, &key);
+}
+
+/*
+Add id to or remove it from the posting list of trigram. The block it
+belongs in is replaced by its new contents, split in two when they grow
+past TRIGRAM_BLOCK_SIZE bytes.
+*/
+void trigram_post(Table* table, uint32_t* root_slot, const char* trigram, uint32_t id,
+                  bool insert) {
+  char probe[TRIGRAM_KEY_SIZE];
+  trigram_key(probe, trigram, id);
+  IndexKey key = {probe, TRIGRAM_KEY_SIZE, 0};
+  IndexCursor cursor = {NULL, NULL, 0, 0};
+
+  uint32_t ids[TRIGRAM_MAX_ENTRY_SIZE + 1];
+  uint32_t count = 0;
+  uint32_t last_id = TRIGRAM_TAIL_ID;
+  char old_value[TRIGRAM_MAX_ENTRY_SIZE];
+  IndexKey old_key = {old_value, 0, 0};
+  if (index_cursor_seek(table, &cursor, *root_slot, &key)) {
+    char* entry = index_cursor_entry(&cursor);
+    if (memcmp(index_entry_value(entry), trigram, TRIGRAM_SIZE) == 0) {
+      old_key.length = index_entry_length(entry);
+      memcpy(old_value, index_entry_value(entry), old_key.length);
+      last_id = trigram_block_last_id(old_value);
+      count = trigram_block_decode(entry, ids);
+    }
+  }
+  index_cursor_release(table, &cursor);
+
+  uint32_t position = 0;
+  while (position < count && ids[position] < id) {
+    position++;
+  }
+  bool present = position < count && ids[position] == id;
+  if (insert == present) {
+    return;
+  }
+  if (old_key.length > 0) {
+    index_delete(table, *root_slot, &old_key);
+  }
+  if (insert) {
+    memmove(ids + position + 1, ids + position, (count - position) * sizeof(uint32_t));
+    ids[position] = id;
+    count++;
+  } else {
+    memmove(ids + position, ids + position + 1, (count - position - 1) * sizeof(uint32_t));
+    count--;
+  }
+  if (count == 0) {
+    return;
+  }
+
+  uint8_t scratch[5];
+  uint32_t bytes = 0;
+  uint32_t previous = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    bytes += varint_encode(ids[i] - previous, scratch);
+    previous = ids[i];
+  }
+  if (bytes <= TRIGRAM_BLOCK_SIZE) {
+    trigram_block_insert(table, root_slot, trigram, last_id, ids, count);
+    return;
+  }
+  /* The lower half becomes a block of its own, ending at its largest id */
+  uint32_t half = count / 2;
+  trigram_block_insert(table, root_slot, trigram, ids[half - 1], ids, half);
+  trigram_block_insert(table, root_slot, trigram, last_id, ids + half, count - half);
+}
+
+/* Post or unpost id under every distinct trigram of the row's column value */
+void trigram_index_row(Table* table, uint32_t* root_slot, Column column, uint32_t id,
+                       char* value, bool insert) {
+  IndexKey key = index_key_from_row(value, column, id);
+  for (uint32_t i = 0; i + TRIGRAM_SIZE <= key.length; i++) {
+    bool repeated = false;
+    for (uint32_t j = 0; j < i && !repeated; j++) {
+      repeated = memcmp(key.value + j, key.value + i, TRIGRAM_SIZE) == 0;
+    }
+    if (!repeated) {
+      trigram_post(table, root_slot, key.value + i, id, insert);
+    }
+  }
+}
+
+/*
+Every id posted under trigram, in order, appended to a growing array.
+False if the array cannot grow.
+*/
+bool trigram_postings(Table* table, uint32_t root, const char* trigram, uint32_t** ids,
+                      uint32_t* capacity, uint32_t* num_ids) {
+  char probe[TRIGRAM_KEY_SIZE];
+  trigram_key(probe, trigram, 0);
+  IndexKey key = {probe, TRIGRAM_KEY_SIZE, 0};
+  IndexCursor cursor = {NULL, NULL, 0, 0};
+  uint32_t count = 0;
+  bool on_entry = index_cursor_seek(table, &cursor, root, &key);
+  while (on_entry) {
+    char* entry = index_cursor_entry(&cursor);
+    if (memcmp(index_entry_value(entry), trigram, TRIGRAM_SIZE) != 0) {
+      break;
+    }
+    if (count + TRIGRAM_MAX_ENTRY_SIZE > *capacity) {
+      uint32_t* grown = memory_realloc(MEMORY_SCRATCH, *ids,
+                                       (count + TRIGRAM_MAX_ENTRY_SIZE) * 2 * sizeof(uint32_t));
+      if (grown == NULL) {
+        index_cursor_release(table, &cursor);
+        return false;
+      }
+      *ids = grown;
+      *capacity = (count + TRIGRAM_MAX_ENTRY_SIZE) * 2;
+    }
+    count += trigram_block_decode(entry, *ids + count);
+    on_entry = index_cursor_advance(table, &cursor);
+  }
+  index_cursor_release(table, &cursor);
+  *num_ids = count;
+  return true;
+}
+
+/*
+Ids of the rows whose value may contain text: the intersection of the
+posting lists of its trigrams. Candidates still have to be checked
+against the row, since the trigrams can appear in a different order.
+False if memory runs out.
+*/
+bool trigram_candidates(Table* table, uint32_t root, const char* text, uint32_t** candidates,
+                        uint32_t* num_candidates) {
+  uint32_t length = strlen(text);
+  uint32_t* result = NULL;
+  uint32_t count = 0;
+  uint32_t* postings = NULL;
+  uint32_t capacity = 0;
+  bool ok = true;
+  for (uint32_t i = 0; i + TRIGRAM_SIZE <= length; i++) {
+    uint32_t num_postings = 0;
+    if (!trigram_postings(table, root, text + i, &postings, &capacity, &num_postings)) {
+      ok = false;
+      break;
+    }
+    if (result == NULL) {
+      result = memory_alloc(MEMORY_SCRATCH, (num_postings + 1) * sizeof(uint32_t));
+      if (result == NULL) {
+        ok = false;
+        break;
+      }
+      memcpy(result, postings, num_postings * sizeof(uint32_t));
+      count = num_postings;
+    } else {
+      /* Merge-intersect two sorted lists into result */
+      uint32_t kept = 0;
+      uint32_t j = 0;
+      for (uint32_t k = 0; k < count && j < num_postings; k++) {
+        while (j < num_postings && postings[j] < result[k]) {
+          j++;
+        }
+        if (j < num_postings && postings[j] == result[k]) {
+          result[kept++] = result[k];
+        }
+      }
+      count = kept;
+    }
+    if (count == 0) {
+      break;
+    }
+  }
+  memory_free(postings);
+  *candidates = result;
+  *num_candidates = count;
+  return ok;
+}
+
+/*
+Extendible hash index on id. The directory is indexed by the low
+global_depth bits of the id's hash; a full bucket splits on its next bit,
+doubling the directory first when the bucket already uses every bit.
+Buckets are not merged when rows are deleted. A full bucket that already
+uses all HASH_MAX_GLOBAL_DEPTH bits chains an overflow page instead, so
+the index takes every row the table can.
+
+Each entry locates the leaf that holds its row. The tree keeps the
+locators current as rows move between leaves (hash_index_locate), and a
+probe still checks the leaf before it trusts it.
+*/
+uint32_t* hash_bucket_local_depth(char* bucket) {
+  return (uint32_t*)(bucket + HASH_BUCKET_LOCAL_DEPTH_OFFSET);
+}
+
+uint32_t* hash_bucket_num_entries(char* bucket) {
+  return (uint32_t*)(bucket + HASH_BUCKET_NUM_ENTRIES_OFFSET);
+}
+
+uint32_t* hash_bucket_next(char* bucket) {
+  return (uint32_t*)(bucket + HASH_BUCKET_NEXT_OFFSET);
+}
+
+uint32_t* hash_bucket_entry(char* bucket, uint32_t entry_num) {
+  return (uint32_t*)(bucket + HASH_BUCKET_HEADER_SIZE + entry_num * HASH_ENTRY_SIZE);
+}
+
+uint32_t hash_bucket_max_entries() {
+  return (PAGE_SIZE - HASH_BUCKET_HEADER_SIZE) / HASH_ENTRY_SIZE;
+}
+
+/*
+Every bit of the id reaches the low bits, so ids that differ only above the
+directory bits (multiples of 512, say) still land in different buckets
+*/
+uint32_t hash_id(uint32_t id) {
+  id ^= id >> 16;
+  id *= 0x85ebca6bu;
+  id ^= id >> 13;
+  id *= 0xc2b2ae35u;
+  id ^= id >> 16;
+  return id;
+}
+
+uint32_t hash_index_slot(HashIndex* index, uint32_t id) {
+  return hash_id(id) & ((1u << index->global_depth) - 1);
+}
+
+void hash_index_load(Table* table, uint32_t directory_page_num) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  char* directory = get_page(table->pager, directory_page_num, tracker);
+  HashIndex* index = memory_alloc_required(MEMORY_TABLE, sizeof(HashIndex));
+  index->directory_page_num = directory_page_num;
+  index->global_depth = *(uint32_t*)(directory + HASH_DIRECTORY_DEPTH_OFFSET);
+  memcpy(index->buckets, directory + HASH_DIRECTORY_BUCKETS_OFFSET,
+         (1u << index->global_depth) * sizeof(uint32_t));
+  index->num_overflow = *(uint32_t*)(directory + HASH_DIRECTORY_NUM_OVERFLOW_OFFSET);
+  memcpy(index->overflow, directory + HASH_DIRECTORY_OVERFLOW_OFFSET,
+         index->num_overflow * sizeof(uint32_t));
+  table->hash_index = index;
+  unpin_all_pages(table->pager, tracker);
+}
+
+void hash_index_save(Table* table) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  HashIndex* index = table->hash_index;
+  char* directory = get_page(table->pager, index->directory_page_num, tracker);
+  *(uint32_t*)(directory + HASH_DIRECTORY_DEPTH_OFFSET) = index->global_depth;
+  memcpy(directory + HASH_DIRECTORY_BUCKETS_OFFSET, index->buckets,
+         (1u << index->global_depth) * sizeof(uint32_t));
+  *(uint32_t*)(directory + HASH_DIRECTORY_NUM_OVERFLOW_OFFSET) = index->num_overflow;
+  memcpy(directory + HASH_DIRECTORY_OVERFLOW_OFFSET, index->overflow,
+         index->num_overflow * sizeof(uint32_t));
+  unpin_all_pages(table->pager, tracker);
+}
+
+/*
+The entry for id in its bucket's chain, or NULL. The page it sits in is
+left pinned by tracker and returned through page when that is not NULL.
+*/
+uint32_t* hash_index_entry(Table* table, uint32_t id, PinnedPages* tracker, char** page) {
+  HashIndex* index = table->hash_index;
+  uint32_t page_num = index->buckets[hash_index_slot(index, id)];
+  while (page_num != 0) {
+    char* bucket = get_page(table->pager, page_num, tracker);
+    for (uint32_t i = 0; i < *hash_bucket_num_entries(bucket); i++) {
+      uint32_t* entry = hash_bucket_entry(bucket, i);
+      if (entry[HASH_ENTRY_ID] == id) {
+        if (page != NULL) {
+          *page = bucket;
+        }
+        return entry;
+      }
+    }
+    page_num = *hash_bucket_next(bucket);
+  }
+  return NULL;
+}
+
+/*
+Whether id is in the index, copying its row out of the leaf it locates
+when row is not NULL. A locator that does not lead to the row falls back
+to a descent.
+*/
+bool hash_index_find(Table* table, uint32_t id, Row* row) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  uint32_t* entry = hash_index_entry(table, id, tracker, NULL);
+  uint32_t leaf_page_num = entry != NULL ? entry[HASH_ENTRY_LEAF] : 0;
+  unpin_all_pages(table->pager, tracker);
+  if (entry == NULL || row == NULL) {
+    return entry != NULL;
+  }
+
+  Arena* arena = &table->pager->arena;
+  ArenaMark mark = arena_mark(arena);
+  tracker = init_pinned_pages(table->pager);
+  char* leaf = get_page(table->pager, leaf_page_num, tracker);
+  bool located = false;
+  if (get_node_type(leaf) == NODE_LEAF && !page_is_free(table->pager, leaf_page_num)) {
+    Cursor* cursor = leaf_node_find(table, leaf_page_num, id);
+    located = cursor->cell_num < *leaf_node_num_cells(leaf) &&
+              *leaf_node_key(leaf, cursor->cell_num) == id;
+    if (located) {
+      deserialize_row(leaf_node_value(leaf, cursor->cell_num), row);
+    }
+  }
+  unpin_all_pages(table->pager, tracker);
+  arena_release(arena, mark);
+  return located || table_find_row(table, id, row);
+}
+
+/* Split the bucket in slot on its next hash bit, doubling the directory if it must */
+void hash_index_split(Table* table, uint32_t slot) {
+  HashIndex* index = table->hash_index;
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  uint32_t bucket_page_num = index->buckets[slot];
+  char* bucket = get_page(table->pager, bucket_page_num, tracker);
+  uint32_t local_depth = *hash_bucket_local_depth(bucket);
+
+  if (local_depth == index->global_depth) {
+    uint32_t size = 1u << index->global_depth;
+    memcpy(index->buckets + size, index->buckets, size * sizeof(uint32_t));
+    index->global_depth += 1;
+  }
+
+  uint32_t new_page_num = get_unused_page_num(table->pager);
+  char* new_bucket = get_page(table->pager, new_page_num, tracker);
+  memset(new_bucket, 0, PAGE_SIZE);
+  *hash_bucket_local_depth(bucket) = local_depth + 1;
+  *hash_bucket_local_depth(new_bucket) = local_depth + 1;
+
+  /* Entries with the new bit set move to the new bucket */
+  uint32_t bit = 1u << local_depth;
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < *hash_bucket_num_entries(bucket); i++) {
+    uint32_t* entry = hash_bucket_entry(bucket, i);
+    if (hash_id(entry[HASH_ENTRY_ID]) & bit) {
+      memcpy(hash_bucket_entry(new_bucket, *hash_bucket_num_entries(new_bucket)), entry,
+             HASH_ENTRY_SIZE);
+      *hash_bucket_num_entries(new_bucket) += 1;
+    } else {
+      memmove(hash_bucket_entry(bucket, kept), entry, HASH_ENTRY_SIZE);
+      kept++;
+    }
+  }
+  *hash_bucket_num_entries(bucket) = kept;
+
+  for (uint32_t i = 0; i < (1u << index->global_depth); i++) {
+    if (index->buckets[i] == bucket_page_num && (i & bit)) {
+      index->buckets[i] = new_page_num;
+    }
+  }
+  unpin_all_pages(table->pager, tracker);
+  hash_index_save(table);
+}
+
+/* Add an entry for an id that has none */
+void hash_index_insert(Table* table, uint32_t id, uint32_t leaf_page_num) {
+  HashIndex* index = table->hash_index;
+  while (true) {
+    PinnedPages* tracker = init_pinned_pages(table->pager);
+    uint32_t slot = hash_index_slot(index, id);
+    char* bucket = get_page(table->pager, index->buckets[slot], tracker);
+    uint32_t local_depth = *hash_bucket_local_depth(bucket);
+    while (*hash_bucket_num_entries(bucket) == hash_bucket_max_entries() &&
+           *hash_bucket_next(bucket) != 0) {
+      bucket = get_page(table->pager, *hash_bucket_next(bucket), tracker);
+    }
+
+    if (*hash_bucket_num_entries(bucket) == hash_bucket_max_entries()) {
+      if (local_depth < HASH_MAX_GLOBAL_DEPTH) {
+        unpin_all_pages(table->pager, tracker);
+        hash_index_split(table, slot);
+        continue;
+      }
+      /* Every entry agrees with id on all the directory bits, so chain a page */
+      uint32_t overflow_page_num = get_unused_page_num(table->pager);
+      char* overflow = get_page(table->pager, overflow_page_num, tracker);
+      memset(overflow, 0, PAGE_SIZE);
+      *hash_bucket_local_depth(overflow) = local_depth;
+      *hash_bucket_next(bucket) = overflow_page_num;
+      index->overflow[index->num_overflow++] = overflow_page_num;
+      hash_index_save(table);
+      bucket = overflow;
+    }
+
+    uint32_t* entry = hash_bucket_entry(bucket, *hash_bucket_num_entries(bucket));
+    entry[HASH_ENTRY_ID] = id;
+    entry[HASH_ENTRY_LEAF] = leaf_page_num;
+    *hash_bucket_num_entries(bucket) += 1;
+    unpin_all_pages(table->pager, tracker);
+    return;
+  }
+}
+
+/* Record that the row with id now lives in leaf_page_num, adding its entry if it has none */
+void hash_index_locate(Table* table, uint32_t id, uint32_t leaf_page_num) {
+  if (table->hash_index == NULL) {
+    return;
+  }
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  uint32_t* entry = hash_index_entry(table, id, tracker, NULL);
+  if (entry != NULL) {
+    entry[HASH_ENTRY_LEAF] = leaf_page_num;
+  }
+  unpin_all_pages(table->pager, tracker);
+  if (entry == NULL) {
+    hash_index_insert(table, id, leaf_page_num);
+  }
+}
+
+/* Locate every row of a leaf whose cells were moved there as a whole */
+void hash_index_locate_leaf(Table* table, uint32_t leaf_page_num) {
+  if (table->hash_index == NULL) {
+    return;
+  }
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  char* leaf = get_page(table->pager, leaf_page_num, tracker);
+  uint32_t num_cells = *leaf_node_num_cells(leaf);
+  uint32_t keys[LEAF_NODE_MAX_CELLS];
+  for (uint32_t i = 0; i < num_cells; i++) {
+    keys[i] = *leaf_node_key(leaf, i);
+  }
+  unpin_all_pages(table->pager, tracker);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    hash_index_locate(table, keys[i], leaf_page_num);
+  }
+}
+
+void hash_index_delete(Table* table, uint32_t id) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  char* bucket;
+  uint32_t* entry = hash_index_entry(table, id, tracker, &bucket);
+  if (entry != NULL) {
+    uint32_t num_entries = *hash_bucket_num_entries(bucket);
+    memmove(entry, hash_bucket_entry(bucket, num_entries - 1), HASH_ENTRY_SIZE);
+    *hash_bucket_num_entries(bucket) = num_entries - 1;
+  }
+  unpin_all_pages(table->pager, tracker);
+}
+
+/* A directory of one slot pointing at one empty bucket */
+void hash_index_create(Table* table) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  HashIndex* index = memory_alloc_required(MEMORY_TABLE, sizeof(HashIndex));
+  index->directory_page_num = get_unused_page_num(table->pager);
+  memset(get_page(table->pager, index->directory_page_num, tracker), 0, PAGE_SIZE);
+  index->global_depth = 0;
+  index->buckets[0] = get_unused_page_num(table->pager);
+  memset(get_page(table->pager, index->buckets[0], tracker), 0, PAGE_SIZE);
+  index->num_overflow = 0;
+  unpin_all_pages(table->pager, tracker);
+  table->hash_index = index;
+  hash_index_save(table);
+  table_save_catalog(table);
+}
+
+/* Build an index over the rows already in the table */
+ExecuteResult execute_create_index(Statement* statement, Table* table) {
+  Column column = statement->index_column;
+  uint32_t* root = statement->reverse_index   ? &table->reverse_index_roots[column]
+                   : statement->trigram_index ? &table->trigram_index_roots[column]
+                                              : &table->index_roots[column];
+  if (statement->hash_index) {
+    if (table->hash_index != NULL) {
+      return EXECUTE_INDEX_EXISTS;
+    }
+    hash_index_create(table);
+  } else {
+    if (*root != 0) {
+      return EXECUTE_INDEX_EXISTS;
+    }
+    PinnedPages* tracker = init_pinned_pages(table->pager);
+    uint32_t root_page_num = get_unused_page_num(table->pager);
+    initialize_index_node(get_page(table->pager, root_page_num, tracker), NODE_LEAF);
+    unpin_all_pages(table->pager, tracker);
+    *root = root_page_num;
+    table_save_catalog(table);
+  }
+
+  Cursor* cursor = table_start(table);
+  char value[ROW_VALUE_SIZE];
+  while (!cursor->end_of_table) {
+    memcpy(value, cursor_value(cursor), ROW_VALUE_SIZE);
+    if (statement->hash_index) {
+      uint32_t id;
+      memcpy(&id, value + ID_OFFSET, ID_SIZE);
+      hash_index_insert(table, id, cursor->page_num);
+    } else {
+      uint32_t id;
+      memcpy(&id, value + ID_OFFSET, ID_SIZE);
+      char buffer[COLUMN_EMAIL_SIZE];
+      IndexKey key = index_key_from_row(value, column, id);
+      if (statement->trigram_index) {
+        trigram_index_row(table, root, column, id, value, true);
+      } else {
+        if (statement->reverse_index) {
+          index_key_reverse(&key, buffer);
+        }
+        index_insert(table, root, &key);
+      }
+    }
+    cursor_advance(cursor);
+  }
+  cursor_release(cursor);
+  return EXECUTE_SUCCESS;
+}
+
+RowCacheSlot* row_cache_slot(RowCache* cache, uint32_t id) {
+  return &cache->slots[hash_id(id) & (cache->num_slots - 1)];
+}
+
+/*
+Copy out the cached row with id, if there is one. Callers get a copy
+because the cache can be shed by any allocation that runs short of memory.
+*/
+bool row_cache_get(RowCache* cache, uint32_t id, Row* row) {
+  if (cache->num_slots == 0) {
+    return false;
+  }
+  RowCacheSlot* slot = row_cache_slot(cache, id);
+  if (slot->valid && slot->row.id == id) {
+    cache->hits++;
+    *row = slot->row;
+    return true;
+  }
+  cache->misses++;
+  return false;
+}
+
+void row_cache_put(RowCache* cache, Row* row) {
+  if (cache->num_slots == 0) {
+    return;
+  }
+  RowCacheSlot* slot = row_cache_slot(cache, row->id);
+  slot->valid = true;
+  slot->row = *row;
+}
+
+void row_cache_invalidate(RowCache* cache, uint32_t id) {
+  if (cache->num_slots == 0) {
+    return;
+  }
+  RowCacheSlot* slot = row_cache_slot(cache, id);
+  if (slot->valid && slot->row.id == id) {
+    slot->valid = false;
+  }
+}
+
+uint64_t sketch_hash(const char* text, uint32_t length) {
+  /* FNV-1a, then a finalizer so the top bits that pick a register are well mixed */
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint32_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)text[i];
+    hash *= 1099511628211ULL;
+  }
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+  return hash ^ (hash >> 31);
+}
+
+/* A register keeps the longest run of leading zeros seen after its index bits */
+void sketch_add(uint8_t* registers, const char* text) {
+  uint64_t hash = sketch_hash(text, strlen(text));
+  uint64_t rest = hash << SKETCH_PRECISION;
+  uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - SKETCH_PRECISION + 1;
+  uint8_t* slot = &registers[hash >> (64 - SKETCH_PRECISION)];
+  *slot = rank > *slot ? rank : *slot;
+}
+
+const char* email_domain(const char* email);
+
+/* Add a row, given in the leaf cell value format, to every sketch */
+void sketches_add_row(DistinctSketches* sketches, char* value) {
+  sketch_add(sketches->registers[0], value + USERNAME_OFFSET);
+  sketch_add(sketches->registers[1], value + EMAIL_OFFSET);
+  sketch_add(sketches->registers[2], email_domain(value + EMAIL_OFFSET));
+}
+
+/* Standard HyperLogLog estimate, counting empty registers while the sketch is sparse */
+double sketch_estimate(uint8_t* registers) {
+  double m = SKETCH_REGISTERS;
+  double sum = 0;
+  uint32_t zeros = 0;
+  for (uint32_t i = 0; i < SKETCH_REGISTERS; i++) {
+    sum += ldexp(1.0, -registers[i]);
+    zeros += registers[i] == 0;
+  }
+  double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  if (estimate <= 2.5 * m && zeros > 0) {
+    estimate = m * log(m / zeros);
+  }
+  return estimate;
+}
+
+/* Which sketch counts an expression; only text columns have one */
+uint32_t sketch_for(Column column, ColumnFunction function) {
+  if (function == FUNCTION_DOMAIN) {
+    return 2;
+  }
+  return column == COLUMN_USERNAME ? 0 : 1;
+}
+
+/* Start the sketches over from every row in the table; returns how many were read */
+uint32_t sketches_rebuild(Table* table) {
+  DistinctSketches* sketches = &table->sketches;
+  memset(sketches->registers, 0, sizeof(sketches->registers));
+  uint32_t num_rows = 0;
+  Cursor* cursor = table_start(table);
+  while (!cursor->end_of_table) {
+    sketches_add_row(sketches, cursor_value(cursor));
+    num_rows++;
+    cursor_advance(cursor);
+  }
+  cursor_release(cursor);
+  sketches->valid = true;
+  return num_rows;
+}
+
+/* Write the sketches to their page, which is allocated and cataloged on first save */
+void sketches_save(Table* table) {
+  DistinctSketches* sketches = &table->sketches;
+  if (!sketches->valid) {
+    return;
+  }
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  bool first_save = sketches->page_num == 0;
+  if (first_save) {
+    sketches->page_num = get_unused_page_num(table->pager);
+  }
+  /* Fetching the page claims it, so the catalog cannot be given the same one */
+  char* page = get_page(table->pager, sketches->page_num, tracker);
+  if (first_save) {
+    table_save_catalog(table);
+  }
+  memset(page, 0, PAGE_SIZE);
+  memcpy(page, sketches->registers, sizeof(sketches->registers));
+  unpin_all_pages(table->pager, tracker);
+}
+
+/*
+Copy out the rows for a sorted, duplicate-free list of ids under page_num,
+in id order, and return how many exist. The ids are split among the
+children in one pass per internal node, so every node on the way down is
+read at most once per batch however many of the ids it covers.
+*/
+uint32_t table_find_rows(Table* table, uint32_t page_num, const uint32_t* ids,
+                         uint32_t num_ids, Row* rows) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  char* node = get_page(table->pager, page_num, tracker);
+  uint32_t found = 0;
+  if (get_node_type(node) == NODE_LEAF) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t cell_num = 0;
+    for (uint32_t i = 0; i < num_ids && cell_num < num_cells; i++) {
+      while (cell_num < num_cells && *leaf_node_key(node, cell_num) < ids[i]) {
+        cell_num++;
+      }
+      if (cell_num < num_cells && *leaf_node_key(node, cell_num) == ids[i]) {
+        deserialize_row(leaf_node_value(node, cell_num), &rows[found++]);
+      }
+    }
+  } else {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t first = 0;
+    for (uint32_t child_num = 0; child_num <= num_keys && first < num_ids; child_num++) {
+      uint32_t last = first;
+      if (child_num == num_keys) {
+        last = num_ids;
+      } else {
+        uint32_t max_key = *internal_node_key(node, child_num);
+        while (last < num_ids && ids[last] <= max_key) {
+          last++;
+        }
+      }
+      if (last > first) {
+        found += table_find_rows(table, *internal_node_child(node, child_num), ids + first,
+                                 last - first, rows + found);
+      }
+      first = last;
+    }
+  }
+  unpin_all_pages(table->pager, tracker);
+  return found;
+}
+
+uint64_t table_random(Table* table) {
+  uint64_t x = (table->random_state += 0x9E3779B97F4A7C15ull);
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+/*
+One try at a uniformly random row, by acceptance/rejection since nodes do
+not know their subtree sizes. Each internal node is entered with chance
+num_children / max_children and leaves pick a slot out of the most cells a
+leaf can hold, so with every leaf at the same depth every row is equally
+likely to be the one accepted. False if the try was rejected.
+*/
+bool table_sample_row(Table* table, Row* row) {
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  uint32_t page_num = table->root_page_num;
+  bool accepted = false;
+  while (true) {
+    char* node = get_page(table->pager, page_num, tracker);
+    if (get_node_type(node) == NODE_LEAF) {
+      uint32_t cell_num = table_random(table) % LEAF_NODE_MAX_CELLS;
+      accepted = cell_num < *leaf_node_num_cells(node);
+      if (accepted) {
+        deserialize_row(leaf_node_value(node, cell_num), row);
+      }
+      break;
+    }
+    uint32_t child_num = table_random(table) % (INTERNAL_NODE_MAX_KEYS + 1);
+    if (child_num > *internal_node_num_keys(node)) {
+      break;
+    }
+    page_num = *internal_node_child(node, child_num);
+  }
+  unpin_all_pages(table->pager, tracker);
+  return accepted;
+}
+
+/*
+Up to sample_size distinct rows chosen uniformly at random, in random
+order. Each accepted try costs one descent. If too many tries are rejected
+or repeat a row, as when the sample covers most of a small table, a
+reservoir sample over a full scan finishes the job instead. The planner
+asks for the scan up front when the statistics say it will come to that.
+*/
+uint32_t table_sample_rows(Table* table, uint32_t sample_size, Row* rows, bool scan) {
+  uint32_t capacity = 1;
+  while (capacity < 2 * sample_size) {
+    capacity *= 2;
+  }
+  uint64_t* seen = scan ? NULL : arena_alloc(&table->pager->arena, capacity * sizeof(uint64_t));
+  uint32_t count = 0;
+  /* Without room to remember the sampled ids, go straight to the reservoir pass */
+  uint64_t max_tries = seen ? 64 * (uint64_t)sample_size + 1024 : 0;
+  if (seen) {
+    memset(seen, 0, capacity * sizeof(uint64_t));  // id + 1 of each sampled row
+  }
+  for (uint64_t tries = 0; count < sample_size && tries < max_tries; tries++) {
+    if (!table_sample_row(table, &rows[count])) {
+      continue;
+    }
+    uint32_t slot = hash_id(rows[count].id) & (capacity - 1);
+    while (seen[slot] != 0 && seen[slot] != rows[count].id + 1ull) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    if (seen[slot] == 0) {
+      seen[slot] = rows[count].id + 1ull;
+      count++;
+    }
+  }
+  if (count == sample_size) {
+    return count;
+  }
+
+  count = 0;
+  uint64_t num_rows = 0;
+  Cursor* cursor = table_start(table);
+  while (!cursor->end_of_table) {
+    uint64_t slot = num_rows < sample_size ? num_rows : table_random(table) % (num_rows + 1);
+    if (slot < sample_size) {
+      deserialize_row(cursor_value(cursor), &rows[slot]);
+    }
+    num_rows++;
+    cursor_advance(cursor);
+  }
+  cursor_release(cursor);
+  return num_rows < sample_size ? num_rows : sample_size;
+}
+
+#define LOOKUP_GROUP_SIZE 8
+
+/* One in-flight lookup of an interleaved batch: the page it descends to next */
+typedef struct {
+  uint32_t index;  // position of its id in the batch
+  uint32_t page_num;
+} Lookup;
+
+/* Hint the cache lines a binary search of a resident page touches first */
+void prefetch_node(Pager* pager, uint32_t page_num) {
+  if (pager->page_numbers[page_num] == -1) {
+    return;
+  }
+  char* node = pager->pages[pager->page_numbers[page_num]];
+  __builtin_prefetch(node);
+  if (get_node_type(node) == NODE_LEAF) {
+    __builtin_prefetch(leaf_node_key(node, *leaf_node_num_cells(node) / 2));
+  } else {
+    __builtin_prefetch(internal_node_key(node, *internal_node_num_keys(node) / 2));
+  }
+}
+
+/*
+Look up ids in any order, one row each into rows, with found[i] telling
+whether ids[i] exists. Up to LOOKUP_GROUP_SIZE lookups are in flight: each
+takes one step down the tree, prefetches the node it moves to and yields to
+the next, so a miss on one lookup's node overlaps with the work of the
+others instead of stalling the whole batch. With the ten-frame pager every
+node is already in cache and get_page's bookkeeping dominates, so this only
+pays off once the pager can hold more than the CPU caches.
+*/
+uint32_t table_find_rows_interleaved(Table* table, const uint32_t* ids, uint32_t num_ids,
+                                     Row* rows, bool* found) {
+  Lookup group[LOOKUP_GROUP_SIZE];
+  uint32_t num_active = 0;
+  uint32_t next = 0;
+  uint32_t num_found = 0;
+  while (num_active > 0 || next < num_ids) {
+    while (num_active < LOOKUP_GROUP_SIZE && next < num_ids) {
+      group[num_active].index = next++;
+      group[num_active].page_num = table->root_page_num;
+      num_active++;
+    }
+    for (uint32_t i = 0; i < num_active;) {
+      Lookup* lookup = &group[i];
+      uint32_t id = ids[lookup->index];
+      PinnedPages* tracker = init_pinned_pages(table->pager);
+      char* node = get_page(table->pager, lookup->page_num, tracker);
+      bool done = get_node_type(node) == NODE_LEAF;
+      if (done) {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t min_index = 0;
+        uint32_t max_index = num_cells;
+        while (min_index != max_index) {
+          uint32_t index = (min_index + max_index) / 2;
+          if (*leaf_node_key(node, index) < id) {
+            min_index = index + 1;
+          } else {
+            max_index = index;
+          }
+        }
+        found[lookup->index] = min_index < num_cells && *leaf_node_key(node, min_index) == id;
+        if (found[lookup->index]) {
+          deserialize_row(leaf_node_value(node, min_index), &rows[lookup->index]);
+          num_found++;
+        }
+      } else {
+        lookup->page_num = *internal_node_child(node, internal_node_find_child(node, id));
+        prefetch_node(table->pager, lookup->page_num);
+      }
+      unpin_all_pages(table->pager, tracker);
+      if (done) {
+        *lookup = group[--num_active];
+      } else {
+        i++;
+      }
+    }
+  }
+  return num_found;
+}
+
+/* Two independent hashes of id; probe i of the filter uses h1 + i * h2 */
+void key_filter_hashes(uint32_t id, uint64_t* h1, uint64_t* h2) {
+  uint64_t x = id + 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  x ^= x >> 31;
+  *h1 = x;
+  *h2 = (x >> 32) | 1;
+}
+
+void key_filter_set(KeyFilter* filter, uint32_t id) {
+  uint64_t h1, h2;
+  key_filter_hashes(id, &h1, &h2);
+  for (uint32_t i = 0; i < KEY_FILTER_PROBES; i++) {
+    uint64_t bit = (h1 + i * h2) & (filter->num_bits - 1);
+    filter->bits[bit / 64] |= 1ull << (bit % 64);
+  }
+}
+
+/*
+Empty the filter and give it num_bits cleared bits. False, leaving it
+invalid, if they cannot be allocated.
+*/
+bool key_filter_reset(KeyFilter* filter, uint32_t num_bits) {
+  /*
+  The allocation may shed the caches, and shedding frees the bits, so the
+  old bits must already be gone from the filter.
+  */
+  memory_free(filter->bits);
+  filter->bits = NULL;
+  filter->valid = false;
+  filter->saved = false;
+  filter->num_bits = num_bits;
+  filter->num_keys = 0;
+  filter->num_deleted = 0;
+  filter->bits = memory_calloc(MEMORY_CACHE, num_bits / 64, sizeof(uint64_t));
+  if (filter->bits == NULL) {
+    filter->refused = true;
+    return false;
+  }
+  filter->valid = true;
+  return true;
+}
+
+/*
+Walk every leaf once and set the bits of every id, sized for twice as many
+up to one page of bits. False, leaving the filter invalid, if the bits
+cannot be allocated.
+*/
+bool key_filter_build(Table* table) {
+  KeyFilter* filter = &table->key_filter;
+  uint32_t num_keys = 0;
+  Cursor* cursor = table_start(table);
+  uint32_t first_page_num = cursor->page_num;
+
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      uint32_t num_bits = KEY_FILTER_MIN_BITS;
+      while (num_bits < 2 * num_keys * KEY_FILTER_BITS_PER_KEY &&
+             num_bits < KEY_FILTER_MAX_BITS) {
+        num_bits *= 2;
+      }
+      if (!key_filter_reset(filter, num_bits)) {
+        return false;
+      }
+      filter->valid = false;
+    }
+    uint32_t page_num = first_page_num;
+    while (true) {
+      PinnedPages* tracker = init_pinned_pages(table->pager);
+      char* node = get_page(table->pager, page_num, tracker);
+      uint32_t num_cells = *leaf_node_num_cells(node);
+      if (pass == 0) {
+        num_keys += num_cells;
+      } else {
+        for (uint32_t i = 0; i < num_cells; i++) {
+          key_filter_set(filter, *leaf_node_key(node, i));
+        }
+      }
+      page_num = *leaf_node_next_leaf(node);
+      unpin_all_pages(table->pager, tracker);
+      if (page_num == 0) {
+        break;
+      }
+    }
+  }
+  filter->num_keys = num_keys;
+  filter->valid = true;
+  return true;
+}
+
+/* Read back the filter the last close saved; num_bits is 0 if it cannot be trusted */
+void key_filter_load(Table* table, uint32_t num_bits, uint32_t num_keys, uint32_t num_deleted) {
+  KeyFilter* filter = &table->key_filter;
+  if (filter->page_num == 0 || num_bits < KEY_FILTER_MIN_BITS ||
+      num_bits > KEY_FILTER_MAX_BITS || (num_bits & (num_bits - 1)) != 0 ||
+      !key_filter_reset(filter, num_bits)) {
+    return;
+  }
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  memcpy(filter->bits, get_page(table->pager, filter->page_num, tracker), num_bits / 8);
+  unpin_all_pages(table->pager, tracker);
+  filter->num_keys = num_keys;
+  filter->num_deleted = num_deleted;
+
+  /* From here on the rows change without the saved copy, so stop vouching for it now */
+  table_save_catalog(table);
+  pager_flush(table->pager, *pager_catalog_page_num(table->pager));
+}
+
+/* Write the filter to its page, which is allocated on first save, and vouch for it */
+void key_filter_save(Table* table) {
+  KeyFilter* filter = &table->key_filter;
+  if (!filter->valid) {
+    return;
+  }
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  if (filter->page_num == 0) {
+    filter->page_num = get_unused_page_num(table->pager);
+  }
+  /* Fetching the page claims it, so the catalog cannot be given the same one */
+  char* page = get_page(table->pager, filter->page_num, tracker);
+  memset(page, 0, PAGE_SIZE);
+  memcpy(page, filter->bits, filter->num_bits / 8);
+  filter->saved = true;
+  table_save_catalog(table);
+  unpin_all_pages(table->pager, tracker);
+}
+
+bool key_filter_test(KeyFilter* filter, uint32_t id) {
+  uint64_t h1, h2;
+  key_filter_hashes(id, &h1, &h2);
+  for (uint32_t i = 0; i < KEY_FILTER_PROBES; i++) {
+    uint64_t bit = (h1 + i * h2) & (filter->num_bits - 1);
+    if (!(filter->bits[bit / 64] & (1ull << (bit % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+False only if id is certainly not in the table, in which case no page was
+read. With rebuild, a missing, stale or outgrown filter is first rebuilt
+from the leaves; without it the filter is used as it is, since a stale one
+only lets more missing ids through to the tree.
+*/
+bool key_filter_may_contain(Table* table, uint32_t id, bool rebuild) {
+  KeyFilter* filter = &table->key_filter;
+  if (!rebuild || (!filter->valid && filter->refused)) {
+    return !filter->valid || key_filter_test(filter, id);
+  }
+  if (!filter->valid || filter->num_deleted > filter->num_keys / 4 ||
+      (filter->num_keys * KEY_FILTER_BITS_PER_KEY > filter->num_bits &&
+       filter->num_bits < KEY_FILTER_MAX_BITS)) {
+    if (!key_filter_build(table)) {
+      return true;
+    }
+  }
+  return key_filter_test(filter, id);
+}
+
+/*
+Insert a row that is already serialized in the leaf cell value format.
+*/
+ExecuteResult table_insert(Table* table, uint32_t key_to_insert, char* value) {
+
+  /* The hash index answers the duplicate check without a descent */
+  if (table->hash_index && hash_index_find(table, key_to_insert, NULL)) {
+    return EXECUTE_DUPLICATE_KEY;
+  }
+
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+
+  Cursor* cursor = table_find(table, key_to_insert);
+  char* node = get_page(table->pager, cursor->page_num, tracker);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  if (cursor->cell_num < num_cells) {
+    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+    if (key_at_index == key_to_insert) {
+      unpin_all_pages(table->pager, tracker);
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+
+  leaf_node_insert(cursor, key_to_insert, value);
+
+  unpin_all_pages(cursor->table->pager, tracker);
+
+  table->insert_stats.rows += 1;
+  table->insert_stats.bytes_copied += ROW_VALUE_SIZE;  // the row's encoding by the parser or binder
+  table_index_row(table, key_to_insert, value, true);
+  row_cache_invalidate(&table->row_cache, key_to_insert);
+  if (table->sketches.valid) {
+    sketches_add_row(&table->sketches, value);
+  }
+  if (table->key_filter.valid) {
+    key_filter_set(&table->key_filter, key_to_insert);
+    table->key_filter.num_keys += 1;
+  }
+  return EXECUTE_SUCCESS;
+}
+
+#define BATCH_SIZE 1024
+
+/*
+A column-oriented batch of up to BATCH_SIZE rows, filled from whole leaves
+at a time. Only the columns a query needs are decoded. Filters clear
+mask[i] for rows that fail a predicate; selection lists the surviving rows
+once the mask is compacted.
+*/
+typedef struct Batch {
+  uint32_t num_rows;
+  uint32_t ids[BATCH_SIZE];
+  char usernames[BATCH_SIZE][COLUMN_USERNAME_SIZE + 1];
+  char emails[BATCH_SIZE][COLUMN_EMAIL_SIZE + 1];
+  uint8_t mask[BATCH_SIZE];
+  uint32_t num_selected;
+  uint16_t selection[BATCH_SIZE];
+} Batch;
+
+typedef struct {
+  Table* table;
+  uint32_t page_num;
+  uint32_t cell_num;
+  bool end_of_table;
+  uint32_t columns;  // COLUMN_BIT mask of the columns to decode
+} BatchScan;
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint32_t min;
+  uint32_t max;
+} AggregateState;
+
+uint32_t select_query_columns(SelectQuery* query) {
+  uint32_t columns = query->has_order_by ? COLUMN_BIT(query->order_column) : 0;
+  if (query->has_group_by) {
+    columns |= COLUMN_BIT(query->group_column);
+  }
+  for (uint32_t i = 0; i < query->num_projections; i++) {
+    if (query->projections[i].aggregate != AGGREGATE_COUNT) {
+      columns |= COLUMN_BIT(query->projections[i].column);
+    }
+  }
+  for (uint32_t i = 0; i < query->num_predicates; i++) {
+    columns |= COLUMN_BIT(query->predicates[i].column);
+  }
+  return columns;
+}
+
+void batch_scan_open(BatchScan* scan, Table* table, uint32_t columns) {
+  Cursor* cursor = table_start(table);
+  scan->table = table;
+  scan->page_num = cursor->page_num;
+  scan->cell_num = 0;
+  scan->end_of_table = cursor->end_of_table;
+  scan->columns = columns;
+}
+
+/*
+Decode num_cells consecutive cells of a leaf into batch rows starting at
+offset, one column at a time.
+*/
+void decode_leaf_columns(char* node, uint32_t first_cell, uint32_t num_cells,
+                         uint32_t columns, Batch* batch, uint32_t offset) {
+  if (columns & COLUMN_BIT(COLUMN_ID)) {
+    for (uint32_t i = 0; i < num_cells; i++) {
+      batch->ids[offset + i] = *leaf_node_key(node, first_cell + i);
+    }
+  }
+  if (columns & COLUMN_BIT(COLUMN_USERNAME)) {
+    for (uint32_t i = 0; i < num_cells; i++) {
+      memcpy(batch->usernames[offset + i],
+             leaf_node_value(node, first_cell + i) + USERNAME_OFFSET, USERNAME_SIZE);
+    }
+  }
+  if (columns & COLUMN_BIT(COLUMN_EMAIL)) {
+    for (uint32_t i = 0; i < num_cells; i++) {
+      memcpy(batch->emails[offset + i],
+             leaf_node_value(node, first_cell + i) + EMAIL_OFFSET, EMAIL_SIZE);
+    }
+  }
+}
+
+/*
+Fill the next batch by following the leaf chain. Each leaf is fetched once
+and all of its remaining cells are decoded together.
+*/
+bool batch_scan_next(BatchScan* scan, Batch* batch) {
+  Pager* pager = scan->table->pager;
+  batch->num_rows = 0;
+
+  while (!scan->end_of_table && batch->num_rows < BATCH_SIZE) {
+    PinnedPages* tracker = init_pinned_pages(pager);
+    char* node = get_page(pager, scan->page_num, tracker);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    uint32_t count = 0;
+    if (scan->cell_num < num_cells) {
+      count = num_cells - scan->cell_num;
+    }
+    if (count > BATCH_SIZE - batch->num_rows) {
+      count = BATCH_SIZE - batch->num_rows;
+    }
+    decode_leaf_columns(node, scan->cell_num, count, scan->columns, batch,
+                        batch->num_rows);
+    batch->num_rows += count;
+    scan->cell_num += count;
+
+    if (scan->cell_num >= num_cells) {
+      uint32_t next_page_num = *leaf_node_next_leaf(node);
+      if (next_page_num == 0) {
+        scan->end_of_table = true;
+      } else {
+        scan->page_num = next_page_num;
+        scan->cell_num = 0;
+      }
+    }
+    unpin_all_pages(pager, tracker);
+  }
+  return batch->num_rows > 0;
+}
+
+/*
+Filter and aggregate kernels work on whole columns with no branches in the
+loop body, so the compiler can vectorize them.
+*/
+void filter_ids(const uint32_t* ids, uint8_t* mask, uint32_t n, CompareOp op,
+                uint32_t value) {
+  switch (op) {
+    case (COMPARE_EQUAL):
+      for (uint32_t i = 0; i < n; i++) mask[i] &= ids[i] == value;
+      break;
+    case (COMPARE_NOT_EQUAL):
+      for (uint32_t i = 0; i < n; i++) mask[i] &= ids[i] != value;
+      break;
+    case (COMPARE_LESS):
+      for (uint32_t i = 0; i < n; i++) mask[i] &= ids[i] < value;
+      break;
+    case (COMPARE_LESS_EQUAL):
+      for (uint32_t i = 0; i < n; i++) mask[i] &= ids[i] <= value;
+      break;
+    case (COMPARE_GREATER):
+      for (uint32_t i = 0; i < n; i++) mask[i] &= ids[i] > value;
+      break;
+    case (COMPARE_GREATER_EQUAL):
+      for (uint32_t i = 0; i < n; i++) mask[i] &= ids[i] >= value;
+      break;
+    case (COMPARE_PREFIX):
+    case (COMPARE_SUFFIX):
+    case (COMPARE_CONTAINS):
+    case (COMPARE_IN):  // always planned as a multi-get, never filtered
+      break;
+  }
+}
+
+bool compare_result_matches(int result, CompareOp op) {
+  switch (op) {
+    case (COMPARE_EQUAL):
+      return result == 0;
+    case (COMPARE_NOT_EQUAL):
+      return result != 0;
+    case (COMPARE_LESS):
+      return result < 0;
+    case (COMPARE_LESS_EQUAL):
+      return result <= 0;
+    case (COMPARE_GREATER):
+      return result > 0;
+    case (COMPARE_GREATER_EQUAL):
+      return result >= 0;
+    case (COMPARE_PREFIX):
+    case (COMPARE_SUFFIX):
+    case (COMPARE_CONTAINS):
+    case (COMPARE_IN):
+      break;
+  }
+  return false;
+}
+
+/* A text column against the text of a predicate, including prefix and suffix */
+bool text_matches(const char* value, CompareOp op, const char* text) {
+  if (op == COMPARE_CONTAINS) {
+    return strstr(value, text) != NULL;
+  }
+  if (op == COMPARE_PREFIX) {
+    return strncmp(value, text, strlen(text)) == 0;
+  }
+  if (op == COMPARE_SUFFIX) {
+    size_t value_length = strlen(value);
+    size_t text_length = strlen(text);
+    return value_length >= text_length &&
+           memcmp(value + value_length - text_length, text, text_length) == 0;
+  }
+  return compare_result_matches(strcmp(value, text), op);
+}
+
+void filter_text(const char* values, uint32_t stride, uint8_t* mask, uint32_t n,
+                 CompareOp op, const char* text) {
+  for (uint32_t i = 0; i < n; i++) {
+    if (mask[i]) {
+      mask[i] = text_matches(values + i * stride, op, text);
+    }
+  }
+}
+
+void batch_filter(Batch* batch, SelectQuery* query) {
+  memset(batch->mask, 1, batch->num_rows);
+  for (uint32_t i = 0; i < query->num_predicates; i++) {
+    Predicate* predicate = &query->predicates[i];
+    switch (predicate->column) {
+      case (COLUMN_ID):
+        filter_ids(batch->ids, batch->mask, batch->num_rows, predicate->op,
+                   predicate->integer);
+        break;
+      case (COLUMN_USERNAME):
+        filter_text(batch->usernames[0], sizeof(batch->usernames[0]), batch->mask,
+                    batch->num_rows, predicate->op, predicate->text);
+        break;
+      case (COLUMN_EMAIL):
+        filter_text(batch->emails[0], sizeof(batch->emails[0]), batch->mask,
+                    batch->num_rows, predicate->op, predicate->text);
+        break;
+    }
+  }
+}
+
+/* Compact the mask into a selection vector of surviving row indexes */
+void batch_select(Batch* batch) {
+  uint32_t num_selected = 0;
+  for (uint32_t i = 0; i < batch->num_rows; i++) {
+    batch->selection[num_selected] = i;
+    num_selected += batch->mask[i];
+  }
+  batch->num_selected = num_selected;
+}
+
+void aggregate_init(AggregateState* state) {
+  state->count = 0;
+  state->sum = 0;
+  state->min = UINT32_MAX;
+  state->max = 0;
+}
+
+void aggregate_merge(AggregateState* state, const AggregateState* other) {
+  state->count += other->count;
+  state->sum += other->sum;
+  state->min = other->min < state->min ? other->min : state->min;
+  state->max = other->max > state->max ? other->max : state->max;
+}
+
+/* Fold the ids of the rows left in the mask into state, one branch-free loop per aggregate */
+void aggregate_batch(Batch* batch, AggregateState* state) {
+  const uint32_t* ids = batch->ids;
+  const uint8_t* mask = batch->mask;
+  uint32_t n = batch->num_rows;
+
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < n; i++) count += mask[i];
+  uint64_t sum = 0;
+  for (uint32_t i = 0; i < n; i++) sum += mask[i] ? ids[i] : 0;
+  uint32_t min = state->min;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t value = mask[i] ? ids[i] : UINT32_MAX;
+    min = value < min ? value : min;
+  }
+  uint32_t max = state->max;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t value = mask[i] ? ids[i] : 0;
+    max = value > max ? value : max;
+  }
+
+  state->count += count;
+  state->sum += sum;
+  state->min = min;
+  state->max = max;
+}
+
+/* domain(email): everything after the last '@', or nothing if there is none */
+const char* email_domain(const char* email) {
+  const char* at = strrchr(email, '@');
+  return at ? at + 1 : "";
+}
+
+/*
+Sort operator for order by. With a limit that fits in the memory budget it
+keeps a bounded max-heap of the best rows (top-K). Otherwise it sorts runs
+of rows that fit in sort_memory, spills each run to pages of a temporary
+file, and streams the result out of a k-way merge of the runs. Rows are
+pulled out one at a time with sorter_next.
+*/
+#define SORT_RECORDS_PER_PAGE (PAGE_SIZE / sizeof(Row))
+#define SORT_PAGE_BYTES (SORT_RECORDS_PER_PAGE * sizeof(Row))
+
+typedef struct {
+  uint32_t first_page;
+  uint32_t num_records;
+} SortRun;
+
+typedef struct {
+  int file_descriptor;
+  Row* page;
+  uint32_t next_page;
+  uint32_t num_buffered;
+  SortRun run;
+} RunWriter;
+
+typedef struct {
+  int file_descriptor;
+  Row* page;
+  uint32_t loaded_page;  // page of the run currently in page, or INVALID_PAGE_NUM
+  SortRun run;
+  uint32_t num_read;
+} RunReader;
+
+/* k-way merge of sorted runs, one page of buffer per run */
+typedef struct {
+  SelectQuery* query;
+  RunReader* readers;
+  Row* pages;
+  uint32_t* heap;  // min-heap of reader indexes, ordered by each reader's current row
+  uint32_t heap_size;
+  bool advance;    // the row returned last is still at the top of the heap
+} RunMerger;
+
+typedef struct {
+  SelectQuery* query;
+  uint32_t memory_budget;
+  Row* records;
+  uint32_t num_records;
+  uint32_t capacity;
+  bool top_k;
+  FILE* spill_file;
+  uint32_t num_spill_pages;
+  SortRun* runs;
+  uint32_t num_runs;
+  uint32_t runs_capacity;
+  uint32_t next_record;  // next in-memory row to return once sorted
+  bool merging;          // rows come from merger instead of records
+  RunMerger merger;
+} Sorter;
+
+int compare_sort_rows(const Row* a, const Row* b, SelectQuery* query) {
+  int result = 0;
+  switch (query->order_column) {
+    case (COLUMN_ID):
+      result = (a->id > b->id) - (a->id < b->id);
+      break;
+    case (COLUMN_USERNAME):
+      result = strcmp(a->username, b->username);
+      break;
+    case (COLUMN_EMAIL):
+      result = strcmp(a->email, b->email);
+      break;
+  }
+  if (query->order_descending) {
+    result = -result;
+  }
+  if (result == 0) {
+    /* Ties keep id order, so every sort has a single deterministic result */
+    result = (a->id > b->id) - (a->id < b->id);
+  }
+  return result;
+}
+
+void swap_rows(Row* a, Row* b) {
+  Row temp = *a;
+  *a = *b;
+  *b = temp;
+}
+
+/* Max-heap by sort order: the row that sorts last sits at the root */
+void sort_heap_sift_down(Row* heap, uint32_t size, uint32_t index, SelectQuery* query) {
+  while (true) {
+    uint32_t largest = index;
+    uint32_t left = 2 * index + 1;
+    uint32_t right = left + 1;
+    if (left < size && compare_sort_rows(&heap[left], &heap[largest], query) > 0) {
+      largest = left;
+    }
+    if (right < size && compare_sort_rows(&heap[right], &heap[largest], query) > 0) {
+      largest = right;
+    }
+    if (largest == index) {
+      return;
+    }
+    swap_rows(&heap[index], &heap[largest]);
+    index = largest;
+  }
+}
+
+void sort_heap_sift_up(Row* heap, uint32_t index, SelectQuery* query) {
+  while (index > 0) {
+    uint32_t parent = (index - 1) / 2;
+    if (compare_sort_rows(&heap[index], &heap[parent], query) <= 0) {
+      return;
+    }
+    swap_rows(&heap[index], &heap[parent]);
+    index = parent;
+  }
+}
+
+void sort_rows(Row* rows, uint32_t num_rows, SelectQuery* query) {
+  for (uint32_t i = num_rows / 2; i > 0; i--) {
+    sort_heap_sift_down(rows, num_rows, i - 1, query);
+  }
+  for (uint32_t end = num_rows; end > 1; end--) {
+    swap_rows(&rows[0], &rows[end - 1]);
+    sort_heap_sift_down(rows, end - 1, 0, query);
+  }
+}
+
+void sort_page_write(int file_descriptor, uint32_t page_num, Row* page) {
+  ssize_t bytes_written = pwrite(file_descriptor, page, SORT_PAGE_BYTES,
+                                 (off_t)page_num * PAGE_SIZE);
+  if (bytes_written != (ssize_t)SORT_PAGE_BYTES) {
+    printf("Error writing sort run: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void run_writer_open(RunWriter* writer, Sorter* sorter, Row* page) {
+  writer->file_descriptor = fileno(sorter->spill_file);
+  writer->page = page;
+  writer->next_page = sorter->num_spill_pages;
+  writer->num_buffered = 0;
+  writer->run.first_page = sorter->num_spill_pages;
+  writer->run.num_records = 0;
+}
+
+void run_writer_add(RunWriter* writer, Row* row) {
+  writer->page[writer->num_buffered] = *row;
+  writer->num_buffered += 1;
+  writer->run.num_records += 1;
+  if (writer->num_buffered == SORT_RECORDS_PER_PAGE) {
+    sort_page_write(writer->file_descriptor, writer->next_page, writer->page);
+    writer->next_page += 1;
+    writer->num_buffered = 0;
+  }
+}
+
+void run_writer_close(RunWriter* writer, Sorter* sorter) {
+  if (writer->num_buffered > 0) {
+    sort_page_write(writer->file_descriptor, writer->next_page, writer->page);
+    writer->next_page += 1;
+  }
+  sorter->num_spill_pages = writer->next_page;
+
+  if (sorter->num_runs == sorter->runs_capacity) {
+    sorter->runs_capacity = sorter->runs_capacity ? sorter->runs_capacity * 2 : 8;
+    sorter->runs = memory_realloc_required(MEMORY_SORT, sorter->runs,
+                                           sorter->runs_capacity * sizeof(SortRun));
+  }
+  sorter->runs[sorter->num_runs] = writer->run;
+  sorter->num_runs += 1;
+}
+
+Row* run_reader_current(RunReader* reader) {
+  if (reader->num_read >= reader->run.num_records) {
+    return NULL;
+  }
+  uint32_t index_in_page = reader->num_read % SORT_RECORDS_PER_PAGE;
+  uint32_t page_num = reader->run.first_page + reader->num_read / SORT_RECORDS_PER_PAGE;
+  if (page_num != reader->loaded_page) {
+    ssize_t bytes_read = pread(reader->file_descriptor, reader->page, SORT_PAGE_BYTES,
+                               (off_t)page_num * PAGE_SIZE);
+    if (bytes_read == -1) {
+      printf("Error reading sort run: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    reader->loaded_page = page_num;
+  }
+  return &reader->page[index_in_page];
+}
+
+bool sorter_open(Sorter* sorter, SelectQuery* query, uint32_t memory_budget) {
+  uint32_t budget_records = memory_budget / sizeof(Row);
+  if (budget_records < 2) {
+    budget_records = 2;
+  }
+
+  sorter->query = query;
+  sorter->memory_budget = memory_budget;
+  sorter->num_records = 0;
+  sorter->top_k = query->has_limit && query->limit <= budget_records;
+  sorter->capacity = sorter->top_k ? query->limit : budget_records;
+  sorter->spill_file = NULL;
+  sorter->num_spill_pages = 0;
+  sorter->runs = NULL;
+  sorter->num_runs = 0;
+  sorter->runs_capacity = 0;
+  sorter->next_record = 0;
+  sorter->merging = false;
+  sorter->records =
+      memory_alloc(MEMORY_SORT, (sorter->capacity ? sorter->capacity : 1) * sizeof(Row));
+  if (sorter->records == NULL && memory_budget > 2 * PAGE_SIZE) {
+    /* Short of memory, sort in smaller runs rather than fail */
+    return sorter_open(sorter, query, 2 * PAGE_SIZE);
+  }
+  return sorter->records != NULL;
+}
+
+void run_merger_close(RunMerger* merger);
+
+void sorter_close(Sorter* sorter) {
+  if (sorter->merging) {
+    run_merger_close(&sorter->merger);
+  }
+  memory_free(sorter->records);
+  memory_free(sorter->runs);
+  if (sorter->spill_file) {
+    fclose(sorter->spill_file);
+  }
+}
+
+bool sorter_spill_run(Sorter* sorter) {
+  if (sorter->spill_file == NULL) {
+    sorter->spill_file = tmpfile();
+    if (sorter->spill_file == NULL) {
+      return false;
+    }
+  }
+  sort_rows(sorter->records, sorter->num_records, sorter->query);
+
+  Row page[SORT_RECORDS_PER_PAGE];
+  RunWriter writer;
+  run_writer_open(&writer, sorter, page);
+  for (uint32_t i = 0; i < sorter->num_records; i++) {
+    run_writer_add(&writer, &sorter->records[i]);
+  }
+  run_writer_close(&writer, sorter);
+  sorter->num_records = 0;
+  return true;
+}
+
+bool sorter_add(Sorter* sorter, Row* row) {
+  if (sorter->top_k) {
+    if (sorter->num_records < sorter->capacity) {
+      sorter->records[sorter->num_records] = *row;
+      sort_heap_sift_up(sorter->records, sorter->num_records, sorter->query);
+      sorter->num_records += 1;
+    } else if (sorter->capacity > 0 &&
+               compare_sort_rows(row, &sorter->records[0], sorter->query) < 0) {
+      sorter->records[0] = *row;
+      sort_heap_sift_down(sorter->records, sorter->num_records, 0, sorter->query);
+    }
+    return true;
+  }
+
+  if (sorter->num_records == sorter->capacity && !sorter_spill_run(sorter)) {
+    return false;
+  }
+  sorter->records[sorter->num_records] = *row;
+  sorter->num_records += 1;
+  return true;
+}
+
+void merge_heap_sift_down(RunReader* readers, uint32_t* heap, uint32_t size,
+                          uint32_t index, SelectQuery* query) {
+  while (true) {
+    uint32_t smallest = index;
+    uint32_t left = 2 * index + 1;
+    uint32_t right = left + 1;
+    if (left < size && compare_sort_rows(run_reader_current(&readers[heap[left]]),
+                                         run_reader_current(&readers[heap[smallest]]),
+                                         query) < 0) {
+      smallest = left;
+    }
+    if (right < size && compare_sort_rows(run_reader_current(&readers[heap[right]]),
+                                          run_reader_current(&readers[heap[smallest]]),
+                                          query) < 0) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      return;
+    }
+    uint32_t temp = heap[index];
+    heap[index] = heap[smallest];
+    heap[smallest] = temp;
+    index = smallest;
+  }
+}
+
+/* The merge buffers take the place of the records freed before merging */
+void run_merger_open(RunMerger* merger, Sorter* sorter, SortRun* runs, uint32_t num_runs) {
+  merger->query = sorter->query;
+  merger->readers = memory_alloc_required(MEMORY_SORT, num_runs * sizeof(RunReader));
+  merger->pages = memory_alloc_required(MEMORY_SORT, num_runs * SORT_PAGE_BYTES);
+  merger->heap = memory_alloc_required(MEMORY_SORT, num_runs * sizeof(uint32_t));
+  merger->heap_size = 0;
+  merger->advance = false;
+
+  for (uint32_t i = 0; i < num_runs; i++) {
+    RunReader* reader = &merger->readers[i];
+    reader->file_descriptor = fileno(sorter->spill_file);
+    reader->page = merger->pages + i * SORT_RECORDS_PER_PAGE;
+    reader->loaded_page = INVALID_PAGE_NUM;
+    reader->run = runs[i];
+    reader->num_read = 0;
+    if (runs[i].num_records > 0) {
+      merger->heap[merger->heap_size++] = i;
+    }
+  }
+  for (uint32_t i = merger->heap_size / 2; i > 0; i--) {
+    merge_heap_sift_down(merger->readers, merger->heap, merger->heap_size, i - 1,
+                         merger->query);
+  }
+}
+
+/* Next row in merged order, or NULL. The row stays valid until the next call. */
+Row* run_merger_next(RunMerger* merger) {
+  if (merger->advance && merger->heap_size > 0) {
+    RunReader* reader = &merger->readers[merger->heap[0]];
+    reader->num_read += 1;
+    if (run_reader_current(reader) == NULL) {
+      merger->heap[0] = merger->heap[merger->heap_size - 1];
+      merger->heap_size -= 1;
+    }
+    merge_heap_sift_down(merger->readers, merger->heap, merger->heap_size, 0,
+                         merger->query);
+  }
+  merger->advance = true;
+  if (merger->heap_size == 0) {
+    return NULL;
+  }
+  return run_reader_current(&merger->readers[merger->heap[0]]);
+}
+
+void run_merger_close(RunMerger* merger) {
+  memory_free(merger->heap);
+  memory_free(merger->pages);
+  memory_free(merger->readers);
+}
+
+/*
+Get ready to return every row in order. Spilled runs are merged in passes of
+at most fan_in runs so the merge buffers also stay within the memory budget;
+the last pass is merged as sorter_next asks for rows.
+*/
+bool sorter_finish(Sorter* sorter) {
+  sorter->next_record = 0;
+  if (sorter->num_runs == 0) {
+    sort_rows(sorter->records, sorter->num_records, sorter->query);
+    return true;
+  }
+
+  if (sorter->num_records > 0 && !sorter_spill_run(sorter)) {
+    return false;
+  }
+  memory_free(sorter->records);
+  sorter->records = NULL;
+
+  uint32_t fan_in = sorter->memory_budget / PAGE_SIZE;
+  if (fan_in > 1) {
+    fan_in -= 1;  // one page is kept for the output run of intermediate passes
+  }
+  if (fan_in < 2) {
+    fan_in = 2;
+  }
+
+  uint32_t first_run = 0;
+  while (sorter->num_runs - first_run > fan_in) {
+    uint32_t end_of_pass = sorter->num_runs;
+    for (uint32_t i = first_run; i < end_of_pass; i += fan_in) {
+      uint32_t group = end_of_pass - i < fan_in ? end_of_pass - i : fan_in;
+      Row page[SORT_RECORDS_PER_PAGE];
+      RunWriter writer;
+      RunMerger merger;
+      run_writer_open(&writer, sorter, page);
+      run_merger_open(&merger, sorter, &sorter->runs[i], group);
+      Row* row;
+      while ((row = run_merger_next(&merger)) != NULL) {
+        run_writer_add(&writer, row);
+      }
+      run_merger_close(&merger);
+      run_writer_close(&writer, sorter);
+    }
+    first_run = end_of_pass;
+  }
+
+  run_merger_open(&sorter->merger, sorter, &sorter->runs[first_run],
+                  sorter->num_runs - first_run);
+  sorter->merging = true;
+  return true;
+}
+
+/* Next row in sort order once sorter_finish has run, or NULL */
+Row* sorter_next(Sorter* sorter) {
+  if (sorter->merging) {
+    return run_merger_next(&sorter->merger);
+  }
+  if (sorter->next_record >= sorter->num_records) {
+    return NULL;
+  }
+  sorter->next_record += 1;
+  return &sorter->records[sorter->next_record - 1];
+}
+
+/*
+Hash aggregation for group by. Groups live in an open-addressing table
+(linear probing) keyed by the grouped expression, and one AggregateState per
+group serves every aggregate in the projection list. When a new group would
+push the table past its memory budget, the row goes to one of
+GROUP_PARTITIONS spill files picked by the next bits of its hash instead.
+After the scan each partition is aggregated on its own one level down, so
+every group is finished in exactly one table. With group_threads > 1 each
+worker aggregates into its own table and the tables are merged at the end.
+*/
+#define GROUP_PARTITION_BITS 3
+#define GROUP_PARTITIONS (1 << GROUP_PARTITION_BITS)
+#define GROUP_MAX_LEVEL (64 / GROUP_PARTITION_BITS - 1)
+#define GROUP_INITIAL_CAPACITY 64
+#define GROUP_INITIAL_KEY_BYTES 1024
+#define GROUP_EMPTY_SLOT UINT32_MAX
+#define GROUP_MAX_KEY_SIZE (COLUMN_EMAIL_SIZE + 1)
+
+typedef struct {
+  uint64_t hash;
+  uint32_t key_offset;
+  uint32_t key_length;  // GROUP_EMPTY_SLOT for a free slot
+  AggregateState state;
+} GroupSlot;
+
+/* Spilled partial group; key_length bytes of key follow it in the file */
+typedef struct {
+  uint64_t hash;
+  uint32_t key_length;
+  AggregateState state;
+} GroupSpillRecord;
+
+typedef struct {
+  uint32_t memory_budget;
+  uint32_t level;  // how many times these rows have been partitioned
+  GroupSlot* slots;
+  uint32_t capacity;  // always a power of two
+  uint32_t num_groups;
+  char* keys;
+  uint32_t keys_used;
+  uint32_t keys_capacity;
+  FILE* partitions[GROUP_PARTITIONS];
+  bool failed;
+} HashAggregate;
+
+uint64_t group_key_hash(const char* key, uint32_t length) {
+  /* FNV-1a, with the high half folded down into the bits used for slots */
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint32_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash ^ (hash >> 32);
+}
+
+/* capacity is the initial number of slots, a power of two */
+bool hash_aggregate_init(HashAggregate* aggregate, uint32_t memory_budget,
+                         uint32_t level, uint32_t capacity) {
+  aggregate->memory_budget = memory_budget;
+  aggregate->level = level;
+  aggregate->capacity = capacity;
+  aggregate->num_groups = 0;
+  aggregate->keys_used = 0;
+  aggregate->keys_capacity = GROUP_INITIAL_KEY_BYTES;
+  aggregate->failed = false;
+  for (uint32_t i = 0; i < GROUP_PARTITIONS; i++) {
+    aggregate->partitions[i] = NULL;
+  }
+  aggregate->slots = memory_alloc(MEMORY_GROUP, aggregate->capacity * sizeof(GroupSlot));
+  aggregate->keys = memory_alloc(MEMORY_GROUP, aggregate->keys_capacity);
+  if (aggregate->slots == NULL || aggregate->keys == NULL) {
+    memory_free(aggregate->slots);
+    memory_free(aggregate->keys);
+    aggregate->slots = NULL;
+    aggregate->keys = NULL;
+    return false;
+  }
+  for (uint32_t i = 0; i < aggregate->capacity; i++) {
+    aggregate->slots[i].key_length = GROUP_EMPTY_SLOT;
+  }
+  return true;
+}
+
+void hash_aggregate_free(HashAggregate* aggregate) {
+  memory_free(aggregate->slots);
+  memory_free(aggregate->keys);
+  for (uint32_t i = 0; i < GROUP_PARTITIONS; i++) {
+    if (aggregate->partitions[i]) {
+      fclose(aggregate->partitions[i]);
+    }
+  }
+}
+
+bool hash_aggregate_fits(HashAggregate* aggregate, size_t extra_bytes) {
+  if (aggregate->level >= GROUP_MAX_LEVEL) {
+    /* Out of hash bits to partition on, so keep growing */
+    return true;
+  }
+  size_t used = (size_t)aggregate->capacity * sizeof(GroupSlot) + aggregate->keys_capacity;
+  return used + extra_bytes <= aggregate->memory_budget;
+}
+
+/*
+Make room for one more group with a key_length byte key, doubling the slot
+array or the key arena as needed. False if that would exceed the budget.
+Keys are stored with a terminating NUL so text keys can be read in place.
+*/
+bool hash_aggregate_reserve(HashAggregate* aggregate, uint32_t key_length) {
+  uint32_t key_size = key_length + 1;
+  if (aggregate->keys_used + key_size > aggregate->keys_capacity) {
+    uint32_t keys_capacity = aggregate->keys_capacity * 2;
+    if (keys_capacity < aggregate->keys_used + key_size) {
+      keys_capacity = aggregate->keys_used + key_size;
+    }
+    if (!hash_aggregate_fits(aggregate, keys_capacity - aggregate->keys_capacity)) {
+      return false;
+    }
+    char* keys = memory_realloc(MEMORY_GROUP, aggregate->keys, keys_capacity);
+    if (keys == NULL) {
+      return false;
+    }
+    aggregate->keys = keys;
+    aggregate->keys_capacity = keys_capacity;
+  }
+
+  if ((aggregate->num_groups + 1) * 2 <= aggregate->capacity) {
+    return true;
+  }
+  uint32_t capacity = aggregate->capacity * 2;
+  if (!hash_aggregate_fits(aggregate, (size_t)aggregate->capacity * sizeof(GroupSlot))) {
+    return false;
+  }
+  GroupSlot* slots = memory_alloc(MEMORY_GROUP, capacity * sizeof(GroupSlot));
+  if (slots == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < capacity; i++) {
+    slots[i].key_length = GROUP_EMPTY_SLOT;
+  }
+  for (uint32_t i = 0; i < aggregate->capacity; i++) {
+    GroupSlot* slot = &aggregate->slots[i];
+    if (slot->key_length == GROUP_EMPTY_SLOT) {
+      continue;
+    }
+    uint32_t index = (uint32_t)slot->hash & (capacity - 1);
+    while (slots[index].key_length != GROUP_EMPTY_SLOT) {
+      index = (index + 1) & (capacity - 1);
+    }
+    slots[index] = *slot;
+  }
+  memory_free(aggregate->slots);
+  aggregate->slots = slots;
+  aggregate->capacity = capacity;
+  return true;
+}
+
+void hash_aggregate_spill(HashAggregate* aggregate, uint64_t hash, const char* key,
+                          uint32_t key_length, const AggregateState* state) {
+  uint32_t shift = 64 - GROUP_PARTITION_BITS * (aggregate->level + 1);
+  uint32_t partition = (hash >> shift) & (GROUP_PARTITIONS - 1);
+  if (aggregate->partitions[partition] == NULL) {
+    aggregate->partitions[partition] = tmpfile();
+    if (aggregate->partitions[partition] == NULL) {
+      aggregate->failed = true;
+      return;
+    }
+  }
+
+  GroupSpillRecord record;
+  record.hash = hash;
+  record.key_length = key_length;
+  record.state = *state;
+  FILE* file = aggregate->partitions[partition];
+  if (fwrite(&record, sizeof(record), 1, file) != 1 ||
+      fwrite(key, 1, key_length, file) != key_length) {
+    aggregate->failed = true;
+  }
+}
+
+/* Fold state into the group for key, creating or spilling the group if it is new */
+void hash_aggregate_add(HashAggregate* aggregate, uint64_t hash, const char* key,
+                        uint32_t key_length, const AggregateState* state) {
+  uint32_t mask = aggregate->capacity - 1;
+  uint32_t index = (uint32_t)hash & mask;
+  while (aggregate->slots[index].key_length != GROUP_EMPTY_SLOT) {
+    GroupSlot* slot = &aggregate->slots[index];
+    if (slot->hash == hash && slot->key_length == key_length &&
+        memcmp(aggregate->keys + slot->key_offset, key, key_length) == 0) {
+      aggregate_merge(&slot->state, state);
+      return;
+    }
+    index = (index + 1) & mask;
+  }
+
+  if (!hash_aggregate_reserve(aggregate, key_length)) {
+    hash_aggregate_spill(aggregate, hash, key, key_length, state);
+    return;
+  }
+  if (mask != aggregate->capacity - 1) {
+    /* The table grew, so find the new group's slot again */
+    mask = aggregate->capacity - 1;
+    index = (uint32_t)hash & mask;
+    while (aggregate->slots[index].key_length != GROUP_EMPTY_SLOT) {
+      index = (index + 1) & mask;
+    }
+  }
+
+  GroupSlot* slot = &aggregate->slots[index];
+  slot->hash = hash;
+  slot->key_offset = aggregate->keys_used;
+  slot->key_length = key_length;
+  slot->state = *state;
+  memcpy(aggregate->keys + aggregate->keys_used, key, key_length);
+  aggregate->keys[aggregate->keys_used + key_length] = '\0';
+  aggregate->keys_used += key_length + 1;
+  aggregate->num_groups += 1;
+}
+
+/*
+Aggregate views keep the count, sum, min and max of id for every value of a
+grouped expression in an index B+tree of their own. Each group is one entry
+whose value is the group key, a NUL and the AggregateState, so the key alone
+finds it with a seek and the state is updated in place; the NUL keeps the
+state bytes out of the ordering between keys. Groups whose rows are all
+deleted keep an entry with a zero count.
+*/
+#define VIEW_MAX_ENTRY_SIZE (COLUMN_EMAIL_SIZE + 1 + sizeof(AggregateState))
+
+/* The view's grouped expression for a row given in the leaf cell value format */
+const char* aggregate_view_key(AggregateView* view, char* value, uint32_t* length) {
+  const char* key = value + (view->column == COLUMN_USERNAME ? USERNAME_OFFSET : EMAIL_OFFSET);
+  if (view->function == FUNCTION_DOMAIN) {
+    key = email_domain(key);
+  }
+  *length = strlen(key);
+  return key;
+}
+
+/* Point cursor at the entry of the group for key; false if the group has none */
+bool aggregate_view_seek(Table* table, AggregateView* view, IndexCursor* cursor,
+                         const char* key, uint32_t key_length) {
+  char probe[COLUMN_EMAIL_SIZE + 1];
+  memcpy(probe, key, key_length);
+  probe[key_length] = '\0';
+  IndexKey index_key = {probe, key_length + 1, 0};
+  if (!index_cursor_seek(table, cursor, view->root_page_num, &index_key)) {
+    return false;
+  }
+  char* entry = index_cursor_entry(cursor);
+  return index_entry_length(entry) == key_length + 1 + sizeof(AggregateState) &&
+         memcmp(index_entry_value(entry), probe, key_length + 1) == 0;
+}
+
+AggregateState* aggregate_view_state(char* entry, uint32_t key_length) {
+  return (AggregateState*)(index_entry_value(entry) + key_length + 1);
+}
+
+/* Min and max of the group's remaining rows, after its min or max was deleted */
+void aggregate_view_rescan(Table* table, AggregateView* view, const char* key,
+                           uint32_t key_length, AggregateState* state) {
+  state->min = UINT32_MAX;
+  state->max = 0;
+  Cursor* cursor = table_start(table);
+  while (!cursor->end_of_table) {
+    char* value = cursor_value(cursor);
+    uint32_t length;
+    const char* row_key = aggregate_view_key(view, value, &length);
+    if (length == key_length && memcmp(row_key, key, key_length) == 0) {
+      uint32_t id;
+      memcpy(&id, value + ID_OFFSET, ID_SIZE);
+      state->min = id < state->min ? id : state->min;
+      state->max = id > state->max ? id : state->max;
+    }
+    cursor_advance(cursor);
+  }
+  cursor_release(cursor);
+}
+
+/*
+Fold a row into or out of its group. Count and sum change in place; a
+delete only rescans the table when it removes the group's min or max.
+*/
+void aggregate_view_fold(Table* table, AggregateView* view, uint32_t id, char* value,
+                         bool insert) {
+  uint32_t key_length;
+  const char* key = aggregate_view_key(view, value, &key_length);
+  IndexCursor cursor = {NULL, NULL, 0, 0};
+  AggregateState state;
+  aggregate_init(&state);
+  bool found = aggregate_view_seek(table, view, &cursor, key, key_length);
+  if (found) {
+    memcpy(&state, aggregate_view_state(index_cursor_entry(&cursor), key_length),
+           sizeof(state));
+  }
+  index_cursor_release(table, &cursor);
+  if (!found && !insert) {
+    return;
+  }
+
+  if (insert) {
+    AggregateState row = {1, id, id, id};
+    aggregate_merge(&state, &row);
+  } else {
+    state.count -= 1;
+    state.sum -= id;
+    if (state.count == 0) {
+      aggregate_init(&state);
+    } else if (id == state.min || id == state.max) {
+      aggregate_view_rescan(table, view, key, key_length, &state);
+    }
+  }
+
+  if (found && aggregate_view_seek(table, view, &cursor, key, key_length)) {
+    memcpy(aggregate_view_state(index_cursor_entry(&cursor), key_length), &state,
+           sizeof(state));
+    index_cursor_release(table, &cursor);
+    return;
+  }
+  index_cursor_release(table, &cursor);
+  char entry_value[VIEW_MAX_ENTRY_SIZE];
+  memcpy(entry_value, key, key_length);
+  entry_value[key_length] = '\0';
+  memcpy(entry_value + key_length + 1, &state, sizeof(state));
+  IndexKey index_key = {entry_value, key_length + 1 + sizeof(state), 0};
+  index_insert(table, &view->root_page_num, &index_key);
+}
+
+/*
+Fold the view's groups into a group by hash table, or into one aggregate
+state when there is no group by, instead of scanning the table. With key
+set only that group is read, with a single seek.
+*/
+void aggregate_view_read(Table* table, AggregateView* view, const char* key,
+                         HashAggregate* groups, AggregateState* aggregate) {
+  IndexCursor cursor = {NULL, NULL, 0, 0};
+  bool on_entry;
+  if (key) {
+    on_entry = aggregate_view_seek(table, view, &cursor, key, strlen(key));
+  } else {
+    IndexKey first = {"", 0, 0};
+    on_entry = index_cursor_seek(table, &cursor, view->root_page_num, &first);
+  }
+  while (on_entry) {
+    char* entry = index_cursor_entry(&cursor);
+    uint32_t key_length = strlen(index_entry_value(entry));
+    AggregateState state;
+    memcpy(&state, aggregate_view_state(entry, key_length), sizeof(state));
+    if (state.count > 0) {
+      if (groups) {
+        hash_aggregate_add(groups, group_key_hash(index_entry_value(entry), key_length),
+                           index_entry_value(entry), key_length, &state);
+      } else {
+        aggregate_merge(aggregate, &state);
+      }
+    }
+    on_entry = !key && index_cursor_advance(table, &cursor);
+  }
+  index_cursor_release(table, &cursor);
+}
+
+ExecuteResult execute_create_view(Statement* statement, Table* table) {
+  for (uint32_t i = 0; i < table->num_views; i++) {
+    if (table->views[i].column == statement->index_column &&
+        table->views[i].function == statement->view_function) {
+      return EXECUTE_VIEW_EXISTS;
+    }
+  }
+  if (table->num_views == MAX_AGGREGATE_VIEWS) {
+    return EXECUTE_FAIL;
+  }
+  AggregateView* view = &table->views[table->num_views++];
+  view->column = statement->index_column;
+  view->function = statement->view_function;
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+  view->root_page_num = get_unused_page_num(table->pager);
+  initialize_index_node(get_page(table->pager, view->root_page_num, tracker), NODE_LEAF);
+  unpin_all_pages(table->pager, tracker);
+  table_save_catalog(table);
+
+  Cursor* cursor = table_start(table);
+  char value[ROW_VALUE_SIZE];
+  while (!cursor->end_of_table) {
+    memcpy(value, cursor_value(cursor), ROW_VALUE_SIZE);
+    uint32_t id;
+    memcpy(&id, value + ID_OFFSET, ID_SIZE);
+    aggregate_view_fold(table, view, id, value, true);
+    cursor_advance(cursor);
+  }
+  cursor_release(cursor);
+  return EXECUTE_SUCCESS;
+}
+
+/* The grouped expression of a batch row, as the bytes it is hashed and compared by */
+const char* group_key(Batch* batch, uint32_t row, SelectQuery* query,
+                      uint32_t* key_length) {
+  const char* key;
+  switch (query->group_column) {
+    case (COLUMN_ID):
+      *key_length = sizeof(uint32_t);
+      return (const char*)&batch->ids[row];
+    case (COLUMN_USERNAME):
+      key = batch->usernames[row];
+      break;
+    default:
+      key = batch->emails[row];
+      if (query->group_function == FUNCTION_DOMAIN) {
+        key = email_domain(key);
+      }
+      break;
+  }
+  *key_length = strlen(key);
+  return key;
+}
+
+void hash_aggregate_batch(HashAggregate* aggregate, Batch* batch, SelectQuery* query) {
+  for (uint32_t i = 0; i < batch->num_selected; i++) {
+    uint32_t row = batch->selection[i];
+    uint32_t key_length;
+    const char* key = group_key(batch, row, query, &key_length);
+
+    AggregateState state;
+    state.count = 1;
+    state.sum = batch->ids[row];
+    state.min = batch->ids[row];
+    state.max = batch->ids[row];
+    hash_aggregate_add(aggregate, group_key_hash(key, key_length), key, key_length,
+                       &state);
+  }
+}
+
+/*
+Walks the finished groups: first the groups held in memory, then, depth
+first, the groups of each spill partition once it has been aggregated one
+level down. Only one table per level is alive at a time.
+*/
+typedef struct {
+  HashAggregate* table;
+  uint32_t next_slot;
+  uint32_t next_partition;
+} GroupLevel;
+
+typedef struct {
+  HashAggregate* sources;  // one table per worker; level 0 walks sources[0]
+  uint32_t num_sources;
+  GroupLevel levels[GROUP_MAX_LEVEL + 1];
+  HashAggregate partitions[GROUP_MAX_LEVEL + 1];  // the table behind levels[d], d > 0
+  uint32_t depth;
+  bool failed;
+} GroupIterator;
+
+/* Merge sources[1..num_sources) into sources[0] and start at its first group */
+void group_iterator_open(GroupIterator* iterator, HashAggregate* sources,
+                         uint32_t num_sources) {
+  HashAggregate* result = &sources[0];
+  for (uint32_t t = 1; t < num_sources; t++) {
+    for (uint32_t i = 0; i < sources[t].capacity; i++) {
+      GroupSlot* slot = &sources[t].slots[i];
+      if (slot->key_length != GROUP_EMPTY_SLOT) {
+        hash_aggregate_add(result, slot->hash, sources[t].keys + slot->key_offset,
+                           slot->key_length, &slot->state);
+      }
+    }
+  }
+
+  iterator->sources = sources;
+  iterator->num_sources = num_sources;
+  iterator->failed = false;
+  for (uint32_t t = 0; t < num_sources; t++) {
+    iterator->failed |= sources[t].failed;
+  }
+  iterator->levels[0].table = result;
+  iterator->levels[0].next_slot = 0;
+  iterator->levels[0].next_partition = 0;
+  iterator->depth = 1;
+}
+
+/* Aggregate spill partition p of the table at depth - 1 into a new level */
+bool group_iterator_push(GroupIterator* iterator, uint32_t p) {
+  GroupLevel* parent = &iterator->levels[iterator->depth - 1];
+  HashAggregate* sources = parent->table;
+  uint32_t num_sources = 1;
+  if (iterator->depth == 1) {
+    /* Every worker spills the same way, so their partitions combine */
+    sources = iterator->sources;
+    num_sources = iterator->num_sources;
+  }
+
+  HashAggregate* partition = &iterator->partitions[iterator->depth];
+  bool initialized = false;
+  for (uint32_t t = 0; t < num_sources; t++) {
+    FILE* file = sources[t].partitions[p];
+    if (file == NULL) {
+      continue;
+    }
+    if (!initialized) {
+      if (!hash_aggregate_init(partition, parent->table->memory_budget,
+                               parent->table->level + 1, GROUP_INITIAL_CAPACITY)) {
+        iterator->failed = true;
+        return false;
+      }
+      initialized = true;
+    }
+    rewind(file);
+    GroupSpillRecord record;
+    char key[GROUP_MAX_KEY_SIZE];
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+      if (record.key_length > GROUP_MAX_KEY_SIZE ||
+          fread(key, 1, record.key_length, file) != record.key_length) {
+        partition->failed = true;
+        break;
+      }
+      hash_aggregate_add(partition, record.hash, key, record.key_length, &record.state);
+    }
+  }
+  if (!initialized) {
+    return false;
+  }
+
+  GroupLevel* level = &iterator->levels[iterator->depth];
+  level->table = partition;
+  level->next_slot = 0;
+  level->next_partition = 0;
+  iterator->depth += 1;
+  iterator->failed |= partition->failed;
+  return true;
+}
+
+/* Next finished group, or NULL; *table is set to the table that holds its key */
+GroupSlot* group_iterator_next(GroupIterator* iterator, HashAggregate** table) {
+  while (iterator->depth > 0 && !iterator->failed) {
+    GroupLevel* level = &iterator->levels[iterator->depth - 1];
+    while (level->next_slot < level->table->capacity) {
+      GroupSlot* slot = &level->table->slots[level->next_slot];
+      level->next_slot += 1;
+      if (slot->key_length != GROUP_EMPTY_SLOT) {
+        *table = level->table;
+        return slot;
+      }
+    }
+
+    bool pushed = false;
+    while (!pushed && level->next_partition < GROUP_PARTITIONS) {
+      level->next_partition += 1;
+      pushed = group_iterator_push(iterator, level->next_partition - 1);
+    }
+    if (!pushed) {
+      if (iterator->depth > 1) {
+        hash_aggregate_free(level->table);
+      }
+      iterator->depth -= 1;
+    }
+  }
+  return NULL;
+}
+
+void group_iterator_close(GroupIterator* iterator) {
+  for (uint32_t d = iterator->depth; d > 1; d--) {
+    hash_aggregate_free(iterator->levels[d - 1].table);
+  }
+  iterator->depth = 0;
+}
+
+typedef struct {
+  BatchScan* scan;
+  pthread_mutex_t* scan_lock;
+  SelectQuery* query;
+  Batch* batch;
+  HashAggregate* aggregate;
+} GroupWorker;
+
+/*
+Workers take turns pulling batches off the shared scan (the pager is not
+thread safe), then filter and aggregate them into their own table in parallel.
+*/
+void* group_worker_run(void* argument) {
+  GroupWorker* worker = argument;
+  while (!worker->aggregate->failed) {
+    pthread_mutex_lock(worker->scan_lock);
+    bool has_rows = batch_scan_next(worker->scan, worker->batch);
+    pthread_mutex_unlock(worker->scan_lock);
+    if (!has_rows) {
+      break;
+    }
+    batch_filter(worker->batch, worker->query);
+    batch_select(worker->batch);
+    hash_aggregate_batch(worker->aggregate, worker->batch, worker->query);
+  }
+  return NULL;
+}
+
+Batch* table_scratch_batch(Table* table) {
+  if (table->batch == NULL) {
+    table->batch = memory_alloc(MEMORY_GROUP, sizeof(Batch));
+  }
+  return table->batch;
+}
+
+/*
+Scan, filter and group the whole table with one worker per table in
+aggregates, each aggregating into its own table. False if not even one
+worker could get a batch.
+*/
+bool group_parallel_aggregate(Table* table, SelectQuery* query,
+                              HashAggregate* aggregates, uint32_t num_workers) {
+  GroupWorker workers[MAX_GROUP_THREADS];
+  pthread_t threads[MAX_GROUP_THREADS];
+  bool started[MAX_GROUP_THREADS];
+  pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  BatchScan scan;
+  batch_scan_open(&scan, table, select_query_columns(query) | COLUMN_BIT(COLUMN_ID));
+
+  uint32_t num_ready = 0;
+  for (; num_ready < num_workers; num_ready++) {
+    Batch* batch = num_ready == 0 ? table_scratch_batch(table)
+                                  : memory_alloc(MEMORY_GROUP, sizeof(Batch));
+    if (batch == NULL) {
+      break;
+    }
+    workers[num_ready].scan = &scan;
+    workers[num_ready].scan_lock = &scan_lock;
+    workers[num_ready].query = query;
+    workers[num_ready].batch = batch;
+    workers[num_ready].aggregate = &aggregates[num_ready];
+  }
+
+  /* Workers that could not get a batch leave their tables empty */
+  if (num_ready > 0) {
+    for (uint32_t i = 1; i < num_ready; i++) {
+      started[i] = pthread_create(&threads[i], NULL, group_worker_run, &workers[i]) == 0;
+    }
+    group_worker_run(&workers[0]);
+    for (uint32_t i = 1; i < num_ready; i++) {
+      if (started[i]) {
+        pthread_join(threads[i], NULL);
+      }
+    }
+  }
+
+  for (uint32_t i = 1; i < num_ready; i++) {
+    memory_free(workers[i].batch);
+  }
+  return num_ready > 0;
+}
+
+ExecuteResult table_delete(Table* table, uint32_t key_to_delete) {
+
+  /*
+  Most deletes are for ids that are already gone; the filter answers those.
+  A delete never pays for a rebuild, which would read every leaf.
+  */
+  if (!key_filter_may_contain(table, key_to_delete, false) ||
+      (table->hash_index && !hash_index_find(table, key_to_delete, NULL))) {
+    return EXECUTE_KEY_NOT_FOUND;
+  }
+
+  PinnedPages* tracker = init_pinned_pages(table->pager);
+
+  Cursor* cursor = table_find(table, key_to_delete);
+  char* node = get_page(table->pager, cursor->page_num, tracker);
+
+  uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+
+  if (key_at_index != key_to_delete) {
+    unpin_all_pages(table->pager, tracker);
+    return EXECUTE_KEY_NOT_FOUND;
+  }
+  /* Keep the row's values for the indexes; the cell is gone after the delete */
+  char value[ROW_VALUE_SIZE];
+  memcpy(value, leaf_node_value(node, cursor->cell_num), ROW_VALUE_SIZE);
+  leaf_node_delete(cursor, key_to_delete);
+
+  unpin_all_pages(table->pager, tracker);
+
+  table_index_row(table, key_to_delete, value, false);
+  row_cache_invalidate(&table->row_cache, key_to_delete);
+  table->key_filter.num_deleted += 1;
+  if (table->hash_index) {
+    hash_index_delete(table, key_to_delete);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+/*
+Register a prepared statement, replacing any earlier one with the same name.
+*/
+ExecuteResult execute_prepare(Statement* statement, Table* table) {
+  PreparedStatement* prepared = find_prepared_statement(
+      table, statement->to_prepare.name, strlen(statement->to_prepare.name));
+
+  if (prepared == NULL) {
+    if (table->num_prepared_statements >= MAX_PREPARED_STATEMENTS) {
+      return EXECUTE_TOO_MANY_PREPARED_STATEMENTS;
+    }
+    prepared = &table->prepared_statements[table->num_prepared_statements];
+    table->num_prepared_statements += 1;
+  }
+  *prepared = statement->to_prepare;
+
+  return EXECUTE_SUCCESS;
+}
+
+/*
+Run a prepared statement with its currently bound values. Inserts hand the
+bound row buffer straight to the tree without re-parsing or re-serializing.
+*/
+ExecuteResult execute_prepared(PreparedStatement* prepared, Table* table) {
+  uint32_t key;
+
+  switch (prepared->type) {
+    case (STATEMENT_INSERT):
+      memcpy(&key, prepared->row_value + ID_OFFSET, ID_SIZE);
+      return table_insert(table, key, prepared->row_value);
+    case (STATEMENT_DELETE):
+      return table_delete(table, prepared->delete_id);
+    default:
+      return EXECUTE_FAIL;
+  }
+}
+
+uint32_t first_leaf_page(Table* table) {
+  Cursor* cursor = table_start(table);
+  uint32_t page_num = cursor->page_num;
+  return page_num;
+}
+
+int compare_hashes(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/*
+Estimate how many distinct values a column has from the hashes of a sample
+of n of its num_rows values, with the GEE estimator: values seen once in
+the sample are scaled up by sqrt(num_rows / n), values seen more than once
+are counted once.
+*/
+double estimate_distinct(uint64_t* hashes, uint32_t n, uint32_t num_rows) {
+  if (n == 0) {
+    return 0;
+  }
+  qsort(hashes, n, sizeof(uint64_t), compare_hashes);
+  uint32_t distinct = 0;
+  uint32_t singletons = 0;
+  for (uint32_t i = 0; i < n;) {
+    uint32_t run = 1;
+    while (i + run < n && hashes[i + run] == hashes[i]) {
+      run += 1;
+    }
+    distinct += 1;
+    singletons += run == 1;
+    i += run;
+  }
+  double estimate = sqrt((double)num_rows / n) * singletons + (distinct - singletons);
+  return estimate > num_rows ? num_rows : estimate;
+}
+
+/*
+Walk every leaf for the row count, key range and an equi-depth histogram of
+ids, then decode an evenly spaced sample of at most ANALYZE_SAMPLE_LEAVES
+leaves to estimate how many distinct values the other columns have.
+False if memory runs out.
+*/
+bool table_analyze(Table* table) {
+  TableStats* stats = &table->stats;
+  Pager* pager = table->pager;
+  uint32_t first_page = first_leaf_page(table);
+
+  uint32_t* keys = NULL;
+  uint32_t num_keys = 0;
+  uint32_t keys_capacity = 0;
+  uint32_t num_leaves = 0;
+  for (uint32_t page_num = first_page;; num_leaves++) {
+    PinnedPages* tracker = init_pinned_pages(pager);
+    char* node = get_page(pager, page_num, tracker);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_keys + num_cells > keys_capacity) {
+      uint32_t* grown = memory_realloc(MEMORY_SCRATCH, keys,
+                                       (num_keys + num_cells) * 2 * sizeof(uint32_t));
+      if (grown == NULL) {
+        unpin_all_pages(pager, tracker);
+        memory_free(keys);
+        return false;
+      }
+      keys = grown;
+      keys_capacity = (num_keys + num_cells) * 2;
+    }
+    for (uint32_t i = 0; i < num_cells; i++) {
+      keys[num_keys++] = *leaf_node_key(node, i);
+    }
+    page_num = *leaf_node_next_leaf(node);
+    unpin_all_pages(pager, tracker);
+    if (page_num == 0) {
+      num_leaves += 1;
+      break;
+    }
+  }
+
+  /* Sorted here rather than trusted to come out of the leaf chain in order */
+  qsort(keys, num_keys, sizeof(uint32_t), compare_ids);
+  stats->num_rows = num_keys;
+  stats->num_leaves = num_leaves;
+  stats->min_key = num_keys ? keys[0] : 0;
+  stats->max_key = num_keys ? keys[num_keys - 1] : 0;
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    uint64_t rank = (uint64_t)(i + 1) * num_keys / HISTOGRAM_BUCKETS;
+    stats->histogram[i] = num_keys ? keys[rank ? rank - 1 : 0] : 0;
+  }
+  memory_free(keys);
+
+  uint32_t step = (num_leaves + ANALYZE_SAMPLE_LEAVES - 1) / ANALYZE_SAMPLE_LEAVES;
+  uint32_t sample_capacity = ANALYZE_SAMPLE_LEAVES * LEAF_NODE_MAX_CELLS;
+  uint64_t* usernames = memory_alloc(MEMORY_SCRATCH, sample_capacity * sizeof(uint64_t));
+  uint64_t* emails = memory_alloc(MEMORY_SCRATCH, sample_capacity * sizeof(uint64_t));
+  uint64_t* domains = memory_alloc(MEMORY_SCRATCH, sample_capacity * sizeof(uint64_t));
+  if (usernames == NULL || emails == NULL || domains == NULL) {
+    /* The row counts and histogram are still good; only the distinct estimates are stale */
+    memory_free(usernames);
+    memory_free(emails);
+    memory_free(domains);
+    return false;
+  }
+  uint32_t sampled = 0;
+  uint32_t page_num = first_page;
+  for (uint32_t leaf = 0; leaf < num_leaves; leaf++) {
+    PinnedPages* tracker = init_pinned_pages(pager);
+    char* node = get_page(pager, page_num, tracker);
+    if (leaf % step == 0) {
+      uint32_t num_cells = *leaf_node_num_cells(node);
+      for (uint32_t i = 0; i < num_cells && sampled < sample_capacity; i++) {
+        char* value = leaf_node_value(node, i);
+        char* username = value + USERNAME_OFFSET;
+        char* email = value + EMAIL_OFFSET;
+        const char* domain = email_domain(email);
+        usernames[sampled] = group_key_hash(username, strlen(username));
+        emails[sampled] = group_key_hash(email, strlen(email));
+        domains[sampled] = group_key_hash(domain, strlen(domain));
+        sampled += 1;
+      }
+    }
+    page_num = *leaf_node_next_leaf(node);
+    unpin_all_pages(pager, tracker);
+  }
+
+  stats->distinct_usernames = estimate_distinct(usernames, sampled, num_keys);
+  stats->distinct_emails = estimate_distinct(emails, sampled, num_keys);
+  stats->distinct_domains = estimate_distinct(domains, sampled, num_keys);
+  stats->valid = true;
+  memory_free(usernames);
+  memory_free(emails);
+  memory_free(domains);
+  return true;
+}
+
+void print_stats(TableStats* stats) {
+  printf("rows: %u, leaves: %u, id: %u .. %u\n", stats->num_rows, stats->num_leaves,
+         stats->min_key, stats->max_key);
+  printf("distinct: username ~%.0f, email ~%.0f, domain ~%.0f\n",
+         stats->distinct_usernames, stats->distinct_emails, stats->distinct_domains);
+}
+
+/* Estimated fraction of rows with an id below key, from the histogram */
+double stats_fraction_below(TableStats* stats, uint64_t key) {
+  if (stats->num_rows == 0 || key <= stats->min_key) {
+    return 0;
+  }
+  if (key > stats->max_key) {
+    return 1;
+  }
+  uint32_t bucket = 0;
+  while (stats->histogram[bucket] < key) {
+    bucket += 1;
+  }
+  uint64_t low = bucket == 0 ? stats->min_key : (uint64_t)stats->histogram[bucket - 1] + 1;
+  uint64_t high = stats->histogram[bucket];
+  double within = high > low ? (double)(key - low) / (high - low + 1) : 0;
+  return (bucket + within) / HISTOGRAM_BUCKETS;
+}
+
+typedef enum {
+  ACCESS_FULL_SCAN,
+  ACCESS_ID_SEEK,
+  ACCESS_INDEX_SEEK,
+  ACCESS_HASH_PROBE,
+  ACCESS_ID_PROBE,
+  ACCESS_TRIGRAM_SCAN,
+  ACCESS_MULTI_GET,
+  ACCESS_VIEW,
+  ACCESS_SKETCH,
+  ACCESS_SAMPLE
+} AccessPath;
+
+/*
+How a statement will run. Choices that change the compiled program
+(access path, view, sample method and worker count) are part of its cache key.
+*/
+typedef struct {
+  AccessPath access_path;
+  int32_t seek_predicate;   // predicate the id or index seek starts from, or -1
+  uint32_t num_workers;     // group by threads; 1 unless the statement groups
+  uint32_t group_capacity;  // initial slots of each group by hash table
+  bool has_estimates;       // the row estimates below come from .analyze
+  double scanned_rows;      // rows the access path reads
+  double result_rows;       // rows left after every predicate
+  bool index_only;          // an index seek whose entries hold every column read
+  int32_t view;             // aggregate view that answers the query, or -1
+  bool sample_scan;         // sample with a reservoir over a full scan, not descents
+} QueryPlan;
+
+#define PARALLEL_ROWS_PER_WORKER 1024
+
+/*
+Plans are costed in rows read by a scan. Every match of an index seek
+takes an index step and a descent of the table for the rest of its row,
+which measures at about INDEX_LOOKUP_COST scanned rows; an index-only seek
+skips the descent and costs about one.
+*/
+#define INDEX_LOOKUP_COST 4.0
+
+/* Selectivity of one predicate; id bounds are accounted for by the scanned range */
+double predicate_selectivity(Predicate* predicate, TableStats* stats) {
+  double distinct = predicate->column == COLUMN_USERNAME ? stats->distinct_usernames
+                                                         : stats->distinct_emails;
+  if (predicate->column == COLUMN_ID) {
+    return predicate->op == COMPARE_NOT_EQUAL && stats->num_rows
+               ? 1.0 - 1.0 / stats->num_rows
+               : 1.0;
+  }
+  if (distinct < 1) {
+    distinct = 1;
+  }
+  switch (predicate->op) {
+    case (COMPARE_EQUAL):
+      return 1.0 / distinct;
+    case (COMPARE_NOT_EQUAL):
+      return 1.0 - 1.0 / distinct;
+    case (COMPARE_IN):
+      return 1.0;  // already accounted for by the id range
+    default:
+      return 1.0 / 3;
+  }
+}
+
+/*
+Root of the index a text predicate can seek in, 0 if there is none. Prefixes
+are a range of the plain index, suffixes a range of the reverse one and
+substrings an intersection of trigram posting lists.
+*/
+uint32_t index_root_for(Table* table, Column column, CompareOp op) {
+  if (column == COLUMN_ID) {
+    return 0;
+  }
+  switch (op) {
+    case (COMPARE_EQUAL):
+    case (COMPARE_PREFIX):
+      return table->index_roots[column];
+    case (COMPARE_SUFFIX):
+      return table->reverse_index_roots[column];
+    case (COMPARE_CONTAINS):
+      return table->trigram_index_roots[column];
+    default:
+      return 0;
+  }
+}
+
+/*
+The aggregate view that holds every aggregate of the query, or -1. Views
+answer queries grouped by their expression, or without group by, either
+over every row or restricted to one value of a plain column.
+*/
+int32_t aggregate_view_for(Table* table, SelectQuery* query) {
+  if (!query->has_aggregates || query->has_order_by || query->num_predicates > 1) {
+    return -1;
+  }
+  Column column = query->group_column;
+  ColumnFunction function = query->group_function;
+  if (query->num_predicates == 1) {
+    Predicate* predicate = &query->predicates[0];
+    if (predicate->op != COMPARE_EQUAL || predicate->column == COLUMN_ID ||
+        (query->has_group_by &&
+         (predicate->column != column || function != FUNCTION_NONE))) {
+      return -1;
+    }
+    column = predicate->column;
+    function = FUNCTION_NONE;
+  } else if (!query->has_group_by) {
+    return table->num_views > 0 ? 0 : -1;
+  }
+  for (uint32_t i = 0; i < table->num_views; i++) {
+    if (table->views[i].column == column && table->views[i].function == function) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void plan_statement(Statement* statement, Table* table, QueryPlan* plan) {
+  TableStats* stats = &table->stats;
+  plan->access_path = ACCESS_FULL_SCAN;
+  plan->seek_predicate = -1;
+  plan->num_workers = 1;
+  plan->group_capacity = GROUP_INITIAL_CAPACITY;
+  plan->has_estimates = stats->valid;
+  plan->scanned_rows = stats->num_rows;
+  plan->result_rows = stats->num_rows;
+  plan->index_only = false;
+  plan->view = -1;
+  plan->sample_scan = false;
+  if (statement->type != STATEMENT_SELECT) {
+    plan->access_path = ACCESS_ID_SEEK;
+    plan->scanned_rows = 1;
+    plan->result_rows = 1;
+    return;
+  }
+  SelectQuery* query = &statement->select;
+
+  /* The id range every predicate on id allows */
+  uint64_t low = 0;
+  uint64_t high = UINT32_MAX;
+  bool empty = false;
+  for (uint32_t i = 0; i < query->num_predicates; i++) {
+    Predicate* predicate = &query->predicates[i];
+    if (predicate->column != COLUMN_ID) {
+      continue;
+    }
+    uint64_t value = predicate->integer;
+    uint64_t bound_low = 0;
+    uint64_t bound_high = UINT32_MAX;
+    switch (predicate->op) {
+      case (COMPARE_EQUAL):
+        bound_low = bound_high = value;
+        break;
+      case (COMPARE_GREATER):
+        bound_low = value + 1;
+        break;
+      case (COMPARE_GREATER_EQUAL):
+        bound_low = value;
+        break;
+      case (COMPARE_LESS):
+        empty |= value == 0;
+        bound_high = value ? value - 1 : 0;
+        break;
+      case (COMPARE_LESS_EQUAL):
+        bound_high = value;
+        break;
+      case (COMPARE_IN):
+        bound_low = query->in_ids[0];
+        bound_high = query->in_ids[query->num_in_ids - 1];
+        break;
+      case (COMPARE_NOT_EQUAL):
+      case (COMPARE_PREFIX):
+      case (COMPARE_SUFFIX):
+      case (COMPARE_CONTAINS):
+        break;
+    }
+    bool lower_bound = predicate->op == COMPARE_EQUAL ||
+                       predicate->op == COMPARE_GREATER ||
+                       predicate->op == COMPARE_GREATER_EQUAL;
+    if (lower_bound && (plan->seek_predicate < 0 || bound_low > low)) {
+      /* Seek from the tightest lower bound; the others become filters */
+      low = bound_low;
+      plan->seek_predicate = i;
+    }
+    high = bound_high < high ? bound_high : high;
+  }
+  if (plan->seek_predicate >= 0) {
+    plan->access_path = ACCESS_ID_SEEK;
+    if (low == high && query->predicates[plan->seek_predicate].op == COMPARE_EQUAL) {
+      /* A single id is one bucket read instead of a descent, or a row cache hit */
+      if (table->hash_index) {
+        plan->access_path = ACCESS_HASH_PROBE;
+      } else if (table->row_cache.num_slots > 0) {
+        plan->access_path = ACCESS_ID_PROBE;
+      }
+    }
+  }
+
+  if (stats->valid) {
+    if (empty || low > high) {
+      plan->scanned_rows = 0;
+    } else if (low == high) {
+      plan->scanned_rows = low >= stats->min_key && low <= stats->max_key ? 1 : 0;
+    } else {
+      plan->scanned_rows = stats->num_rows * (stats_fraction_below(stats, high + 1) -
+                                              stats_fraction_below(stats, low));
+    }
+    plan->result_rows = plan->scanned_rows;
+    for (uint32_t i = 0; i < query->num_predicates; i++) {
+      plan->result_rows *= predicate_selectivity(&query->predicates[i], stats);
+    }
+  }
+
+  /*
+  An equality, prefix or suffix on an indexed column reads only the rows it
+  matches, and stops as soon as a limit is met. With statistics it is
+  chosen when its matches cost less than the rows the scan or id seek would
+  read; without them it wins over anything but a single id.
+  */
+  double best_cost = plan->scanned_rows;
+  for (uint32_t i = 0; i < query->num_predicates; i++) {
+    Predicate* predicate = &query->predicates[i];
+    if (index_root_for(table, predicate->column, predicate->op) == 0 ||
+        (predicate->op == COMPARE_CONTAINS && strlen(predicate->text) < TRIGRAM_SIZE)) {
+      continue;
+    }
+    double matches = stats->num_rows * predicate_selectivity(predicate, stats);
+    uint32_t covered = COLUMN_BIT(COLUMN_ID) | COLUMN_BIT(predicate->column);
+    bool index_only =
+        predicate->op != COMPARE_CONTAINS && (select_query_columns(query) & ~covered) == 0;
+    double cost = matches * (index_only ? 1.0 : INDEX_LOOKUP_COST);
+    bool cheaper = stats->valid ? cost < best_cost
+                                : plan->access_path == ACCESS_FULL_SCAN ||
+                                      (plan->access_path == ACCESS_ID_SEEK && low != high);
+    if (cheaper) {
+      plan->access_path =
+          predicate->op == COMPARE_CONTAINS ? ACCESS_TRIGRAM_SCAN : ACCESS_INDEX_SEEK;
+      plan->seek_predicate = i;
+      plan->scanned_rows = matches;
+      best_cost = cost;
+    }
+  }
+
+  /* An in list is only ever evaluated by fetching its ids */
+  for (uint32_t i = 0; i < query->num_predicates; i++) {
+    if (query->predicates[i].op == COMPARE_IN) {
+      plan->access_path = ACCESS_MULTI_GET;
+      plan->seek_predicate = i;
+      if (stats->valid && query->num_in_ids < plan->scanned_rows) {
+        plan->scanned_rows = query->num_in_ids;
+        plan->result_rows =
+            plan->result_rows < plan->scanned_rows ? plan->result_rows : plan->scanned_rows;
+      }
+    }
+  }
+
+  if (query->has_sample) {
+    plan->access_path = ACCESS_SAMPLE;
+    /* Past half the table most descents land on rows already taken */
+    plan->sample_scan = stats->valid && 2 * (uint64_t)query->sample_size >= stats->num_rows;
+    if (stats->valid) {
+      plan->result_rows = query->sample_size < stats->num_rows ? query->sample_size
+                                                               : stats->num_rows;
+      plan->scanned_rows = plan->sample_scan ? stats->num_rows : plan->result_rows;
+    }
+    return;
+  }
+
+  /* Approximate distinct counts read only the sketches */
+  if (query->num_projections > 0 &&
+      query->projections[0].aggregate == AGGREGATE_APPROX_DISTINCT) {
+    plan->access_path = ACCESS_SKETCH;
+    plan->scanned_rows = 0;
+    plan->result_rows = 1;
+    return;
+  }
+
+  /* A view holds the aggregates already, one entry per group */
+  plan->view = aggregate_view_for(table, query);
+  if (plan->view >= 0) {
+    plan->access_path = ACCESS_VIEW;
+    plan->seek_predicate = query->num_predicates > 0 ? 0 : -1;
+    if (stats->valid && plan->seek_predicate >= 0) {
+      plan->scanned_rows = 1;
+    } else if (stats->valid) {
+      AggregateView* view = &table->views[plan->view];
+      plan->scanned_rows = view->function == FUNCTION_DOMAIN   ? stats->distinct_domains
+                           : view->column == COLUMN_USERNAME ? stats->distinct_usernames
+                                                             : stats->distinct_emails;
+    }
+    plan->result_rows = plan->scanned_rows;
+  }
+
+  /* An index entry is a (value, id) pair, so a query reading nothing else never visits the table */
+  if (plan->access_path == ACCESS_INDEX_SEEK) {
+    uint32_t covered =
+        COLUMN_BIT(COLUMN_ID) | COLUMN_BIT(query->predicates[plan->seek_predicate].column);
+    plan->index_only = (select_query_columns(query) & ~covered) == 0;
+  }
+
+  if (!query->has_group_by) {
+    return;
+  }
+  /*
+  Workers share one full scan, so they only pay off on a full scan with
+  enough rows to keep each of them busy.
+  */
+  plan->num_workers = table->settings.group_threads;
+  if (plan->access_path != ACCESS_FULL_SCAN) {
+    plan->num_workers = 1;
+  } else if (stats->valid) {
+    uint32_t useful = plan->scanned_rows / PARALLEL_ROWS_PER_WORKER;
+    if (useful < plan->num_workers) {
+      plan->num_workers = useful > 1 ? useful : 1;
+    }
+  }
+
+  if (stats->valid) {
+    /* Size the hash table for the expected groups so it does not rehash while filling */
+    double groups = plan->result_rows;
+    if (query->group_column == COLUMN_USERNAME && stats->distinct_usernames < groups) {
+      groups = stats->distinct_usernames;
+    } else if (query->group_column == COLUMN_EMAIL) {
+      double distinct = query->group_function == FUNCTION_DOMAIN ? stats->distinct_domains
+                                                                 : stats->distinct_emails;
+      groups = distinct < groups ? distinct : groups;
+    }
+    uint32_t max_capacity =
+        table->settings.group_memory / plan->num_workers / 2 / sizeof(GroupSlot);
+    while (plan->group_capacity < 2 * groups && plan->group_capacity * 2 <= max_capacity) {
+      plan->group_capacity *= 2;
+    }
+  }
+}
+
+/*
+Insert, delete and select statements run as small register-based bytecode
+programs, in the spirit of SQLite's VDBE. A program is compiled from the
+shape of a statement with its literal values left out: the values are bound
+into the first registers when the program runs, so one compiled program
+serves every statement of that shape and is cached by it. Programs walk a
+cursor along the leaves and read columns in place from the pinned leaf.
+*/
+typedef enum {
+  OP_HALT,            // stop and return the statement result
+  OP_REWIND,          // cursor to the first row; jump to p4 if the table is empty
+  OP_SEEK_GE,         // cursor to the first row with id >= r[p1]; jump to p4 if none
+  OP_SEEK_GT,         // cursor to the first row with id > r[p1]; jump to p4 if none
+  OP_NEXT,            // advance the cursor; jump to p4 if it is on a row
+  OP_INDEX_SEEK,      // cursor to the first row whose column p1 <op p3> r[p2] by its index; jump to p4 if none
+  OP_INDEX_NEXT,      // cursor to the next such row; jump to p4 if any
+  OP_TRIGRAM_SEEK,    // cursor to the first row whose column p1 may contain r[p2]; jump to p4 if none
+  OP_TRIGRAM_NEXT,    // cursor to the next such row; jump to p4 if any
+  OP_FILTER,          // jump to p4 if the key filter rules out id r[p1]
+  OP_HASH_PROBE,      // copy the row with id r[p1] out of the hash index; jump to p4 if none
+  OP_ID_PROBE,        // copy the row with id r[p1] out of the table; jump to p4 if none
+  OP_MULTI_GET,       // copy out the rows for the in list of predicate p1; jump to p4 if none
+  OP_FETCHED_NEXT,    // move to the next row copied out; jump to p4 if any
+  OP_SAMPLE,          // copy out a random sample of rows, by full scan if p1; jump to p4 if none
+  OP_BATCH_SCAN,      // decode the first batch of rows from the leaves; jump to p4 if the table is empty
+  OP_BATCH_NEXT,      // decode the next batch of rows; jump to p4 if any
+  OP_BATCH_FILTER,    // mask out the batch rows that fail a predicate
+  OP_BATCH_AGG_STEP,  // fold the ids of the batch rows left in the mask into the aggregate state
+  OP_BATCH_EMIT,      // print projections r[p1] .. r[p1 + p2 - 1] of each batch row left in the mask
+  OP_VIEW_READ,       // aggregate from view p1, only its group for r[p2] if p3
+  OP_SKETCH_VALUE,    // r[p2] = distinct count estimated by sketch p1
+  OP_COLUMN,          // r[p2] = column p1 of the cursor row
+  OP_DOMAIN,          // r[p2] = domain(r[p1])
+  OP_COMPARE,         // jump to p4 unless r[p2] <op p1> r[p3]
+  OP_LIMIT,           // jump to p4 if r[p1] is zero, otherwise decrement it
+  OP_EMIT,            // print r[p1] .. r[p1 + p2 - 1] as a result row
+  OP_AGG_STEP,        // fold id r[p1] into the aggregate state
+  OP_AGG_VALUE,       // r[p2] = aggregate p1 of the aggregate state, or of the group if p3
+  OP_SORTER_PUT,      // add the cursor row to the sorter
+  OP_SORTER_SORT,     // sort and point the cursor at the first row; jump to p4 if none
+  OP_SORTER_NEXT,     // point the cursor at the next sorted row; jump to p4 if any
+  OP_GROUP_STEP,      // fold id r[p2] into the group keyed by r[p1]
+  OP_GROUP_PARALLEL,  // scan, filter and group the whole table on worker threads
+  OP_GROUP_REWIND,    // move to the first finished group; jump to p4 if none
+  OP_GROUP_NEXT,      // move to the next group; jump to p4 if any
+  OP_GROUP_KEY,       // r[p1] = key of the current group, an id if p2
+  OP_INSERT,          // insert the encoded row r[p1 + 1] under id r[p1]
+  OP_DELETE,          // delete the row with id r[p1]
+  NUM_OPCODES
+} Opcode;
+
+typedef struct {
+  uint8_t opcode;
+  uint8_t p1;
+  uint8_t p2;
+  uint8_t p3;
+  int32_t p4;  // jump target
+} Instruction;
+
+#define MAX_PROGRAM_SIZE 128
+#define MAX_REGISTERS 32
+#define MAX_SHAPE_SIZE 64
+#define PROGRAM_CACHE_SIZE 16
+
+typedef struct {
+  uint32_t num_instructions;
+  Instruction instructions[MAX_PROGRAM_SIZE];
+  uint32_t num_registers;
+  bool uses_sorter;
+  bool index_only;            // index seeks read rows from index entries alone
+  uint32_t num_group_tables;  // 0 unless the program groups rows
+  bool overflow;  // the statement needed more instructions or registers than fit
+} Program;
+
+typedef struct {
+  uint8_t shape[MAX_SHAPE_SIZE];
+  uint32_t shape_length;
+  uint64_t last_used;  // 0 for an unused entry
+  Program program;
+} ProgramCacheEntry;
+
+typedef struct ProgramCache {
+  ProgramCacheEntry entries[PROGRAM_CACHE_SIZE];
+  uint64_t clock;
+  uint64_t hits;
+  uint64_t misses;
+} ProgramCache;
+
+typedef enum { REGISTER_NULL, REGISTER_INTEGER, REGISTER_TEXT } RegisterType;
+
+/* Text registers point at bytes owned by a page, the statement or an operator */
+typedef struct {
+  RegisterType type;
+  uint64_t integer;
+  const char* text;
+} Register;
+
+typedef struct {
+  Table* table;
+  SelectQuery* query;
+  Register registers[MAX_REGISTERS];
+  PinnedPages* tracker;  // pins the leaf under the cursor
+  char* node;
+  uint32_t num_cells;
+  uint32_t cell_num;
+  Row* row;  // the current sorted row, read instead of the leaf when set
+  AggregateState aggregate;
+  Sorter sorter;
+  HashAggregate groups[MAX_GROUP_THREADS];
+  GroupIterator group_iterator;
+  GroupSlot* group;
+  HashAggregate* group_table;  // holds the current group's key
+  IndexCursor index_cursor;
+  char index_value[COLUMN_EMAIL_SIZE + 1];  // what index entries must equal or start with
+  uint32_t index_length;
+  bool index_prefix;
+  bool index_only;  // rows come from the index entries instead of the table
+  Column index_column;
+  bool index_reverse;  // entries hold their values spelled backwards
+  uint32_t* candidates;  // ids a trigram scan visits, in order
+  uint32_t num_candidates;
+  uint32_t candidate_num;
+  Row* fetched_rows;  // the rows a multi-get copied out, in id order
+  uint32_t num_fetched_rows;
+  uint32_t fetched_row_num;
+  Row probe_row;  // the row a hash probe found
+  Batch* batch;   // the rows a batch scan decoded, with the mask of those that match
+  BatchScan batch_scan;
+  ExecuteResult result;
+} Vm;
+
+uint32_t program_emit(Program* program, Opcode opcode, uint32_t p1, uint32_t p2,
+                      uint32_t p3) {
+  if (program->num_instructions >= MAX_PROGRAM_SIZE) {
+    program->overflow = true;
+    return MAX_PROGRAM_SIZE - 1;
+  }
+  Instruction* instruction = &program->instructions[program->num_instructions];
+  instruction->opcode = opcode;
+  instruction->p1 = p1;
+  instruction->p2 = p2;
+  instruction->p3 = p3;
+  instruction->p4 = 0;
+  return program->num_instructions++;
+}
+
+/* Point the jump of the instruction at address to the next instruction emitted */
+void program_jump_here(Program* program, uint32_t address) {
+  program->instructions[address].p4 = program->num_instructions;
+}
+
+uint32_t program_register(Program* program) {
+  if (program->num_registers >= MAX_REGISTERS) {
+    program->overflow = true;
+    return MAX_REGISTERS - 1;
+  }
+  return program->num_registers++;
+}
+
+/* Load every projection of the current row into results .. results + n - 1 */
+void compile_projections(Program* program, SelectQuery* query, uint32_t results) {
+  for (uint32_t i = 0; i < query->num_projections; i++) {
+    Projection* projection = &query->projections[i];
+    program_emit(program, OP_COLUMN, projection->column, results + i, 0);
+    if (projection->function == FUNCTION_DOMAIN) {
+      program_emit(program, OP_DOMAIN, results + i, results + i, 0);
+    }
+  }
+}
+
+/*
+Registers 0 .. num_predicates - 1 hold the predicate values, followed by
+the limit; bind_parameters fills them in the same order.
+*/
+void compile_select(Program* program, SelectQuery* query, QueryPlan* plan) {
+  for (uint32_t i = 0; i < query->num_predicates; i++) {
+    program_register(program);
+  }
+  uint32_t limit = query->has_limit ? program_register(program) : 0;
+  uint32_t columns[3];
+  for (uint32_t i = 0; i < 3; i++) {
+    columns[i] = program_register(program);
+  }
+  uint32_t domain = program_register(program);
+  uint32_t results = program->num_registers;
+  for (uint32_t i = 0; i < query->num_projections; i++) {
+    program_register(program);
+  }
+
+  bool parallel = query->has_group_by && plan->num_workers > 1;
+  /*
+  A full scan that only filters and aggregates or prints runs on batches. A
+  limit on printed rows stays row at a time, since it may stop well inside
+  the first batch.
+  */
+  bool batched = plan->access_path == ACCESS_FULL_SCAN && !query->has_group_by &&
+                 !query->has_order_by && (query->has_aggregates || !query->has_limit);
+  program->uses_sorter = query->has_order_by;
+  program->index_only = plan->index_only;
+  program->num_group_tables = query->has_group_by ? plan->num_workers : 0;
+
+  uint32_t exits[MAX_PREDICATES * 2 + 3];
+  uint32_t num_exits = 0;
+
+  if (plan->access_path == ACCESS_SKETCH) {
+    for (uint32_t i = 0; i < query->num_projections; i++) {
+      Projection* projection = &query->projections[i];
+      program_emit(program, OP_SKETCH_VALUE, sketch_for(projection->column, projection->function),
+                   results + i, 0);
+    }
+    program_emit(program, OP_EMIT, results, query->num_projections, 0);
+    program_emit(program, OP_HALT, 0, 0, 0);
+    return;
+  }
+  if (plan->access_path == ACCESS_VIEW) {
+    int32_t seek = plan->seek_predicate;
+    program_emit(program, OP_VIEW_READ, plan->view, seek >= 0 ? seek : 0, seek >= 0);
+  } else if (parallel) {
+    program_emit(program, OP_GROUP_PARALLEL, 0, 0, 0);
+  } else if (batched) {
+    /* Whole leaves are decoded into column arrays and filtered and folded a batch at a time */
+    exits[num_exits++] = program_emit(program, OP_BATCH_SCAN, 0, 0, 0);
+    uint32_t loop = program->num_instructions;
+    program_emit(program, OP_BATCH_FILTER, 0, 0, 0);
+    if (query->has_aggregates) {
+      program_emit(program, OP_BATCH_AGG_STEP, 0, 0, 0);
+    } else {
+      program_emit(program, OP_BATCH_EMIT, results, query->num_projections, 0);
+    }
+    program->instructions[program_emit(program, OP_BATCH_NEXT, 0, 0, 0)].p4 = loop;
+    for (uint32_t i = 0; i < num_exits; i++) {
+      program_jump_here(program, exits[i]);
+    }
+  } else {
+    /* Seek straight to the planned lower bound on id instead of scanning up to it */
+    int32_t seek = plan->seek_predicate;
+    if (plan->access_path == ACCESS_FULL_SCAN) {
+      exits[num_exits++] = program_emit(program, OP_REWIND, 0, 0, 0);
+    } else if (plan->access_path == ACCESS_INDEX_SEEK) {
+      exits[num_exits++] = program_emit(program, OP_INDEX_SEEK, query->predicates[seek].column,
+                                        seek, query->predicates[seek].op);
+    } else if (plan->access_path == ACCESS_TRIGRAM_SCAN) {
+      exits[num_exits++] =
+          program_emit(program, OP_TRIGRAM_SEEK, query->predicates[seek].column, seek, 0);
+    } else if (plan->access_path == ACCESS_HASH_PROBE ||
+               plan->access_path == ACCESS_ID_PROBE) {
+      Opcode opcode = plan->access_path == ACCESS_HASH_PROBE ? OP_HASH_PROBE : OP_ID_PROBE;
+      exits[num_exits++] = program_emit(program, OP_FILTER, seek, 0, 0);
+      exits[num_exits++] = program_emit(program, opcode, seek, 0, 0);
+    } else if (plan->access_path == ACCESS_MULTI_GET) {
+      exits[num_exits++] = program_emit(program, OP_MULTI_GET, seek, 0, 0);
+    } else if (plan->access_path == ACCESS_SAMPLE) {
+      exits[num_exits++] = program_emit(program, OP_SAMPLE, plan->sample_scan, 0, 0);
+    } else {
+      if (query->predicates[seek].op == COMPARE_EQUAL) {
+        exits[num_exits++] = program_emit(program, OP_FILTER, seek, 0, 0);
+      }
+      Opcode opcode =
+          query->predicates[seek].op == COMPARE_GREATER ? OP_SEEK_GT : OP_SEEK_GE;
+      exits[num_exits++] = program_emit(program, opcode, seek, 0, 0);
+    }
+
+    uint32_t loop = program->num_instructions;
+    uint32_t skips[MAX_PREDICATES];
+    uint32_t num_skips = 0;
+    uint32_t loaded = 0;
+    for (uint32_t i = 0; i < query->num_predicates; i++) {
+      Predicate* predicate = &query->predicates[i];
+      Column column = predicate->column;
+      if ((plan->access_path == ACCESS_INDEX_SEEK || plan->access_path == ACCESS_HASH_PROBE ||
+           plan->access_path == ACCESS_ID_PROBE || plan->access_path == ACCESS_MULTI_GET) &&
+          (int32_t)i == seek) {
+        continue;  // every row the index yields matches it
+      }
+      if (!(loaded & COLUMN_BIT(column))) {
+        program_emit(program, OP_COLUMN, column, columns[column], 0);
+        loaded |= COLUMN_BIT(column);
+      }
+      if (column == COLUMN_ID && (predicate->op == COMPARE_LESS ||
+                                  predicate->op == COMPARE_LESS_EQUAL ||
+                                  predicate->op == COMPARE_EQUAL)) {
+        /* Ids only grow along the leaves, so past an upper bound the scan is over */
+        CompareOp op = predicate->op == COMPARE_LESS ? COMPARE_LESS : COMPARE_LESS_EQUAL;
+        exits[num_exits++] = program_emit(program, OP_COMPARE, op, columns[column], i);
+        if (predicate->op != COMPARE_EQUAL) {
+          continue;
         }
-      update_internal_node_key(parent, old_max_key, new_max_key);
+      }
+      skips[num_skips++] =
+          program_emit(program, OP_COMPARE, predicate->op, columns[column], i);
     }
-  
-    /* Decrement the number of children in the parent by 1 */
-  
-    parent_page_num = *node_parent(child);
-    *internal_node_num_keys(parent) -= 1;
-    push_free_page(table->pager, child_page_num);
 
-    /* If the parent becomes underfilled after its child was deleted, call internal_node_merge() */
-    if (*internal_node_num_keys(parent) < 1 && !is_node_root(parent)) {
-      internal_node_merge(table, parent_page_num);
+    if (query->has_group_by) {
+      uint32_t key = columns[query->group_column];
+      if (!(loaded & COLUMN_BIT(query->group_column))) {
+        program_emit(program, OP_COLUMN, query->group_column, key, 0);
+      }
+      if (query->group_function == FUNCTION_DOMAIN) {
+        program_emit(program, OP_DOMAIN, key, domain, 0);
+        key = domain;
+      }
+      if (!(loaded & COLUMN_BIT(COLUMN_ID)) && query->group_column != COLUMN_ID) {
+        program_emit(program, OP_COLUMN, COLUMN_ID, columns[COLUMN_ID], 0);
+      }
+      program_emit(program, OP_GROUP_STEP, key, columns[COLUMN_ID], 0);
+    } else if (query->has_order_by) {
+      program_emit(program, OP_SORTER_PUT, 0, 0, 0);
+    } else if (query->has_aggregates) {
+      if (!(loaded & COLUMN_BIT(COLUMN_ID))) {
+        program_emit(program, OP_COLUMN, COLUMN_ID, columns[COLUMN_ID], 0);
+      }
+      program_emit(program, OP_AGG_STEP, columns[COLUMN_ID], 0, 0);
+    } else {
+      if (query->has_limit) {
+        exits[num_exits++] = program_emit(program, OP_LIMIT, limit, 0, 0);
+      }
+      compile_projections(program, query, results);
+      program_emit(program, OP_EMIT, results, query->num_projections, 0);
     }
 
-    unpin_all_pages(table->pager, tracker);
-    
-}
+    for (uint32_t i = 0; i < num_skips; i++) {
+      program_jump_here(program, skips[i]);
+    }
+    /* A probe finds at most one row, so there is nothing to loop over */
+    if (plan->access_path == ACCESS_INDEX_SEEK) {
+      uint32_t next =
+          program_emit(program, OP_INDEX_NEXT, query->predicates[seek].column, seek, 0);
+      program->instructions[next].p4 = loop;
+    } else if (plan->access_path == ACCESS_TRIGRAM_SCAN) {
+      program->instructions[program_emit(program, OP_TRIGRAM_NEXT, 0, 0, 0)].p4 = loop;
+    } else if (plan->access_path == ACCESS_MULTI_GET || plan->access_path == ACCESS_SAMPLE) {
+      program->instructions[program_emit(program, OP_FETCHED_NEXT, 0, 0, 0)].p4 = loop;
+    } else if (plan->access_path != ACCESS_HASH_PROBE &&
+               plan->access_path != ACCESS_ID_PROBE) {
+      program->instructions[program_emit(program, OP_NEXT, 0, 0, 0)].p4 = loop;
+    }
+    for (uint32_t i = 0; i < num_exits; i++) {
+      program_jump_here(program, exits[i]);
+    }
+  }
 
-void internal_node_merge(Table* table, uint32_t page_num) {
-  PinnedPages* tracker = init_pinned_pages();
-  
-  /* Fetch the underfilled internal node, its parent, its right child, and its index within its own parent.*/
-  
-  char* node = get_page(table->pager, page_num, tracker);
-  char* parent = get_page(table->pager, *node_parent(node), tracker);
-  char* child = get_page(table->pager, *internal_node_right_child(node), tracker);
-  uint32_t index = internal_node_find_child(parent, get_node_max_key(table->pager, node)); 
-  
-  /* Initialize the underfilled internal node's sibling to an invalid page number and 
-  initialize the sibling's index in the parent and its cell number to 0. */
-  
-  uint32_t sibling_page_num = INVALID_PAGE_NUM;
-  uint32_t sibling_index = 0;
-  uint32_t sibling_cell_num = 0;
-  
-  /* Initialize the underfilled internal node's sibling's index to the index of the node directly to the left of it if the underfilled node
-  is the right child of its parent. Otherwise, initialize  underfilled internal node's sibling's index to the index of the node directly to 
-  the right of it.*/
-  
-  if (index == *internal_node_num_keys(parent)) {
-    sibling_index = index - 1;
+  /* Produce output from whatever the scan fed */
+  num_exits = 0;
+  if (query->has_group_by) {
+    exits[num_exits++] = program_emit(program, OP_GROUP_REWIND, 0, 0, 0);
+    uint32_t loop = program->num_instructions;
+    if (query->has_limit) {
+      exits[num_exits++] = program_emit(program, OP_LIMIT, limit, 0, 0);
+    }
+    for (uint32_t i = 0; i < query->num_projections; i++) {
+      Projection* projection = &query->projections[i];
+      if (projection->aggregate != AGGREGATE_NONE) {
+        program_emit(program, OP_AGG_VALUE, projection->aggregate, results + i, 1);
+      } else {
+        program_emit(program, OP_GROUP_KEY, results + i,
+                     query->group_column == COLUMN_ID, 0);
+      }
+    }
+    program_emit(program, OP_EMIT, results, query->num_projections, 0);
+    program->instructions[program_emit(program, OP_GROUP_NEXT, 0, 0, 0)].p4 = loop;
+  } else if (query->has_order_by) {
+    exits[num_exits++] = program_emit(program, OP_SORTER_SORT, 0, 0, 0);
+    uint32_t loop = program->num_instructions;
+    if (query->has_limit) {
+      exits[num_exits++] = program_emit(program, OP_LIMIT, limit, 0, 0);
+    }
+    compile_projections(program, query, results);
+    program_emit(program, OP_EMIT, results, query->num_projections, 0);
+    program->instructions[program_emit(program, OP_SORTER_NEXT, 0, 0, 0)].p4 = loop;
+  } else if (query->has_aggregates) {
+    if (query->has_limit) {
+      exits[num_exits++] = program_emit(program, OP_LIMIT, limit, 0, 0);
+    }
+    for (uint32_t i = 0; i < query->num_projections; i++) {
+      program_emit(program, OP_AGG_VALUE, query->projections[i].aggregate, results + i, 0);
+    }
+    program_emit(program, OP_EMIT, results, query->num_projections, 0);
   }
-  else {
-    sibling_index = index + 1;
+  for (uint32_t i = 0; i < num_exits; i++) {
+    program_jump_here(program, exits[i]);
   }
-  sibling_page_num = *internal_node_child(parent, sibling_index);
+  program_emit(program, OP_HALT, 0, 0, 0);
+}
 
-  char* sibling = get_page(table->pager, sibling_page_num, tracker);
+void compile_statement(Program* program, Statement* statement, QueryPlan* plan) {
+  program->num_instructions = 0;
+  program->num_registers = 0;
+  program->uses_sorter = false;
+  program->index_only = false;
+  program->num_group_tables = 0;
+  program->overflow = false;
 
-  /* If the underfilled internal node's sibling has less more than child, we transfer a child from it to 
-  the underfilled internal node to help fill the underfilled internal node. */
-  
-  if (*internal_node_num_keys(sibling) > 1) {
-    
-    /*If the underfilled internal node's sibling is the index of the node directly to the left of the 
-    underfilled internal node, we initialize the index of the underfilled internal node's sibling's 
-    child to index of the underfilled internal node's sibling's right child. If the underfilled internal 
-    node's sibling is the index of the node directly to the right of the underfilled internal node, we 
-    initialize the index of the underfilled internal node's sibling's child to index of the underfilled 
-    internal node's sibling's first child */
-    
-    if (sibling_index == index - 1) {
-      sibling_cell_num = *internal_node_num_keys(sibling);
-    }
-    char* source = get_page(table->pager, *internal_node_child(sibling, sibling_cell_num), tracker);
-    
-    /* Set the underfilled internal node's sibling's child's parent to be the underfilled internal node and increase 
-    the underfilled internal node's number of keys by 1. */
-    
-    *node_parent(source) = page_num;
-    *internal_node_num_keys(node) += 1;
+  switch (statement->type) {
+    case (STATEMENT_INSERT):
+      program->num_registers = 2;
+      program_emit(program, OP_INSERT, 0, 0, 0);
+      break;
+    case (STATEMENT_DELETE):
+      program->num_registers = 1;
+      program_emit(program, OP_DELETE, 0, 0, 0);
+      break;
+    case (STATEMENT_SELECT):
+      compile_select(program, &statement->select, plan);
+      return;
+    default:
+      program->overflow = true;
+      return;
+  }
+  program_emit(program, OP_HALT, 0, 0, 0);
+}
 
-    /* If the maximum key of the underfilled internal node is less than the maximum key of the underfilled internal node's 
-    sibling's child's maximum key, we need to update the underfilled internal node's maximum key to be the underfilled internal 
-    node's sibling's child's maximum key */
-    
-    if (get_node_max_key(table->pager, source) > get_node_max_key(table->pager, child)) {
-      *internal_node_child(node, 0) = *internal_node_right_child(node);
-      *internal_node_key(node, 0) = get_node_max_key(table->pager, child);
-      *internal_node_right_child(node) = *internal_node_child(sibling, sibling_cell_num);
+/*
+The cache key of a statement: everything compile_statement looks at,
+without the literal values.
+*/
+uint32_t statement_shape(Statement* statement, QueryPlan* plan, uint8_t* shape) {
+  uint32_t length = 0;
+  shape[length++] = statement->type;
+  if (statement->type != STATEMENT_SELECT) {
+    return length;
+  }
 
-      uint32_t old_max_key = get_node_max_key(table->pager, child);
-      uint32_t new_max_key = get_node_max_key(table->pager, source); 
-      
-      /* If the underfilled internal node was the right child of its parent, then we also need to update its key in its parent and
-      so on if the parent is the right child of its own parent. */
-      
-      if (*internal_node_right_child(parent) == page_num) {
-        uint32_t parent_page_num = *node_parent(node);
-        parent = get_page(table->pager, *node_parent(parent), tracker);
-        while (*internal_node_right_child(parent) == parent_page_num && !is_node_root(parent)) {
-          parent_page_num = *node_parent(get_page(table->pager, parent_page_num, tracker));
-          parent = get_page(table->pager, *node_parent(parent), tracker);
+  SelectQuery* query = &statement->select;
+  shape[length++] = query->num_projections;
+  for (uint32_t i = 0; i < query->num_projections; i++) {
+    shape[length++] = query->projections[i].aggregate;
+    shape[length++] = query->projections[i].column;
+    shape[length++] = query->projections[i].function;
+  }
+  shape[length++] = query->num_predicates;
+  for (uint32_t i = 0; i < query->num_predicates; i++) {
+    shape[length++] = query->predicates[i].column;
+    shape[length++] = query->predicates[i].op;
+  }
+  shape[length++] = query->has_aggregates;
+  shape[length++] = query->has_order_by;
+  shape[length++] = query->has_limit;
+  shape[length++] = plan->access_path;
+  shape[length++] = plan->seek_predicate;
+  shape[length++] = plan->index_only;
+  shape[length++] = (uint8_t)(plan->view + 1);
+  shape[length++] = plan->sample_scan;
+  shape[length++] = query->has_group_by;
+  if (query->has_group_by) {
+    shape[length++] = query->group_column;
+    shape[length++] = query->group_function;
+    shape[length++] = plan->num_workers;
+  }
+  return length;
+}
+
+/* Fill the parameter registers of a program with the statement's values */
+void bind_parameters(Statement* statement, Register* registers) {
+  switch (statement->type) {
+    case (STATEMENT_INSERT): {
+      uint32_t id;
+      memcpy(&id, statement->row_value + ID_OFFSET, ID_SIZE);
+      registers[0].type = REGISTER_INTEGER;
+      registers[0].integer = id;
+      registers[1].type = REGISTER_TEXT;
+      registers[1].text = statement->row_value;
+      break;
+    }
+    case (STATEMENT_DELETE):
+      registers[0].type = REGISTER_INTEGER;
+      registers[0].integer = statement->delete_id;
+      break;
+    case (STATEMENT_SELECT): {
+      SelectQuery* query = &statement->select;
+      for (uint32_t i = 0; i < query->num_predicates; i++) {
+        Predicate* predicate = &query->predicates[i];
+        if (predicate->column == COLUMN_ID) {
+          registers[i].type = REGISTER_INTEGER;
+          registers[i].integer = predicate->integer;
+        } else {
+          registers[i].type = REGISTER_TEXT;
+          registers[i].text = predicate->text;
         }
       }
-      update_internal_node_key(parent, old_max_key, new_max_key);
+      if (query->has_limit) {
+        registers[query->num_predicates].type = REGISTER_INTEGER;
+        registers[query->num_predicates].integer = query->limit;
+      }
+      break;
     }
-      
-    /* Set the first child of the underfilled internal node to the first child of the underfilled internal node's sibling. */
-      
-    else {
-      *internal_node_child(node, 0) = *internal_node_child(sibling, sibling_cell_num);
-      *internal_node_key(node, 0) = get_node_max_key(table->pager, source);
+    default:
+      break;
+  }
+}
+
+/* The compiled program for the statement's shape, compiling it on a miss */
+Program* program_cache_lookup(Table* table, Statement* statement, QueryPlan* plan) {
+  if (table->programs == NULL) {
+    table->programs = memory_calloc(MEMORY_CACHE, 1, sizeof(ProgramCache));
+    if (table->programs == NULL) {
+      return NULL;
+    }
+  }
+  ProgramCache* cache = table->programs;
+  uint8_t shape[MAX_SHAPE_SIZE];
+  uint32_t shape_length = statement_shape(statement, plan, shape);
+
+  cache->clock += 1;
+  ProgramCacheEntry* victim = &cache->entries[0];
+  for (uint32_t i = 0; i < PROGRAM_CACHE_SIZE; i++) {
+    ProgramCacheEntry* entry = &cache->entries[i];
+    if (entry->last_used && entry->shape_length == shape_length &&
+        memcmp(entry->shape, shape, shape_length) == 0) {
+      entry->last_used = cache->clock;
+      cache->hits += 1;
+      return &entry->program;
+    }
+    if (entry->last_used < victim->last_used) {
+      victim = entry;
     }
-    /* Delete from the underfilled internal node's sibling its child that was transferred to the underfilled internla node */
-    
-    internal_node_delete(table, sibling_page_num, *internal_node_child(sibling, sibling_cell_num), sibling_cell_num);
-    pop_free_page(table->pager);
   }
-  /* If the underfilled internal node's sibling has only 1 key and the parent of the underfilled internal node is the root, 
-  we transfer the the underfilled internal node's only child to the underfilled node's sibling and set the sibling as the root.*/
-    
-  else if (*internal_node_num_keys(sibling) == 1) {
-    if (*internal_node_num_keys(parent) == 1 && is_node_root(parent)) {
-      internal_node_insert(table, sibling_page_num, *internal_node_right_child(node));
-  
-      for (uint32_t i = 0; i < *internal_node_num_keys(sibling) + 1; i++) {
-        *node_parent(get_page(table->pager, *internal_node_child(sibling, i), tracker)) = *node_parent(node);
-      }
-      memcpy(parent, sibling, PAGE_SIZE);
-      set_node_root(parent, true);
 
-      push_free_page(table->pager, sibling_page_num);
+  /* Compile into the least recently used entry */
+  cache->misses += 1;
+  compile_statement(&victim->program, statement, plan);
+  if (victim->program.overflow) {
+    victim->last_used = 0;
+    return NULL;
+  }
+  memcpy(victim->shape, shape, shape_length);
+  victim->shape_length = shape_length;
+  victim->last_used = cache->clock;
+  return &victim->program;
+}
+
+void print_program_cache_stats(Table* table) {
+  ProgramCache* cache = table->programs;
+  uint32_t cached = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  if (cache) {
+    for (uint32_t i = 0; i < PROGRAM_CACHE_SIZE; i++) {
+      cached += cache->entries[i].last_used != 0;
     }
+    hits = cache->hits;
+    misses = cache->misses;
+  }
+  printf("programs: %u of %u cached, %lu hits, %lu misses\n", cached, PROGRAM_CACHE_SIZE,
+         (unsigned long)hits, (unsigned long)misses);
+}
 
-      /* If the underfilled internal node's sibling has only 1 child and the parent of the underfilled internal node is not the root, 
-      we transfer the the underfilled internal node's only child to the underfilled node's sibling and delete the underfilled internal node
-      from its parent.*/
-      
-    else {
-      internal_node_insert(table, sibling_page_num, *internal_node_right_child(node));
-      *node_parent(child) = sibling_page_num;
-      internal_node_delete(table, *node_parent(node), page_num, index);
+void vm_cursor_release(Vm* vm) {
+  if (vm->tracker) {
+    unpin_all_pages(vm->table->pager, vm->tracker);
+    vm->tracker = NULL;
+  }
+  vm->node = NULL;
+}
+
+/*
+Point the cursor at cell_num of leaf page_num, moving along the leaf chain
+past leaves with nothing left in them. False once there are no rows left.
+*/
+bool vm_cursor_move_to(Vm* vm, uint32_t page_num, uint32_t cell_num) {
+  while (true) {
+    vm_cursor_release(vm);
+    vm->tracker = init_pinned_pages(vm->table->pager);
+    vm->node = get_page(vm->table->pager, page_num, vm->tracker);
+    vm->num_cells = *leaf_node_num_cells(vm->node);
+    vm->cell_num = cell_num;
+    if (cell_num < vm->num_cells) {
+      return true;
     }
+    page_num = *leaf_node_next_leaf(vm->node);
+    if (page_num == 0) {
+      vm_cursor_release(vm);
+      return false;
+    }
+    cell_num = 0;
   }
-  unpin_all_pages(table->pager, tracker);
 }
 
-void leaf_node_merge(Cursor* cursor);
+bool vm_cursor_seek(Vm* vm, uint32_t key) {
+  Cursor* cursor = table_find(vm->table, key);
+  bool on_row = vm_cursor_move_to(vm, cursor->page_num, cursor->cell_num);
+  return on_row;
+}
 
-void leaf_node_delete(Cursor* cursor, uint32_t key) {
+/*
+Point the cursor at the row of the index entry under the index cursor,
+skipping to later entries while that entry still holds value. False once
+the entries for value run out.
+*/
+bool vm_index_row(Vm* vm) {
+  uint32_t length = vm->index_length;
+  while (vm->index_cursor.node != NULL) {
+    char* entry = index_cursor_entry(&vm->index_cursor);
+    uint32_t entry_length = index_entry_length(entry);
+    if (vm->index_prefix ? entry_length < length : entry_length != length) {
+      break;
+    }
+    if (memcmp(index_entry_value(entry), vm->index_value, length) != 0) {
+      break;
+    }
+    uint32_t id = index_entry_id(entry);
+    if (vm->index_only) {
+      /* Only the id and the indexed column are read, and the entry has both */
+      Row* row = &vm->probe_row;
+      char* value = vm->index_column == COLUMN_USERNAME ? row->username : row->email;
+      IndexKey key = {index_entry_value(entry), entry_length, id};
+      if (vm->index_reverse) {
+        index_key_reverse(&key, value);
+      } else {
+        memcpy(value, key.value, entry_length);
+      }
+      value[entry_length] = '\0';
+      row->id = id;
+      vm->row = row;
+      return true;
+    }
+    if (vm_cursor_seek(vm, id) && *leaf_node_key(vm->node, vm->cell_num) == id) {
+      return true;
+    }
+    index_cursor_advance(vm->table, &vm->index_cursor);
+  }
+  index_cursor_release(vm->table, &vm->index_cursor);
+  vm_cursor_release(vm);
+  vm->row = NULL;
+  return false;
+}
 
-  PinnedPages* tracker = init_pinned_pages();
-  
-  /* Fetch the leaf node of the row that is to be deleted and how many rows it currently ha.s */
-  
-  char* node = get_page(cursor->table->pager, cursor->page_num, tracker);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+/* Point the cursor at the first remaining trigram candidate that is still a row */
+bool vm_candidate_row(Vm* vm) {
+  for (; vm->candidate_num < vm->num_candidates; vm->candidate_num++) {
+    uint32_t id = vm->candidates[vm->candidate_num];
+    if (vm_cursor_seek(vm, id) && *leaf_node_key(vm->node, vm->cell_num) == id) {
+      return true;
+    }
+  }
+  vm_cursor_release(vm);
+  return false;
+}
 
-  /* If the row to be deleted is not the right child of its leaf node, we shift all the rows 
-  after the deleted one to the left to fill the gap. */
-  
-  if (cursor->cell_num + 1 < num_cells) {
-    for (uint32_t i = cursor->cell_num; i + 1 < num_cells; i++) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i + 1), LEAF_NODE_CELL_SIZE);
+void vm_emit(Register* registers, uint32_t count) {
+  printf("(");
+  for (uint32_t i = 0; i < count; i++) {
+    if (i > 0) {
+      printf(", ");
+    }
+    switch (registers[i].type) {
+      case (REGISTER_NULL):
+        printf("NULL");
+        break;
+      case (REGISTER_INTEGER):
+        printf("%lu", (unsigned long)registers[i].integer);
+        break;
+      case (REGISTER_TEXT):
+        printf("%s", registers[i].text);
+        break;
     }
   }
-    
-  /* If the row to be deleted is the right child of its leaf node, we decrease the number of rows its leaf node
-  has by 1. */
-    
-  else if (cursor->cell_num + 1 == num_cells && !is_node_root(node)) {
-    
-    /* If the leaf node containing the row to be deleted is not the root, then we must also update the leaf node's key in its own parent 
-    and so on if the parent is the right child of its own parent.*/
-    
-    char* parent = get_page(cursor->table->pager, *node_parent(node), tracker);
-    uint32_t old_max_key = get_node_max_key(cursor->table->pager, node);
-    uint32_t new_max_key = *leaf_node_key(node, cursor->cell_num - 1);
-    uint32_t index = internal_node_find_child(parent, get_node_max_key(cursor->table->pager, node));
-    if (index == *internal_node_num_keys(parent) && !is_node_root(parent)) {
-      uint32_t parent_page_num = *node_parent(node);
-      parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
-      while (*internal_node_right_child(parent) == parent_page_num && !is_node_root(parent)) {
-        parent_page_num = *node_parent(get_page(cursor->table->pager, parent_page_num, tracker));
-        parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
-      }
+  printf(")\n");
+}
+
+/* Load the projections of batch row row into results, the way OP_COLUMN would */
+void vm_batch_projections(SelectQuery* query, Batch* batch, uint32_t row, Register* results) {
+  for (uint32_t i = 0; i < query->num_projections; i++) {
+    Projection* projection = &query->projections[i];
+    if (projection->column == COLUMN_ID) {
+      results[i].type = REGISTER_INTEGER;
+      results[i].integer = batch->ids[row];
+    } else if (projection->column == COLUMN_USERNAME) {
+      results[i].type = REGISTER_TEXT;
+      results[i].text = batch->usernames[row];
+    } else {
+      results[i].type = REGISTER_TEXT;
+      results[i].text = projection->function == FUNCTION_DOMAIN
+                            ? email_domain(batch->emails[row])
+                            : batch->emails[row];
     }
-    update_internal_node_key(parent, old_max_key, new_max_key);
   }
-
-  *(leaf_node_num_cells(node)) -= 1;
-  
-  /* If the leaf node that of the deleted row becomes underfilled after deletion, and it is not the root, we call leaf_node_merge*/
-  
-  if (*leaf_node_num_cells(node) < 7 && !is_node_root(node)) {
-    leaf_node_merge(cursor);
+}
+
+void vm_aggregate_value(AggregateType aggregate, AggregateState* state,
+                        Register* target) {
+  target->type = REGISTER_INTEGER;
+  switch (aggregate) {
+    case (AGGREGATE_COUNT):
+      target->integer = state->count;
+      break;
+    case (AGGREGATE_SUM):
+      target->integer = state->sum;
+      break;
+    case (AGGREGATE_MIN):
+      target->integer = state->min;
+      break;
+    case (AGGREGATE_MAX):
+      target->integer = state->max;
+      break;
+    case (AGGREGATE_NONE):
+    case (AGGREGATE_APPROX_DISTINCT):
+      break;
+  }
+  if (state->count == 0 && aggregate != AGGREGATE_COUNT && aggregate != AGGREGATE_SUM) {
+    target->type = REGISTER_NULL;
   }
-  unpin_all_pages(cursor->table->pager, tracker);
 }
 
+/*
+The interpreter loop. With GCC or clang each instruction jumps straight to
+the next one's handler through a table of label addresses (threaded
+dispatch); otherwise it falls back to a switch in a loop.
+*/
+#if defined(__GNUC__)
+#define VM_THREADED_DISPATCH
+#endif
+
+#ifdef VM_THREADED_DISPATCH
+#define VM_CASE(label, opcode) label:
+#define VM_DISPATCH() goto* dispatch_table[pc->opcode]
+#else
+#define VM_CASE(label, opcode) case (opcode):
+#define VM_DISPATCH() continue
+#endif
+#define VM_JUMP(condition)                                      \
+  do {                                                          \
+    pc = (condition) ? instructions + pc->p4 : pc + 1;          \
+    VM_DISPATCH();                                              \
+  } while (0)
+#define VM_NEXT() \
+  do {            \
+    pc += 1;      \
+    VM_DISPATCH(); \
+  } while (0)
+
+ExecuteResult vm_run(Program* program, Vm* vm) {
+  Instruction* instructions = program->instructions;
+  Instruction* pc = instructions;
+  Register* r = vm->registers;
+
+#ifdef VM_THREADED_DISPATCH
+  static void* dispatch_table[NUM_OPCODES] = {
+      [OP_HALT] = &&op_halt,
+      [OP_REWIND] = &&op_rewind,
+      [OP_SEEK_GE] = &&op_seek_ge,
+      [OP_SEEK_GT] = &&op_seek_gt,
+      [OP_NEXT] = &&op_next,
+      [OP_INDEX_SEEK] = &&op_index_seek,
+      [OP_INDEX_NEXT] = &&op_index_next,
+      [OP_TRIGRAM_SEEK] = &&op_trigram_seek,
+      [OP_TRIGRAM_NEXT] = &&op_trigram_next,
+      [OP_FILTER] = &&op_filter,
+      [OP_HASH_PROBE] = &&op_hash_probe,
+      [OP_ID_PROBE] = &&op_id_probe,
+      [OP_MULTI_GET] = &&op_multi_get,
+      [OP_FETCHED_NEXT] = &&op_fetched_next,
+      [OP_SAMPLE] = &&op_sample,
+      [OP_BATCH_SCAN] = &&op_batch_scan,
+      [OP_BATCH_NEXT] = &&op_batch_next,
+      [OP_BATCH_FILTER] = &&op_batch_filter,
+      [OP_BATCH_AGG_STEP] = &&op_batch_agg_step,
+      [OP_BATCH_EMIT] = &&op_batch_emit,
+      [OP_VIEW_READ] = &&op_view_read,
+      [OP_SKETCH_VALUE] = &&op_sketch_value,
+      [OP_COLUMN] = &&op_column,
+      [OP_DOMAIN] = &&op_domain,
+      [OP_COMPARE] = &&op_compare,
+      [OP_LIMIT] = &&op_limit,
+      [OP_EMIT] = &&op_emit,
+      [OP_AGG_STEP] = &&op_agg_step,
+      [OP_AGG_VALUE] = &&op_agg_value,
+      [OP_SORTER_PUT] = &&op_sorter_put,
+      [OP_SORTER_SORT] = &&op_sorter_sort,
+      [OP_SORTER_NEXT] = &&op_sorter_next,
+      [OP_GROUP_STEP] = &&op_group_step,
+      [OP_GROUP_PARALLEL] = &&op_group_parallel,
+      [OP_GROUP_REWIND] = &&op_group_rewind,
+      [OP_GROUP_NEXT] = &&op_group_next,
+      [OP_GROUP_KEY] = &&op_group_key,
+      [OP_INSERT] = &&op_insert,
+      [OP_DELETE] = &&op_delete,
+  };
+  VM_DISPATCH();
+#else
+  for (;;) switch (pc->opcode) {
+#endif
+
+  VM_CASE(op_halt, OP_HALT) {
+    return vm->result;
+  }
 
-void leaf_node_merge(Cursor* cursor) {
+  VM_CASE(op_rewind, OP_REWIND) {
+    Cursor* cursor = table_start(vm->table);
+    bool on_row = !cursor->end_of_table && vm_cursor_move_to(vm, cursor->page_num, 0);
+    VM_JUMP(!on_row);
+  }
 
-  PinnedPages* tracker = init_pinned_pages();
+  VM_CASE(op_seek_ge, OP_SEEK_GE) {
+    VM_JUMP(!vm_cursor_seek(vm, r[pc->p1].integer));
+  }
 
-  /* For our underfilled leaf node, we will need to find assign either the node to its left as its sibling
-  if it is the right child. Otherwise, we can just assign the node to the right as the sibling. 
+  VM_CASE(op_seek_gt, OP_SEEK_GT) {
+    uint64_t key = r[pc->p1].integer + 1;
+    VM_JUMP(key > UINT32_MAX || !vm_cursor_seek(vm, key));
+  }
 
-  If the sibling has more than 7 rows, we can safely take a row from it to give to the underfilled road. And 
-  then update the node's max key in the parent internal node.
+  VM_CASE(op_next, OP_NEXT) {
+    vm->cell_num += 1;
+    if (vm->cell_num < vm->num_cells) {
+      pc = instructions + pc->p4;
+      VM_DISPATCH();
+    }
+    uint32_t next_page_num = *leaf_node_next_leaf(vm->node);
+    if (next_page_num == 0) {
+      vm_cursor_release(vm);
+      VM_NEXT();
+    }
+    VM_JUMP(vm_cursor_move_to(vm, next_page_num, 0));
+  }
 
-  However, if the sibling has 7 rows, we insert the underfilled node's rows into the sibling. If, as a result 
-  of this merging, the parent internal node becomes underfilled, we check if the parent internal is the root or not.
-  If it is, then we can simply assign our new sibling node as the root. If it is not, then we insert the underfilled 
-  leaf node's rows into its sibling node. And then update the next leaf pointers for the sibling and the previous node.
-  We then delete the underfilled node from its parent.
-  */
-  
-  /* Fetch the underfilled internal node, its parent, its right child, and its index within its own parent.*/
-  
-  char* node = get_page(cursor->table->pager, cursor->page_num, tracker);
-  uint32_t node_max_key =get_node_max_key(cursor->table->pager, node);
-  char* parent = get_page(cursor->table->pager, *node_parent(node), tracker);
-  uint32_t index = internal_node_find_child(parent, get_node_max_key(cursor->table->pager, node));
-  
- /* Initialize the underfilled leaf node's sibling to an invalid page number and 
-  initialize sibling's index in the parent and its cell number to 0. */
-  
-  uint32_t sibling_page_num = INVALID_PAGE_NUM;
-  uint32_t sibling_index = 0;
-  uint32_t sibling_cell_num = 0;
+  VM_CASE(op_index_seek, OP_INDEX_SEEK) {
+    /* Entries are in value order, so every match follows the first entry >= the text */
+    IndexKey key = {r[pc->p2].text, strlen(r[pc->p2].text), 0};
+    if (pc->p3 == COMPARE_SUFFIX) {
+      index_key_reverse(&key, vm->index_value);
+    }
+    memmove(vm->index_value, key.value, key.length);
+    vm->index_length = key.length;
+    vm->index_prefix = pc->p3 != COMPARE_EQUAL;
+    vm->index_column = pc->p1;
+    vm->index_reverse = pc->p3 == COMPARE_SUFFIX;
+    uint32_t root = index_root_for(vm->table, pc->p1, pc->p3);
+    VM_JUMP(!index_cursor_seek(vm->table, &vm->index_cursor, root, &key) ||
+            !vm_index_row(vm));
+  }
 
-   /* Initialize the underfilled leaf node's sibling's index to the index of the node directly to the left of it if the underfilled laef node
-  is the right child of its parent. Otherwise, initialize  underfilled leaf node's sibling's index to the index of the node directly to 
-  the right of it.*/
-  
-  if (index == *internal_node_num_keys(parent)) {
-    sibling_index = index - 1;
+  VM_CASE(op_index_next, OP_INDEX_NEXT) {
+    VM_JUMP(index_cursor_advance(vm->table, &vm->index_cursor) && vm_index_row(vm));
   }
-  else {
-    sibling_index = index + 1;
+
+  VM_CASE(op_trigram_seek, OP_TRIGRAM_SEEK) {
+    /* Only candidates are visited; the contains predicate itself still checks each row */
+    memory_free(vm->candidates);
+    if (!trigram_candidates(vm->table, vm->table->trigram_index_roots[pc->p1], r[pc->p2].text,
+                            &vm->candidates, &vm->num_candidates)) {
+      return EXECUTE_OUT_OF_MEMORY;
+    }
+    vm->candidate_num = 0;
+    VM_JUMP(!vm_candidate_row(vm));
   }
-  sibling_page_num = *internal_node_child(parent, sibling_index);
 
-  char* sibling = get_page(cursor->table->pager, sibling_page_num, tracker);
-  uint32_t old_max_key = get_node_max_key(cursor->table->pager, sibling);
+  VM_CASE(op_trigram_next, OP_TRIGRAM_NEXT) {
+    vm->candidate_num++;
+    VM_JUMP(vm_candidate_row(vm));
+  }
 
-  /* If the underfilled leaf node's sibling has more than 7 rows, transfer a row from it to the underfilled leaf node. */
-  
-  if (*leaf_node_num_cells(sibling) > 7) {
-    Row* value = malloc(sizeof(Row));
+  VM_CASE(op_filter, OP_FILTER) {
+    VM_JUMP(!key_filter_may_contain(vm->table, r[pc->p1].integer, true));
+  }
 
-    /* If the underfilled leaf node's sibling is the child directly to the left of the underfilled leaf node, transfer the sibling's 
-    right child to the underfilled leaf node by setting the sibling cell number to the index of the sibling's right child. If not, transfer 
-    the sibling's first child to the underfilled leaf node by keeping the cull number as 0. */
-    
-    if (sibling_index == index - 1) {
-      sibling_cell_num = *leaf_node_num_cells(sibling) - 1;
+  VM_CASE(op_hash_probe, OP_HASH_PROBE) {
+    /* Probes read the row cache first and fill it from what they decode */
+    RowCache* cache = &vm->table->row_cache;
+    vm->row = &vm->probe_row;
+    if (!row_cache_get(cache, r[pc->p1].integer, &vm->probe_row)) {
+      if (hash_index_find(vm->table, r[pc->p1].integer, &vm->probe_row)) {
+        row_cache_put(cache, &vm->probe_row);
+      } else {
+        vm->row = NULL;
+      }
     }
+    VM_JUMP(vm->row == NULL);
+  }
 
-    uint32_t key = *leaf_node_key(sibling, sibling_cell_num);
-    deserialize_row(leaf_node_value(sibling, sibling_cell_num), value);
+  VM_CASE(op_id_probe, OP_ID_PROBE) {
+    RowCache* cache = &vm->table->row_cache;
+    vm->row = &vm->probe_row;
+    if (!row_cache_get(cache, r[pc->p1].integer, &vm->probe_row)) {
+      if (table_find_row(vm->table, r[pc->p1].integer, &vm->probe_row)) {
+        row_cache_put(cache, &vm->probe_row);
+      } else {
+        vm->row = NULL;
+      }
+    }
+    VM_JUMP(vm->row == NULL);
+  }
 
-    Cursor* alternate_cursor = leaf_node_find(cursor->table, cursor->page_num, key);
-    old_max_key = get_node_max_key(cursor->table->pager, node);
-    leaf_node_insert(alternate_cursor, key, value);
-    uint32_t new_max_key = get_node_max_key(cursor->table->pager, node);
-    
-    /* If the underfilled leaf node is the right child of its parent, then we must also update the its key in its own parent 
-    and so on if the parent is the right child of its own parent. */
-    
-    if (index == *internal_node_num_keys(parent) && !is_node_root(parent)) { 
-        uint32_t parent_page_num = *node_parent(node);
-        parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
-        while (*internal_node_right_child(parent) == parent_page_num && !is_node_root(parent)) {
-          parent_page_num = *node_parent(get_page(cursor->table->pager, parent_page_num, tracker));
-          parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
-        }
+  VM_CASE(op_multi_get, OP_MULTI_GET) {
+    /* The whole list is fetched in one descent up front, then walked like sorted rows */
+    SelectQuery* query = vm->query;
+    vm->fetched_rows = arena_alloc(&vm->table->pager->arena, sizeof(Row) * query->num_in_ids);
+    if (vm->fetched_rows == NULL) {
+      return EXECUTE_OUT_OF_MEMORY;
     }
+    vm->num_fetched_rows = table_find_rows(vm->table, vm->table->root_page_num,
+                                           query->in_ids, query->num_in_ids, vm->fetched_rows);
+    vm->fetched_row_num = 0;
+    vm->row = vm->num_fetched_rows ? &vm->fetched_rows[0] : NULL;
+    VM_JUMP(vm->row == NULL);
+  }
 
-    update_internal_node_key(parent, old_max_key, new_max_key);
+  VM_CASE(op_sample, OP_SAMPLE) {
+    vm->fetched_rows = arena_alloc(&vm->table->pager->arena, sizeof(Row) * vm->query->sample_size);
+    if (vm->fetched_rows == NULL) {
+      return EXECUTE_OUT_OF_MEMORY;
+    }
+    vm->num_fetched_rows = table_sample_rows(vm->table, vm->query->sample_size,
+                                             vm->fetched_rows, pc->p1);
+    vm->fetched_row_num = 0;
+    vm->row = vm->num_fetched_rows ? &vm->fetched_rows[0] : NULL;
+    VM_JUMP(vm->row == NULL);
+  }
 
-    Cursor* sibling_cursor = leaf_node_find(cursor->table, sibling_page_num, key);
-    
-    /* Delete the row that was transferred from the underfilled leaf node's sibling to the underfilled leaf node. */
-    
-    leaf_node_delete(sibling_cursor, key);
+  VM_CASE(op_fetched_next, OP_FETCHED_NEXT) {
+    vm->fetched_row_num++;
+    bool more = vm->fetched_row_num < vm->num_fetched_rows;
+    vm->row = more ? &vm->fetched_rows[vm->fetched_row_num] : NULL;
+    VM_JUMP(more);
+  }
 
-    free(value);
-    value = NULL;
+  VM_CASE(op_batch_scan, OP_BATCH_SCAN) {
+    vm->batch = table_scratch_batch(vm->table);
+    if (vm->batch == NULL) {
+      return EXECUTE_OUT_OF_MEMORY;
+    }
+    uint32_t columns = select_query_columns(vm->query) | COLUMN_BIT(COLUMN_ID);
+    batch_scan_open(&vm->batch_scan, vm->table, columns);
+    VM_JUMP(!batch_scan_next(&vm->batch_scan, vm->batch));
   }
-   /* If the underfilled leaf node's sibling has 7 rows, insert the underfilled leaf node's rows into the sibling. */ 
-    
-  else if (*leaf_node_num_cells(sibling) == 7) {
-    Row* value = malloc(sizeof(Row));
-    for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++) {
-      uint32_t key = *leaf_node_key(node, i);
-      deserialize_row(leaf_node_value(node, i), value);
-      Cursor* sibling_cursor = leaf_node_find(cursor->table, sibling_page_num, key);
-      leaf_node_insert(sibling_cursor, key, value);
+
+  VM_CASE(op_batch_next, OP_BATCH_NEXT) {
+    VM_JUMP(batch_scan_next(&vm->batch_scan, vm->batch));
+  }
+
+  VM_CASE(op_batch_filter, OP_BATCH_FILTER) {
+    batch_filter(vm->batch, vm->query);
+    VM_NEXT();
+  }
+
+  VM_CASE(op_batch_agg_step, OP_BATCH_AGG_STEP) {
+    aggregate_batch(vm->batch, &vm->aggregate);
+    VM_NEXT();
+  }
+
+  VM_CASE(op_batch_emit, OP_BATCH_EMIT) {
+    Batch* batch = vm->batch;
+    batch_select(batch);
+    for (uint32_t i = 0; i < batch->num_selected; i++) {
+      vm_batch_projections(vm->query, batch, batch->selection[i], &r[pc->p1]);
+      vm_emit(&r[pc->p1], pc->p2);
     }
+    VM_NEXT();
+  }
 
-    free(value);
-    value = NULL;
-    
-    /* If the underfilled leaf node's parent has only 1 key and is the root, set the underfilled leaf node's sibling as the root. */
-    
-    if (*internal_node_num_keys(parent) == 1 && is_node_root(parent)) {
-      memcpy(parent, sibling, PAGE_SIZE);
-      set_node_type(parent, NODE_LEAF);
-      set_node_root(parent, true);
-      *leaf_node_next_leaf(parent) = 0;
-      push_free_page(cursor->table->pager, sibling_page_num);
-      push_free_page(cursor->table->pager, cursor->page_num);
+  VM_CASE(op_view_read, OP_VIEW_READ) {
+    aggregate_view_read(vm->table, &vm->table->views[pc->p1], pc->p3 ? r[pc->p2].text : NULL,
+                        vm->query->has_group_by ? &vm->groups[0] : NULL, &vm->aggregate);
+    VM_NEXT();
+  }
+
+  VM_CASE(op_sketch_value, OP_SKETCH_VALUE) {
+    if (!vm->table->sketches.valid) {
+      sketches_rebuild(vm->table);
     }
-    else {
-      /* If the underfilled leaf node is the the right child of its own parent, we need to update the sibling's maximum key in its parent 
-      and so on if the parent is the right child of its parent. */
-      
-      if (index == *internal_node_num_keys(parent) && !is_node_root(parent)) {
-        uint32_t parent_page_num = *node_parent(node);
-        parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
-        while (*internal_node_right_child(parent) == parent_page_num && !is_node_root(parent)) {
-          parent_page_num = *node_parent(get_page(cursor->table->pager, parent_page_num, tracker));
-          parent = get_page(cursor->table->pager, *node_parent(parent), tracker);
-        }
-      }
-      uint32_t new_max_key = get_node_max_key(cursor->table->pager, sibling);
-      update_internal_node_key(parent, old_max_key, new_max_key);
-      parent = get_page(cursor->table->pager, *node_parent(node), tracker);
+    r[pc->p2].type = REGISTER_INTEGER;
+    r[pc->p2].integer = llround(sketch_estimate(vm->table->sketches.registers[pc->p1]));
+    VM_NEXT();
+  }
 
-      /* If the underfilled leaf node is the right child of its parent, set the next leaf pointer of the sibling to
-      point to the next leaf node pointed to by the underfilled leaf node. */
-      
-      if (index == *internal_node_num_keys(parent) ) {
-        *leaf_node_next_leaf(sibling) = *leaf_node_next_leaf(node);
-      }
-      else {
-        
-        /* If the underfilled leaf node was not the right child of its parent, set the next leaf pointer of the leaf node directly to the left of 
-        the underfilled leaf node to point to the sibling. */
-        
-        Cursor* prev_cursor = table_start(cursor->table);
-        char* prev_leaf_node = get_page(cursor->table->pager, prev_cursor->page_num, tracker);
-        while (*leaf_node_next_leaf(prev_leaf_node) != cursor->page_num && prev_cursor->page_num != cursor->page_num) {
-          prev_cursor->page_num = *leaf_node_next_leaf(prev_leaf_node);
-          prev_leaf_node = get_page(cursor->table->pager, prev_cursor->page_num, tracker);
-        }
-        if (prev_cursor->page_num != cursor->page_num) {
-          *leaf_node_next_leaf(prev_leaf_node) = sibling_page_num;
-        }
-      }
+  VM_CASE(op_column, OP_COLUMN) {
+    Register* target = &r[pc->p2];
+    if (pc->p1 == COLUMN_ID) {
+      target->type = REGISTER_INTEGER;
+      target->integer = vm->row ? vm->row->id : *leaf_node_key(vm->node, vm->cell_num);
+    } else if (vm->row) {
+      target->type = REGISTER_TEXT;
+      target->text = pc->p1 == COLUMN_USERNAME ? vm->row->username : vm->row->email;
+    } else {
+      target->type = REGISTER_TEXT;
+      target->text = leaf_node_value(vm->node, vm->cell_num) +
+                     (pc->p1 == COLUMN_USERNAME ? USERNAME_OFFSET : EMAIL_OFFSET);
+    }
+    VM_NEXT();
+  }
 
-      /* Delete the underfilled leaf node from its parent */
-      
-      internal_node_delete(cursor->table, *node_parent(node), cursor->page_num, index);
+  VM_CASE(op_domain, OP_DOMAIN) {
+    r[pc->p2].type = REGISTER_TEXT;
+    r[pc->p2].text = email_domain(r[pc->p1].text);
+    VM_NEXT();
+  }
+
+  VM_CASE(op_compare, OP_COMPARE) {
+    Register* a = &r[pc->p2];
+    Register* b = &r[pc->p3];
+    if (a->type == REGISTER_TEXT) {
+      VM_JUMP(!text_matches(a->text, pc->p1, b->text));
     }
+    int result = (a->integer > b->integer) - (a->integer < b->integer);
+    VM_JUMP(!compare_result_matches(result, pc->p1));
   }
-  unpin_all_pages(cursor->table->pager, tracker);
-}
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
+  VM_CASE(op_limit, OP_LIMIT) {
+    if (r[pc->p1].integer == 0) {
+      pc = instructions + pc->p4;
+      VM_DISPATCH();
+    }
+    r[pc->p1].integer -= 1;
+    VM_NEXT();
+  }
 
-  PinnedPages* tracker = init_pinned_pages();
+  VM_CASE(op_emit, OP_EMIT) {
+    vm_emit(&r[pc->p1], pc->p2);
+    VM_NEXT();
+  }
 
-  Row* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
+  VM_CASE(op_agg_step, OP_AGG_STEP) {
+    uint32_t id = r[pc->p1].integer;
+    vm->aggregate.count += 1;
+    vm->aggregate.sum += id;
+    vm->aggregate.min = id < vm->aggregate.min ? id : vm->aggregate.min;
+    vm->aggregate.max = id > vm->aggregate.max ? id : vm->aggregate.max;
+    VM_NEXT();
+  }
 
-  Cursor* cursor = table_find(table, key_to_insert);
-  char* node = get_page(table->pager, cursor->page_num, tracker);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+  VM_CASE(op_agg_value, OP_AGG_VALUE) {
+    AggregateState* state = pc->p3 ? &vm->group->state : &vm->aggregate;
+    vm_aggregate_value(pc->p1, state, &r[pc->p2]);
+    VM_NEXT();
+  }
 
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert) {
-      return EXECUTE_DUPLICATE_KEY;
+  VM_CASE(op_sorter_put, OP_SORTER_PUT) {
+    Row row;
+    if (vm->row) {
+      row = *vm->row;
+    } else {
+      char* value = leaf_node_value(vm->node, vm->cell_num);
+      row.id = *leaf_node_key(vm->node, vm->cell_num);
+      memcpy(row.username, value + USERNAME_OFFSET, USERNAME_SIZE);
+      memcpy(row.email, value + EMAIL_OFFSET, EMAIL_SIZE);
     }
+    if (!sorter_add(&vm->sorter, &row)) {
+      return EXECUTE_FAIL;
+    }
+    VM_NEXT();
   }
 
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+  VM_CASE(op_sorter_sort, OP_SORTER_SORT) {
+    if (!sorter_finish(&vm->sorter)) {
+      return EXECUTE_FAIL;
+    }
+    vm->row = sorter_next(&vm->sorter);
+    VM_JUMP(vm->row == NULL);
+  }
 
-  unpin_all_pages(cursor->table->pager, tracker);
-  free(cursor);
+  VM_CASE(op_sorter_next, OP_SORTER_NEXT) {
+    vm->row = sorter_next(&vm->sorter);
+    VM_JUMP(vm->row != NULL);
+  }
 
-  return EXECUTE_SUCCESS;
-}
+  VM_CASE(op_group_step, OP_GROUP_STEP) {
+    Register* key = &r[pc->p1];
+    uint32_t id = r[pc->p2].integer;
+    uint32_t integer_key = key->integer;
+    const char* key_bytes = (const char*)&integer_key;
+    uint32_t key_length = sizeof(integer_key);
+    if (key->type == REGISTER_TEXT) {
+      key_bytes = key->text;
+      key_length = strlen(key->text);
+    }
+    AggregateState state = {1, id, id, id};
+    hash_aggregate_add(&vm->groups[0], group_key_hash(key_bytes, key_length), key_bytes,
+                       key_length, &state);
+    VM_NEXT();
+  }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Cursor* cursor = table_start(table);
+  VM_CASE(op_group_parallel, OP_GROUP_PARALLEL) {
+    if (!group_parallel_aggregate(vm->table, vm->query, vm->groups,
+                                  program->num_group_tables)) {
+      return EXECUTE_OUT_OF_MEMORY;
+    }
+    VM_NEXT();
+  }
 
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+  VM_CASE(op_group_rewind, OP_GROUP_REWIND) {
+    group_iterator_open(&vm->group_iterator, vm->groups, program->num_group_tables);
+    vm->group = group_iterator_next(&vm->group_iterator, &vm->group_table);
+    if (vm->group_iterator.failed) {
+      return EXECUTE_FAIL;
+    }
+    VM_JUMP(vm->group == NULL);
   }
 
-  free(cursor);
+  VM_CASE(op_group_next, OP_GROUP_NEXT) {
+    vm->group = group_iterator_next(&vm->group_iterator, &vm->group_table);
+    if (vm->group_iterator.failed) {
+      return EXECUTE_FAIL;
+    }
+    VM_JUMP(vm->group != NULL);
+  }
 
-  return EXECUTE_SUCCESS;
-}
+  VM_CASE(op_group_key, OP_GROUP_KEY) {
+    const char* key = vm->group_table->keys + vm->group->key_offset;
+    if (pc->p2) {
+      uint32_t id;
+      memcpy(&id, key, sizeof(id));
+      r[pc->p1].type = REGISTER_INTEGER;
+      r[pc->p1].integer = id;
+    } else {
+      r[pc->p1].type = REGISTER_TEXT;
+      r[pc->p1].text = key;
+    }
+    VM_NEXT();
+  }
 
-ExecuteResult execute_delete(Statement* statement, Table* table) {
+  VM_CASE(op_insert, OP_INSERT) {
+    vm->result = table_insert(vm->table, r[pc->p1].integer, (char*)r[pc->p1 + 1].text);
+    VM_NEXT();
+  }
 
-  PinnedPages* tracker = init_pinned_pages();
+  VM_CASE(op_delete, OP_DELETE) {
+    vm->result = table_delete(vm->table, r[pc->p1].integer);
+    VM_NEXT();
+  }
 
-  uint32_t key_to_delete = statement->delete_id;
+#ifndef VM_THREADED_DISPATCH
+  }
+#endif
+  return EXECUTE_FAIL;
+}
 
-  Cursor* cursor = table_find(table, key_to_delete);
-  char* node = get_page(table->pager, cursor->page_num, tracker);
+ExecuteResult vm_execute(Program* program, Statement* statement, Table* table,
+                         QueryPlan* plan) {
+  Vm vm;
+  vm.table = table;
+  vm.query = &statement->select;
+  vm.tracker = NULL;
+  vm.node = NULL;
+  vm.row = NULL;
+  vm.index_cursor.tracker = NULL;
+  vm.index_cursor.node = NULL;
+  vm.index_only = program->index_only;
+  vm.candidates = NULL;
+  vm.num_candidates = 0;
+  vm.fetched_rows = NULL;
+  vm.batch = NULL;
+  vm.group_iterator.depth = 0;
+  vm.result = EXECUTE_SUCCESS;
+  aggregate_init(&vm.aggregate);
+  bind_parameters(statement, vm.registers);
+
+  if (program->uses_sorter &&
+      !sorter_open(&vm.sorter, vm.query, table->settings.sort_memory)) {
+    return EXECUTE_OUT_OF_MEMORY;
+  }
+  uint32_t num_groups = 0;
+  uint32_t group_memory = table->settings.group_memory /
+                          (program->num_group_tables ? program->num_group_tables : 1);
+  for (; num_groups < program->num_group_tables; num_groups++) {
+    if (!hash_aggregate_init(&vm.groups[num_groups], group_memory, 0,
+                             plan->group_capacity)) {
+      break;
+    }
+  }
 
-  uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+  ExecuteResult result = EXECUTE_OUT_OF_MEMORY;
+  if (num_groups == program->num_group_tables) {
+    result = vm_run(program, &vm);
+  }
 
-  if (key_at_index != key_to_delete) {
-    return EXECUTE_KEY_NOT_FOUND;
+  vm_cursor_release(&vm);
+  index_cursor_release(table, &vm.index_cursor);
+  memory_free(vm.candidates);
+  group_iterator_close(&vm.group_iterator);
+  for (uint32_t i = 0; i < num_groups; i++) {
+    hash_aggregate_free(&vm.groups[i]);
   }
-  leaf_node_delete(cursor, key_to_delete);
+  if (program->uses_sorter) {
+    sorter_close(&vm.sorter);
+  }
+  return result;
+}
 
-  unpin_all_pages(table->pager, tracker);
+const char* opcode_names[NUM_OPCODES] = {
+    "HALT",        "REWIND",     "SEEK_GE",        "SEEK_GT",       "NEXT",
+    "INDEX_SEEK",  "INDEX_NEXT", "TRIGRAM_SEEK",   "TRIGRAM_NEXT",  "FILTER",
+    "HASH_PROBE",  "ID_PROBE",   "MULTI_GET",      "FETCHED_NEXT", "SAMPLE",
+    "BATCH_SCAN",  "BATCH_NEXT", "BATCH_FILTER",   "BATCH_AGG_STEP", "BATCH_EMIT",
+    "VIEW_READ",   "SKETCH_VALUE",
+    "COLUMN",      "DOMAIN",     "COMPARE",        "LIMIT",         "EMIT",
+    "AGG_STEP",    "AGG_VALUE",  "SORTER_PUT",     "SORTER_SORT",   "SORTER_NEXT",
+    "GROUP_STEP",  "GROUP_PARALLEL", "GROUP_REWIND", "GROUP_NEXT",  "GROUP_KEY",
+    "INSERT",      "DELETE",
+};
+
+const char* compare_op_symbols[] = {"=",  "!=",     "<",      "<=",
+                                    ">",  ">=",     "prefix", "suffix",
+                                    "contains", "in"};
+const char* column_names[] = {"id", "username", "email"};
+
+void print_plan(Statement* statement, QueryPlan* plan, Table* table) {
+  if (statement->type != STATEMENT_SELECT) {
+    printf("plan: %s by id\n", statement->type == STATEMENT_INSERT ? "insert" : "delete");
+    return;
+  }
+  SelectQuery* query = &statement->select;
+  if (plan->access_path == ACCESS_ID_SEEK) {
+    Predicate* predicate = &query->predicates[plan->seek_predicate];
+    printf("plan: seek id %s %u", compare_op_symbols[predicate->op], predicate->integer);
+  } else if (plan->access_path == ACCESS_INDEX_SEEK) {
+    Predicate* predicate = &query->predicates[plan->seek_predicate];
+    printf("plan: %sindex %son %s %s %s", predicate->op == COMPARE_SUFFIX ? "reverse " : "",
+           plan->index_only ? "only " : "", column_names[predicate->column], compare_op_symbols[predicate->op],
+           predicate->text);
+  } else if (plan->access_path == ACCESS_TRIGRAM_SCAN) {
+    Predicate* predicate = &query->predicates[plan->seek_predicate];
+    printf("plan: trigram index on %s contains %s", column_names[predicate->column],
+           predicate->text);
+  } else if (plan->access_path == ACCESS_ID_PROBE) {
+    printf("plan: probe id = %u", query->predicates[plan->seek_predicate].integer);
+  } else if (plan->access_path == ACCESS_MULTI_GET) {
+    printf("plan: multi-get %u ids", query->num_in_ids);
+  } else if (plan->access_path == ACCESS_SAMPLE) {
+    printf(plan->sample_scan ? "plan: sample %u rows by reservoir over a full scan"
+                             : "plan: sample %u rows by random descents, full scan if they "
+                               "keep repeating rows",
+           query->sample_size);
+  } else if (plan->access_path == ACCESS_SKETCH) {
+    printf("plan: distinct count sketches, %.1f%% standard error",
+           100 * 1.04 / sqrt(SKETCH_REGISTERS));
+  } else if (plan->access_path == ACCESS_VIEW) {
+    AggregateView* view = &table->views[plan->view];
+    printf(view->function == FUNCTION_DOMAIN ? "plan: aggregate view on domain(%s)"
+                                             : "plan: aggregate view on %s",
+           column_names[view->column]);
+    if (plan->seek_predicate >= 0) {
+      printf(" = %s", query->predicates[plan->seek_predicate].text);
+    }
+  } else if (plan->access_path == ACCESS_HASH_PROBE) {
+    printf("plan: hash probe id = %u", query->predicates[plan->seek_predicate].integer);
+  } else {
+    printf("plan: full scan");
+  }
+  if (plan->has_estimates) {
+    printf(", ~%.0f of %u rows read, ~%.0f match", plan->scanned_rows,
+           table->stats.num_rows, plan->result_rows);
+  }
+  printf("\n");
+  if (query->has_group_by) {
+    printf("group by: %u worker%s, %u slots\n", plan->num_workers,
+           plan->num_workers == 1 ? "" : "s", plan->group_capacity);
+  }
+}
 
-  return EXECUTE_SUCCESS;
+void print_program(Program* program) {
+  for (uint32_t i = 0; i < program->num_instructions; i++) {
+    Instruction* instruction = &program->instructions[i];
+    printf("%3u %-15s %3u %3u %3u %3d\n", i, opcode_names[instruction->opcode],
+           instruction->p1, instruction->p2, instruction->p3, instruction->p4);
+  }
 }
 
-ExecuteResult execute_statement(Statement* statement, Table* table) {
+ExecuteResult run_statement(Statement* statement, Table* table) {
   switch (statement->type) {
+    case (STATEMENT_PREPARE):
+      return execute_prepare(statement, table);
+    case (STATEMENT_EXECUTE):
+      return execute_prepared(statement->prepared, table);
+    case (STATEMENT_CREATE_INDEX):
+      return execute_create_index(statement, table);
+    case (STATEMENT_CREATE_VIEW):
+      return execute_create_view(statement, table);
+    default:
+      break;
+  }
+  QueryPlan plan;
+  plan_statement(statement, table, &plan);
+  Program* program = program_cache_lookup(table, statement, &plan);
+  if (program == NULL) {
+    return EXECUTE_FAIL;
+  }
+  if (statement->explain) {
+    print_plan(statement, &plan, table);
+    print_program(program);
+    return EXECUTE_SUCCESS;
+  }
+  return vm_execute(program, statement, table, &plan);
+}
+
+/* Run statement, counting it and sometimes timing it if it is an insert, select or delete */
+ExecuteResult execute_statement(Statement* statement, Table* table) {
+  StatementType type =
+      statement->type == STATEMENT_EXECUTE ? statement->prepared->type : statement->type;
+  LatencyKind kind;
+  switch (type) {
     case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
+      kind = LATENCY_INSERT;
+      break;
     case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+      kind = LATENCY_SELECT;
+      break;
     case (STATEMENT_DELETE):
-      return execute_delete(statement, table);
-    }
-  return EXECUTE_FAIL;
+      kind = LATENCY_DELETE;
+      break;
+    default:
+      return run_statement(statement, table);
+  }
+  if (statement->explain) {
+    return run_statement(statement, table);
+  }
+  LatencyHistogram* histogram = &table->latency[kind];
+  uint64_t start = latency_start(histogram, histogram->calls % LATENCY_SAMPLE_RATE == 0);
+  ExecuteResult result = run_statement(statement, table);
+  latency_record(histogram, start);
+  return result;
 }
 
 int main(int argc, char* argv[]) {
@@ -1853,6 +8951,7 @@ int main(int argc, char* argv[]) {
 
   InputBuffer* input_buffer = new_input_buffer();
   while (true) {
+    pager_end_statement(table->pager);
     print_prompt();
     read_input(input_buffer);
 
@@ -1867,12 +8966,15 @@ int main(int argc, char* argv[]) {
     }
 
     Statement statement;
-    switch (prepare_statement(input_buffer, &statement)) {
+    switch (prepare_statement(input_buffer, &statement, table)) {
       case (PREPARE_SUCCESS):
         break;
       case (PREPARE_NEGATIVE_ID):
         printf("ID must be positive.\n");
         continue;
+      case (PREPARE_ID_TOO_LARGE):
+        printf("ID is too large.\n");
+        continue;
       case (PREPARE_STRING_TOO_LONG):
         printf("String is too long.\n");
         continue;
@@ -1883,6 +8985,9 @@ int main(int argc, char* argv[]) {
         printf("Unrecognized keyword at start of '%s'.\n",
                input_buffer->buffer);
         continue;
+      case (PREPARE_UNKNOWN_PREPARED_STATEMENT):
+        printf("Unknown prepared statement.\n");
+        continue;
     }
 
     switch (execute_statement(&statement, table)) {
@@ -1895,6 +9000,18 @@ int main(int argc, char* argv[]) {
       case (EXECUTE_KEY_NOT_FOUND):
         printf("Error: Key not found.\n");
         break;
+      case (EXECUTE_INDEX_EXISTS):
+        printf("Error: Index already exists.\n");
+        break;
+      case (EXECUTE_VIEW_EXISTS):
+        printf("Error: View already exists.\n");
+        break;
+      case (EXECUTE_OUT_OF_MEMORY):
+        printf("Error: Out of memory.\n");
+        break;
+      case (EXECUTE_TOO_MANY_PREPARED_STATEMENTS):
+        printf("Error: Too many prepared statements.\n");
+        break;
       case(EXECUTE_FAIL):
         printf("Error: Failed to execute.\n");
         break;
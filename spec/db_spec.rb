@@ -774,4 +774,1017 @@ describe 'database' do
       "db > ",
     ])
   end
-end
\ No newline at end of file
+
+  it 'executes a prepared insert with bound parameters' do
+    script = [
+      "prepare add insert ? ? ?",
+      "execute add 1 user1 person1@example.com",
+      "execute add 2 user2 person2@example.com",
+      "execute add 2 user2 person2@example.com",
+      "prepare remove delete ?",
+      "execute remove 1",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'validates values bound to a prepared statement' do
+    script = [
+      "prepare add insert ? bob ?",
+      "execute add -1 bob@example.com",
+      "execute add 1 #{"a"*256}",
+      "execute add 1",
+      "execute missing 1",
+      "execute add 1 bob@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > ID must be positive.",
+      "db > String is too long.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Unknown prepared statement.",
+      "db > Executed.",
+      "db > (1, bob, bob@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'refuses a prepared statement past the last free slot' do
+    script = (1..17).map { |i| "prepare add#{i} insert ? ? ?" }
+    script += [
+      "prepare add1 delete ?",
+      "execute add1 1",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result.drop(16)).to eq([
+      "db > Error: Too many prepared statements.",
+      "db > Executed.",
+      "db > Error: Key not found.",
+      "db > ",
+    ])
+  end
+
+  it 'allows quoted strings containing spaces' do
+    script = [
+      "insert 1 'john smith' \"john smith@example.com\"",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > (1, john smith, john smith@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'rejects ids that overflow and malformed statements' do
+    script = [
+      "insert 99999999999 user1 person1@example.com",
+      "insert 2147483648 user1 person1@example.com",
+      "insert abc user1 person1@example.com",
+      "insert 1 user1 person1@example.com extra",
+      "insert 1 'user1 person1@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > ID is too large.",
+      "db > ID is too large.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'benchmarks statement parsing' do
+    result = run_script([
+      ".bench parse 1000",
+      ".exit",
+    ])
+    expect(result[0]).to match(/^db > parse: 4000 statements, [0-9.]+ ns\/statement$/)
+  end
+
+  it 'filters, projects and limits selected rows' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select id, username where id > 10 and id <= 13"
+    script << "select email where username = user20"
+    script << "select where id >= 25 limit 2"
+    script << "select id where id < -1"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[30...(result.length)]).to match_array([
+      "db > (11, user11)",
+      "(12, user12)",
+      "(13, user13)",
+      "Executed.",
+      "db > (person20@example.com)",
+      "Executed.",
+      "db > (25, user25, person25@example.com)",
+      "(26, user26, person26@example.com)",
+      "Executed.",
+      "db > ID must be positive.",
+      "db > ",
+    ])
+  end
+
+  it 'computes aggregates over a batch scan' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select count(*), sum(id), min(id), max(id)"
+    script << "select count(*) where id > 20"
+    script << "select max(id) where id > 100"
+    script << "select id, count(*)"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[30...(result.length)]).to match_array([
+      "db > (30, 465, 1, 30)",
+      "Executed.",
+      "db > (10)",
+      "Executed.",
+      "db > (NULL)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'orders rows by a non-key column with and without a limit' do
+    script = [
+      "insert 1 carol carol@example.com",
+      "insert 2 alice zed@example.com",
+      "insert 3 bob alice@example.com",
+      "insert 4 alice amy@example.com",
+      "select order by username limit 2",
+      "select id, email order by email desc",
+      "select id order by username desc limit 0",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[4...(result.length)]).to match_array([
+      "db > (2, alice, zed@example.com)",
+      "(4, alice, amy@example.com)",
+      "Executed.",
+      "db > (2, zed@example.com)",
+      "(1, carol@example.com)",
+      "(4, amy@example.com)",
+      "(3, alice@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'spills sort runs to disk under a small memory budget' do
+    script = (1..60).map do |i|
+      "insert #{i} user#{i} person#{(61 - i).to_s.rjust(2, '0')}@example.com"
+    end
+    script << ".set sort_memory 100"
+    script << ".set sort_memory 8192"
+    script << "select id order by email"
+    script << ".exit"
+    result = run_script(script)
+    expected = ["db > sort_memory must be at least 8192 bytes."]
+    expected << "db > db > (60)"
+    (59).downto(1).each { |i| expected << "(#{i})" }
+    expected << "Executed."
+    expected << "db > "
+    expect(result[60...(result.length)]).to eq(expected)
+  end
+
+  it 'groups rows by username and by email domain' do
+    script = [
+      "insert 1 alice alice@example.com",
+      "insert 2 bob bob@test.org",
+      "insert 3 alice alice@test.org",
+      "insert 4 carol carol@example.com",
+      "insert 5 alice alice@other.net",
+      "select username, count(*), max(id) group by username",
+      "select domain(email), count(*) where id > 1 group by domain(email)",
+      "select email, count(*) group by username",
+      ".exit",
+    ]
+    # Groups come out in hash table order, so compare them without prompts
+    result = run_script(script).map { |line| line.sub(/^(db > )+/, '') }
+    expect(result[5...(result.length)]).to match_array([
+      "(alice, 3, 5)",
+      "(bob, 1, 2)",
+      "(carol, 1, 4)",
+      "Executed.",
+      "(test.org, 2)",
+      "(example.com, 1)",
+      "(other.net, 1)",
+      "Executed.",
+      "Syntax error. Could not parse statement.",
+      "",
+    ])
+  end
+
+  it 'spills group partitions and merges worker tables' do
+    script = (1..90).map do |i|
+      "insert #{i} user#{i} person#{i}@example#{i % 2}.com"
+    end
+    script << ".set group_memory 8192"
+    script << ".set group_threads 3"
+    script << "select username, count(*) group by username"
+    script << "select domain(email), count(*), sum(id) group by domain(email)"
+    script << ".exit"
+    result = run_script(script).map { |line| line.sub(/^(db > )+/, '') }
+    expected = (1..90).map { |i| "(user#{i}, 1)" }
+    expected += ["Executed.", "(example0.com, 45, 2070)", "(example1.com, 45, 2025)",
+                 "Executed.", ""]
+    expect(result[90...(result.length)]).to match_array(expected)
+  end
+
+  it 'runs full scans as cached batch programs' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i % 3} person#{i}@example.com"
+    end
+    script += [
+      "select count(*), sum(id), min(id), max(id) where username = user1",
+      "select count(*), sum(id), min(id), max(id) where username = user9",
+      "select id, domain(email) where email = person17@example.com",
+      "select id where username = user2 limit 2",
+      "explain select count(*) where username = user2",
+      "explain select id where username = user2",
+      ".stats programs",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result.drop(30)).to eq([
+      "db > (10, 145, 1, 28)",
+      "Executed.",
+      "db > (0, 0, NULL, NULL)",
+      "Executed.",
+      "db > (17, example.com)",
+      "Executed.",
+      "db > (2)",
+      "(5)",
+      "Executed.",
+      "db > plan: full scan",
+      "  0 BATCH_SCAN        0   0   0   4",
+      "  1 BATCH_FILTER      0   0   0   0",
+      "  2 BATCH_AGG_STEP    0   0   0   0",
+      "  3 BATCH_NEXT        0   0   0   1",
+      "  4 AGG_VALUE         1   5   0   0",
+      "  5 EMIT              5   1   0   0",
+      "  6 HALT              0   0   0   0",
+      "Executed.",
+      "db > plan: full scan",
+      "  0 BATCH_SCAN        0   0   0   4",
+      "  1 BATCH_FILTER      0   0   0   0",
+      "  2 BATCH_EMIT        5   1   0   0",
+      "  3 BATCH_NEXT        0   0   0   1",
+      "  4 HALT              0   0   0   0",
+      "Executed.",
+      "db > programs: 6 of 16 cached, 30 hits, 6 misses",
+      "db > ",
+    ])
+  end
+
+  it 'collects statistics and explains query plans' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i % 3} person#{i}@example.com"
+    end
+    script << "explain select id where id > 20"
+    script << ".analyze"
+    script << "explain select username, count(*) where id > 20 and username = user1 group by username"
+    script << "explain select where email = x"
+    script << ".exit"
+    result = run_script(script)
+    plan = result.select { |line| line =~ /plan:|rows:|distinct:|group by:/ }
+    expect(plan).to match_array([
+      "db > plan: seek id > 20",
+      "db > rows: 30, leaves: 4, id: 1 .. 30",
+      "distinct: username ~3, email ~30, domain ~1",
+      "db > plan: seek id > 20, ~9 of 30 rows read, ~3 match",
+      "group by: 1 worker, 64 slots",
+      "db > plan: full scan, ~30 of 30 rows read, ~1 match",
+    ])
+  end
+
+  it 'costs index seeks against a full scan once statistics exist' do
+    script = (1..40).map do |i|
+      "insert #{i} user#{i % 2} person#{i}@example.com"
+    end
+    script += [
+      "create index on username",
+      "create index on email",
+      "explain select where username = user1",
+      ".analyze",
+      "explain select where username = user1",
+      "explain select id where username = user1",
+      "explain select where email = person7@example.com",
+      ".exit",
+    ]
+    result = run_script(script)
+    plan = result.select { |line| line =~ /plan:/ }
+    expect(plan).to eq([
+      "db > plan: index on username = user1",
+      "db > plan: full scan, ~40 of 40 rows read, ~20 match",
+      "db > plan: index only on username = user1, ~20 of 40 rows read, ~20 match",
+      "db > plan: index on email = person7@example.com, ~1 of 40 rows read, ~1 match",
+    ])
+  end
+
+  it 'maintains and looks up secondary indexes' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i % 3} person#{i}@example.com"
+    end
+    script += [
+      "create index on email",
+      "create index on email",
+      "create index on id",
+      "explain select where email = person7@example.com",
+      "select where email = person7@example.com",
+      "delete 7",
+      "insert 31 late person7@example.com",
+      "select id where email = person7@example.com",
+      "explain select where email = person7@example.com and id = 3",
+      ".exit",
+    ]
+    result = run_script(script)
+    output = result.drop(30).reject { |line| line =~ /^ +\d+ [A-Z_]+ / }
+    expect(output).to eq([
+      "db > Executed.",
+      "db > Error: Index already exists.",
+      "db > Syntax error. Could not parse statement.",
+      "db > plan: index on email = person7@example.com",
+      "Executed.",
+      "db > (7, user1, person7@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (31)",
+      "Executed.",
+      "db > plan: probe id = 3",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'probes a hash index on id for point lookups' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i % 3} person#{i}@example.com"
+    end
+    script += [
+      "create hash index on id",
+      "create hash index on email",
+      "explain select where id = 5",
+      "select where id = 5",
+      "insert 5 again again@example.com",
+      "delete 5",
+      "delete 5",
+      "select where id = 5",
+      "select count(*) where id > 0",
+      ".exit",
+    ]
+    result = run_script(script)
+    output = result.drop(30).reject { |line| line =~ /^ +\d+ [A-Z_]+ / }
+    expect(output).to eq([
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > plan: hash probe id = 5",
+      "Executed.",
+      "db > (5, user2, person5@example.com)",
+      "Executed.",
+      "db > Error: Duplicate key.",
+      "db > Executed.",
+      "db > Error: Key not found.",
+      "db > Executed.",
+      "db > (29)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'chains overflow pages to a hash bucket that cannot split' do
+    # The same finalizer as hash_id in db.c; a bucket page holds 510 entries
+    hash_id = lambda do |id|
+      id ^= id >> 16
+      id = (id * 0x85ebca6b) & 0xffffffff
+      id ^= id >> 13
+      id = (id * 0xc2b2ae35) & 0xffffffff
+      id ^ (id >> 16)
+    end
+    ids = (1..Float::INFINITY).lazy.select { |i| hash_id.call(i) & 511 == 7 }.first(520)
+    script = ids.first(300).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "create hash index on id"
+    script += ids.drop(300).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ids.first(100).select.with_index { |_, n| n.even? }.map { |i| "delete #{i}" }
+    script += [
+      "insert #{ids[519]} again again@example.com",
+      "select where id = #{ids[519]}",
+      "select where id = #{ids[101]}",
+      "delete #{ids[518]}",
+      "select where id = #{ids[518]}",
+      "select count(*)",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result.drop(571)).to eq([
+      "db > Error: Duplicate key.",
+      "db > (#{ids[519]}, user#{ids[519]}, person#{ids[519]}@example.com)",
+      "Executed.",
+      "db > (#{ids[101]}, user#{ids[101]}, person#{ids[101]}@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (469)",
+      "Executed.",
+      "db > ",
+    ])
+    expect(result.first(571).uniq).to eq(["db > Executed."])
+
+    result = run_script(["select where id = #{ids[517]}", ".exit"])
+    expect(result).to eq([
+      "db > (#{ids[517]}, user#{ids[517]}, person#{ids[517]}@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'answers lookups of missing ids from the key filter' do
+    script = (1..20).map do |i|
+      "insert #{i * 2} user#{i} person#{i}@example.com"
+    end
+    script += (1..8).map { |i| "delete #{i * 4}" }
+    script += [
+      "delete 3",
+      "delete 8",
+      "insert 8 back back@example.com",
+      "select where id = 8",
+      "select where id = 12",
+      "select where id = 13",
+      "select where id = 14",
+      "select count(*) where id > 0",
+      "explain select where id = 13",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result.drop(28).take(12)).to eq([
+      "db > Error: Key not found.",
+      "db > Error: Key not found.",
+      "db > Executed.",
+      "db > (8, back, back@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (14, user7, person7@example.com)",
+      "Executed.",
+      "db > (13)",
+      "Executed.",
+      "db > plan: probe id = 13",
+    ])
+    expect(result[40]).to match(/^ +0 FILTER /)
+  end
+
+  it 'keeps the key filter in the file across a reopen' do
+    script = (1..20).map do |i|
+      "insert #{i * 2} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "select id where id = 8",
+      "select id where id = 9",
+      "insert 9 nine nine@example.com",
+      "delete 4",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (8)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+
+    result = run_script([
+      "select id where id = 9",
+      "select id where id = 4",
+      "select count(*)",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (9)",
+      "Executed.",
+      "db > Executed.",
+      "db > (20)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps the hash index on id when the saved key filter is loaded' do
+    script = ["create hash index on id"]
+    script += (1..20).map { |i| "insert #{i * 2} user#{i} person#{i}@example.com" }
+    script << ".exit"
+    run_script(script)
+    run_script(["select id where id = 8", ".exit"])
+
+    result = run_script(["explain select where id = 8", "select id where id = 9", ".exit"])
+    expect(result.first).to eq("db > plan: hash probe id = 8")
+    expect(result.last(2)).to eq(["db > Executed.", "db > "])
+  end
+
+  it 'searches emails by prefix and suffix' do
+    script = [
+      "insert 1 alice alice@example.com",
+      "insert 2 albert al@test.org",
+      "insert 3 bob bob@example.com",
+      "insert 4 abby abby@mail.example.com",
+      "select id where email prefix 'al'",
+      "create index on email",
+      "create reverse index on email",
+      "select id where email prefix 'al' limit 1",
+      "select id where email suffix 'example.com'",
+      "explain select where email suffix '.org'",
+      "select where id prefix '1'",
+      ".exit",
+    ]
+    result = run_script(script)
+    output = result.drop(4).reject { |line| line =~ /^ +\d+ [A-Z_]+ / }
+    expect(output).to eq([
+      "db > (1)",
+      "(2)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (2)",
+      "Executed.",
+      "db > (4)",
+      "(3)",
+      "(1)",
+      "Executed.",
+      "db > plan: reverse index on email suffix .org",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'finds substrings with like and a trigram index' do
+    script = [
+      "insert 1 alice alice@example.com",
+      "insert 2 albert al@test.org",
+      "insert 3 bob bob@example.com",
+      "insert 4 mallory mallory@alice.net",
+      "select id where email like '%lice%'",
+      "create trigram index on email",
+      "explain select id where email like '%lice%'",
+      "select id where email like '%lice%'",
+      "select id where email like '%e.o%'",
+      "select id where email like 'bob%'",
+      "delete 1",
+      "insert 5 carol carol@slice.io",
+      "select id where email like '%lice%'",
+      "select id where email like '%li%ce%'",
+      ".exit",
+    ]
+    result = run_script(script)
+    output = result.drop(4).reject { |line| line =~ /^ +\d+ [A-Z_]+ / }
+    expect(output).to eq([
+      "db > (1)",
+      "(4)",
+      "Executed.",
+      "db > Executed.",
+      "db > plan: trigram index on email contains lice",
+      "Executed.",
+      "db > (1)",
+      "(4)",
+      "Executed.",
+      "db > Executed.",
+      "db > (3)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (4)",
+      "(5)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'serves repeated id lookups from the row cache' do
+    script = [
+      ".set row_cache 4",
+      "insert 1 alice alice@example.com",
+      "insert 2 bob bob@example.com",
+      "select where id = 1",
+      "select where id = 1",
+      "delete 1",
+      "insert 1 carol carol@example.com",
+      "select where id = 1",
+      "select where id = 1",
+      ".stats cache",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result.drop(4)).to eq([
+      "db > (1, alice, alice@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, carol, carol@example.com)",
+      "Executed.",
+      "db > (1, carol, carol@example.com)",
+      "Executed.",
+      "db > row cache: 4 slots, 2 hits, 2 misses, 50.0% hit rate",
+      "db > ",
+    ])
+  end
+
+  it 'fetches a list of ids in one batch' do
+    script = (1..20).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      "select id, username where id in (15, 3, 99, 3, 7)",
+      "select id where id in (1, 2, 3) and username != user2",
+      "explain select where id in (4, 5)",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result.drop(20)).to eq([
+      "db > (3, user3)",
+      "(7, user7)",
+      "(15, user15)",
+      "Executed.",
+      "db > (1)",
+      "(3)",
+      "Executed.",
+      "db > plan: multi-get 2 ids",
+      "  0 MULTI_GET         0   0   0   6",
+      "  1 COLUMN            0   5   0   0",
+      "  2 COLUMN            1   6   0   0",
+      "  3 COLUMN            2   7   0   0",
+      "  4 EMIT              5   3   0   0",
+      "  5 FETCHED_NEXT      0   0   0   1",
+      "  6 HALT              0   0   0   0",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'benchmarks point lookups one at a time and interleaved' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      ".bench lookups 1000",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[30]).to match(
+      /^db > lookups: 1000 ids, 1000 found, [0-9.]+ ns\/lookup one at a time, [0-9.]+ ns\/lookup interleaved$/
+    )
+  end
+
+  it 'gives back the arena memory of each point lookup' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      ".bench lookups 20000",
+      ".memory",
+      ".exit",
+    ]
+    result = run_script(script)
+    arena = result.select { |line| line.start_with?("  arena:") }
+    expect(arena).to eq(["  arena: 65560 bytes, peak 65560"])
+  end
+
+  it 'answers queries on id and an indexed column from the index alone' do
+    script = [
+      "insert 1 alice alice@example.com",
+      "insert 2 albert al@test.org",
+      "insert 3 bob bob@example.com",
+      "create index on email",
+      "create reverse index on email",
+      "select id, email where email prefix 'al'",
+      "select email where email suffix 'example.com'",
+      "explain select id where email suffix 'example.com'",
+      "explain select username where email = bob@example.com",
+      ".exit",
+    ]
+    result = run_script(script)
+    output = result.drop(5).reject { |line| line =~ /^ +\d+ [A-Z_]+ / }
+    expect(output).to eq([
+      "db > (2, al@test.org)",
+      "(1, alice@example.com)",
+      "Executed.",
+      "db > (bob@example.com)",
+      "(alice@example.com)",
+      "Executed.",
+      "db > plan: reverse index only on email suffix example.com",
+      "Executed.",
+      "db > plan: index on email = bob@example.com",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps aggregate views up to date across writes' do
+    script = [
+      "insert 1 alice alice@example.com",
+      "insert 2 bob bob@test.org",
+      "insert 3 carol carol@example.com",
+      "create aggregate view on domain(email)",
+      "create aggregate view on username",
+      "create aggregate view on username",
+      "insert 4 alice alice@mail.org",
+      "delete 1",
+      "select domain(email), count(*), min(id), max(id) group by domain(email)",
+      "select count(*), sum(id) where username = alice",
+      "explain select count(*) where username = alice",
+      ".exit",
+    ]
+    result = run_script(script)
+    output = result.drop(5).reject { |line| line =~ /^ +\d+ [A-Z_]+ / }
+    expect(output).to match_array([
+      "db > Error: View already exists.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (mail.org, 1, 4, 4)",
+      "(example.com, 1, 3, 3)",
+      "(test.org, 1, 2, 2)",
+      "Executed.",
+      "db > (1, 4)",
+      "Executed.",
+      "db > plan: aggregate view on username = alice",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'estimates distinct counts from sketches kept by inserts' do
+    script = (1..30).map { |i| "insert #{i} user#{i % 5} person#{i}@host#{i % 3}.com" }
+    script += [
+      "select approx_count_distinct(username), approx_count_distinct(domain(email))",
+      "select approx_count_distinct(username) where id > 3",
+      "explain select approx_count_distinct(email)",
+      ".rebuild sketches",
+      ".exit",
+    ]
+    result = run_script(script)
+    output = result.drop(30).reject { |line| line =~ /^ +\d+ [A-Z_]+ / }
+    expect(output).to eq([
+      "db > (5, 3)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > plan: distinct count sketches, 3.2% standard error",
+      "Executed.",
+      "db > sketches: rebuilt from 30 rows",
+      "db > ",
+    ])
+  end
+
+  it 'reopens a file whose sketches were saved on close' do
+    script = (1..100).map { |i| "insert #{i} u#{i} e#{i}@x.com" }
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "select where id = 57",
+      "select approx_count_distinct(username)",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (57, u57, e57@x.com)",
+      "Executed.",
+      "db > (96)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'samples distinct random rows' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += [
+      "select id sample 5",
+      "select id sample 50",
+      "select count(*) sample 2",
+      "explain select sample 3",
+      ".analyze",
+      "explain select sample 20",
+      ".exit",
+    ]
+    result = run_script(script)
+    sampled = result.drop(30)
+    small = sampled.take_while { |line| line != "Executed." }
+    ids = small.map { |line| line.delete("db>() ").to_i }
+    expect(ids.uniq.size).to eq(5)
+    expect((ids - (1..30).to_a)).to eq([])
+    everything = sampled.drop(small.size + 1).take_while { |line| line != "Executed." }
+    expect(everything.map { |line| line.delete("db>() ").to_i }.sort).to eq((1..30).to_a)
+    expect(result.count("db > Syntax error. Could not parse statement.")).to eq(1)
+    expect(result.count("db > plan: sample 3 rows by random descents, full scan if they keep repeating rows")).to eq(1)
+    expect(result.count("db > plan: sample 20 rows by reservoir over a full scan, ~30 of 30 rows read, ~20 match")).to eq(1)
+  end
+
+  it 'scans rows spread over several leaves to build an index' do
+    script = (1..60).map do |i|
+      "insert #{i} user#{i % 7} person#{i}@example.com"
+    end
+    script += [
+      "create index on username",
+      "select id where username = user3",
+      ".rebuild sketches",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result.drop(60)).to eq([
+      "db > Executed.",
+      "db > (3)",
+      "(10)",
+      "(17)",
+      "(24)",
+      "(31)",
+      "(38)",
+      "(45)",
+      "(52)",
+      "(59)",
+      "Executed.",
+      "db > sketches: rebuilt from 60 rows",
+      "db > ",
+    ])
+  end
+
+  it 'splits and merges a deep tree within the pinned frames' do
+    ids = (1..600).map { |i| i * 7 % 601 }
+    script = ids.map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "select count(*)"
+    script += ids.reverse.each_slice(2).map(&:first).map { |i| "delete #{i}" }
+    script += ["select count(*)", "select id where id = #{ids[0]}", ".exit"]
+    result = run_script(script)
+    expect(result.first(600).uniq).to eq(["db > Executed."])
+    expect(result[600..601]).to eq(["db > (600)", "Executed."])
+    expect(result.drop(602)).to eq(["db > Executed."] * 300 + [
+      "db > (300)",
+      "Executed.",
+      "db > (#{ids[0]})",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'counts the row bytes copied by inserts' do
+    script = [
+      "insert 2 bob bob@example.com",
+      "insert 1 alice alice@example.com",
+      "insert 3 'carol ann' carol@example.com",
+      "insert 3 carol carol@example.com",
+      ".stats inserts",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > inserts: 3 rows, 689.0 bytes copied/insert",
+      "db > (1, alice, alice@example.com)",
+      "(2, bob, bob@example.com)",
+      "(3, carol ann, carol@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'fails statements that would pass the memory limit' do
+    script = [
+      "insert 2 bob bob@example.com",
+      "insert 1 alice alice@example.com",
+      ".set memory_limit 100000",
+      "select id order by username",
+      "select where id = 2",
+      ".memory",
+      ".set memory_limit 0",
+      "select id order by username",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[0..4]).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > db > Error: Out of memory.",
+      "db > (2, bob, bob@example.com)",
+      "Executed.",
+    ])
+    expect(result[5]).to match(/\Adb > memory: \d+ bytes, peak \d+, limit 100000\z/)
+    expect(result[12..15]).to eq([
+      "  sort: 0 bytes, peak 0",
+      "  group: 0 bytes, peak 0",
+      "  scratch: 0 bytes, peak 0",
+      "caches shed 3 times, 3 allocations refused",
+    ])
+    expect(result[-4..]).to eq([
+      "db > db > (1)",
+      "(2)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'deletes rows and rebuilds the key filter under a tight memory limit' do
+    script = (1..40).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "delete 1"
+    script << ".set memory_limit 100000"
+    script += (2..14).map { |i| "delete #{i}" }
+    script += [
+      "select id where id = 15",
+      "select id where id = 1",
+      ".memory",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[40..56]).to eq(
+      ["db > Executed.", "db > db > Executed."] + ["db > Executed."] * 12 + [
+        "db > (15)",
+        "Executed.",
+        "db > Executed.",
+      ]
+    )
+    expect(result[57]).to match(/\Adb > memory: \d+ bytes, peak \d+, limit 100000\z/)
+    expect(result[-2]).to eq("caches shed 1 times, 1 allocations refused")
+  end
+
+  it 'reports pager hits, file traffic and frame residency' do
+    script = [
+      "insert 1 alice alice@example.com",
+      "insert 2 bob bob@example.com",
+      "select id",
+      ".stats pager",
+      ".stats pager json",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1)",
+      "(2)",
+      "Executed.",
+      "db > pager: 12 hits, 1 misses, 92.3% hit rate",
+      "file: 0 reads, 0 evictions, 0 write-backs",
+      "frames: 1 of 10 loaded (0 internal, 1 leaf, 0 other), 0 pinned, 0 left pinned by the last statement",
+      "free pages: 0",
+      "db > {\"hits\": 12, \"misses\": 1, \"reads\": 0, \"evictions\": 0, \"write_backs\": 0, " \
+        "\"frames\": 10, \"loaded\": 1, \"internal\": 0, \"leaf\": 1, \"other\": 0, " \
+        "\"pinned\": 0, \"stale_pins\": 0, \"free_pages\": 0}",
+      "db > ",
+    ])
+  end
+
+  it 'keeps latency histograms for statements and tree changes' do
+    script = (1..40).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += (1..4).map { |i| "delete #{i * 2}" }
+    script += [
+      "select id where id = 1",
+      ".stats latency",
+      ".stats latency reset",
+      ".stats latency",
+      ".exit",
+    ]
+    result = run_script(script)
+    stats = result.drop(46)
+    timing = 'p50 \\d+ ns, p99 \\d+ ns, p999 \\d+ ns, max \\d+ ns'
+    expect(stats[0]).to match(/\Adb > insert: 40 calls, 5 timed, #{timing}\z/)
+    expect(stats[1]).to match(/\Aselect: 1 calls, 1 timed, #{timing}\z/)
+    expect(stats[2]).to match(/\Adelete: 4 calls, 1 timed, #{timing}\z/)
+    expect(stats[3]).to match(/\Aleaf split: 4 calls, 4 timed, #{timing}\z/)
+    expect(stats[4]).to match(/\Ainternal split: 1 calls, 1 timed, #{timing}\z/)
+    expect(stats[5]).to match(/\Aleaf merge: 1 calls, 1 timed, #{timing}\z/)
+    expect(stats[6]).to match(/\Ainternal merge: 1 calls, 1 timed, #{timing}\z/)
+    expect(stats[7..9]).to eq([
+      "db > latency: reset",
+      "db > insert: 0 calls, 0 timed, p50 n/a, p99 n/a, p999 n/a, max n/a",
+      "select: 0 calls, 0 timed, p50 n/a, p99 n/a, p999 n/a, max n/a",
+    ])
+    expect(stats.length).to eq(16)
+  end
+end